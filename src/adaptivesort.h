@@ -0,0 +1,61 @@
+#ifndef ADAPTIVE_SORT_H
+#define ADAPTIVE_SORT_H
+
+#include <radixsort.h>
+#include <merge.h>
+#include <vector>
+
+
+// Number of positions i at which keys[i] < keys[i - 1]. Zero means the keys
+// are sorted.
+template <typename Key>
+int CountDescents(const Key* keys, int n) {
+  int descents = 0;
+  for (int i = 1; i < n; ++i) {
+    descents += keys[i] < keys[i - 1];
+  }
+  return descents;
+}
+
+// Sorts keys and values together when only few keys are out of order.
+//
+// A single scan splits the input into a sorted subsequence and a list of
+// displaced pairs: whenever a key is smaller than the last key kept so far,
+// both it and the last kept pair are moved to the displaced list. Every
+// descent therefore displaces at most two pairs, and a single far-away
+// outlier doesn't drag all following pairs along. The displaced pairs are
+// radix sorted and then merged with the sorted subsequence in linear time.
+//
+// keys_in and values_in are not modified. keys and values are resized to n.
+template <typename Key, typename Value>
+void MergeNearlySortedPairs(const Key* keys_in, const Value* values_in,
+    int n, int num_bits, std::vector<Key>* keys, std::vector<Value>* values) {
+  std::vector<Key> kept_keys;
+  std::vector<Value> kept_values;
+  std::vector<Key> displaced_keys;
+  std::vector<Value> displaced_values;
+  kept_keys.reserve(n);
+  kept_values.reserve(n);
+  for (int i = 0; i < n; ++i) {
+    if (!kept_keys.empty() && keys_in[i] < kept_keys.back()) {
+      displaced_keys.push_back(kept_keys.back());
+      displaced_values.push_back(kept_values.back());
+      kept_keys.pop_back();
+      kept_values.pop_back();
+      displaced_keys.push_back(keys_in[i]);
+      displaced_values.push_back(values_in[i]);
+    } else {
+      kept_keys.push_back(keys_in[i]);
+      kept_values.push_back(values_in[i]);
+    }
+  }
+  RadixSortPairs(&displaced_keys, &displaced_values, num_bits);
+
+  keys->resize(n);
+  values->resize(n);
+  MergeSortedPairs(kept_keys.data(), kept_values.data(), kept_keys.size(),
+      displaced_keys.data(), displaced_values.data(), displaced_keys.size(),
+      keys->data(), values->data());
+}
+
+#endif
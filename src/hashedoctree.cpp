@@ -1,34 +1,56 @@
 #include <hashedoctree.h>
 #include <helpers.h>
+#include <keykernels.h>
+#include <radixsort.h>
+#include <adaptivesort.h>
+#include <merge.h>
 #include <cmath>
 #include <cassert>
 #include <iostream>
 #include <algorithm>
 #include <numeric>
+#include <bitset>
+#include <new>
+#ifdef HOT_HAVE_TBB
+#include <tbb/scalable_allocator.h>
+#endif
 
 
 static void HOTNodeComputePartitionPointers(
     const HOTKey* key_begin, const HOTKey* key_end, const HOTNodeKey* child_keys,
     const HOTKey** partition_ptrs);
 
-// We use 32 bit keys. That is large enough for 2**10 buckets
-// along each dimension.
-static const int BITS_PER_DIM = 10;
-static const HOTKey NUM_LEAF_BUCKETS = 1u << BITS_PER_DIM;
+static const HOTKey NUM_LEAF_BUCKETS = HOTKey(1) << HOT_BITS_PER_DIM;
+// Maximum number of items in leaf nodes. This can be a configurable
+// parameter, but for now I just hardwire it.
+static const size_t MAX_NUM_LEAF_ITEMS = 32;
+static const int MAX_LEVELS = HOT_BITS_PER_DIM;
 
+// The vector kernels in keykernels.cpp use the same operations for
+// locations inside of [min, max] and need to be kept in sync. Locations on
+// the upper face belong to the last bucket, only locations outside of the
+// interval are folded back into it.
 static HOTKey ComputeBucket(double min, double max, double pos, HOTKey num_buckets) {
   assert(max > min);
-  double folded_pos = std::fmod(pos - min, max - min);
-  if (folded_pos < 0) {
-    folded_pos += max - min;
+  double width = max - min;
+  double offset = pos - min;
+  // Rounding is monotonic, so offsets of locations in [min, max] are in
+  // [0, width].
+  if (!(pos >= min && pos <= max)) {
+    offset = std::fmod(offset, width);
+    if (offset < 0) {
+      offset += width;
+    }
   }
-  int bucket = num_buckets * folded_pos / (max - min);
-  assert(bucket >= 0);
-  assert((uint32_t)bucket < num_buckets);
-  return bucket;
+  // Offsets at width and rounding put locations into the bucket past the end.
+  HOTKey bucket = offset * (num_buckets / width);
+  return std::min(bucket, num_buckets - 1);
 }
 
 
+// Only the encoding matching the key width is defined to avoid unused static
+// function warnings.
+#if !defined(HOT_USE_64BIT_KEYS)
 static uint32_t Part1By2_32(uint32_t a) {
   a &= 0x000003ff;                  // a = ---- ---- ---- ---- ---- --98 7654 3210
   a = (a ^ (a << 16)) & 0xff0000ff; // a = ---- --98 ---- ---- ---- ---- 7654 3210
@@ -41,11 +63,9 @@ static uint32_t Part1By2_32(uint32_t a) {
 static uint32_t MortonEncode_32(uint32_t a, uint32_t b, uint32_t c) {
   return Part1By2_32(a) + (Part1By2_32(b) << 1) + (Part1By2_32(c) << 2);
 }
-
-#if defined(USE_64BIT_KEYS)
-// Define these only for 64 bit keys to avoid unused static function warning.
+#else
 static uint64_t Part1By2_64(uint32_t x) {
-  uint64_t a = x & 0x1fffff; 
+  uint64_t a = x & 0x1fffff;
   a = (a | a << 32) & 0x1f00000000ffff;
   a = (a | a << 16) & 0x1f0000ff0000ff;
   a = (a | a << 8) & 0x100f00f00f00f00f;
@@ -59,20 +79,154 @@ static uint64_t MortonEncode_64(uint32_t a, uint32_t b, uint32_t c) {
 }
 #endif
 
+static HOTKey MortonEncode(HOTKey a, HOTKey b, HOTKey c) {
+#if defined(HOT_USE_64BIT_KEYS)
+  return MortonEncode_64(a, b, c);
+#else
+  return MortonEncode_32(a, b, c);
+#endif
+}
+
 HOTKey HOTComputeHash(HOTBoundingBox bbox, HOTPoint point) {
   HOTKey a, b, c;
   a = ComputeBucket(bbox.min.x, bbox.max.x, point.x, NUM_LEAF_BUCKETS);
   b = ComputeBucket(bbox.min.y, bbox.max.y, point.y, NUM_LEAF_BUCKETS);
   c = ComputeBucket(bbox.min.z, bbox.max.z, point.z, NUM_LEAF_BUCKETS);
-  return MortonEncode_32(a, b, c);
+  return MortonEncode(a, b, c);
+}
+
+
+static const HOTCurve& HOTMortonCurve() {
+  struct MortonCurve : HOTCurve {
+    MortonCurve() : HOTCurve() {
+      for (int i = 0; i < 8; ++i) {
+        octant[0][i] = i;
+        digit[0][i] = i;
+      }
+    }
+  };
+  static const MortonCurve curve;
+  return curve;
+}
+
+// The states of the Hilbert curve are the entry corner e and the main
+// direction d of the curve through a node, see Hamilton, "Compact Hilbert
+// Indices", 2006. Of the 24 combinations 12 are reachable from the root.
+static const HOTCurve& HOTHilbertCurve() {
+  struct HilbertCurve : HOTCurve {
+    HilbertCurve() : HOTCurve() {
+      auto rotate_right = [](int x, int r) {
+        r %= 3;
+        return ((x >> r) | (x << (3 - r))) & 7;
+      };
+      auto gray_code = [](int i) { return i ^ (i >> 1); };
+      auto inverse_gray_code = [](int g) { return g ^ (g >> 1) ^ (g >> 2); };
+      // Entry corner and main direction of the sub curve through the
+      // octant with digit i relative to the parent's curve.
+      auto entry = [&](int i) {
+        return i == 0 ? 0 : gray_code(2 * ((i - 1) / 2));
+      };
+      auto direction = [](int i) {
+        if (i == 0) return 0;
+        int j = i % 2 == 0 ? i - 1 : i;
+        int trailing_ones = 0;
+        while (j & 1) {
+          ++trailing_ones;
+          j >>= 1;
+        }
+        return trailing_ones % 3;
+      };
+      int entries[MAX_STATES] = {0};
+      int directions[MAX_STATES] = {0};
+      int num_states = 1;
+      for (int s = 0; s < num_states; ++s) {
+        int e = entries[s];
+        int d = directions[s];
+        for (int o = 0; o < 8; ++o) {
+          int i = inverse_gray_code(rotate_right(o ^ e, d + 1));
+          int child_e = e ^ rotate_right(entry(i), 3 - (d + 1) % 3);
+          int child_d = (d + direction(i) + 1) % 3;
+          int t = 0;
+          while (t < num_states &&
+              (entries[t] != child_e || directions[t] != child_d)) {
+            ++t;
+          }
+          if (t == num_states) {
+            assert(num_states < MAX_STATES);
+            entries[t] = child_e;
+            directions[t] = child_d;
+            ++num_states;
+          }
+          octant[s][i] = o;
+          digit[s][o] = i;
+          child_state[s][i] = t;
+        }
+      }
+      for (int s = 0; s < num_states; ++s) {
+        for (int o = 0; o < 64; ++o) {
+          int upper = digit[s][o >> 3];
+          int t = child_state[s][upper];
+          int lower = digit[t][o & 7];
+          two_levels[s][o] = (child_state[t][lower] << 6) | (upper << 3) | lower;
+        }
+      }
+    }
+  };
+  static const HilbertCurve curve;
+  return curve;
+}
+
+const HOTCurve& HOTCurveOf(HOTKeyOrder order) {
+  return order == HOTKeyOrder::HILBERT ? HOTHilbertCurve() : HOTMortonCurve();
+}
+
+void HOTMortonToHilbert(HOTKey* keys, size_t n) {
+  const HOTCurve& curve = HOTHilbertCurve();
+  for (size_t i = 0; i < n; ++i) {
+    HOTKey morton = keys[i];
+    HOTKey hilbert = 0;
+    int state = 0;
+    int level = HOT_BITS_PER_DIM;
+    if (level % 2 == 1) {
+      --level;
+      int d = curve.digit[0][morton >> (3 * level)];
+      hilbert = d;
+      state = curve.child_state[0][d];
+    }
+    while (level > 0) {
+      level -= 2;
+      int entry = curve.two_levels[state][(morton >> (3 * level)) & 63];
+      hilbert = (hilbert << 6) | (entry & 63);
+      state = entry >> 6;
+    }
+    keys[i] = hilbert;
+  }
+}
+
+HOTKey HOTComputeHilbertHash(HOTBoundingBox bbox, HOTPoint point) {
+  HOTKey key = HOTComputeHash(bbox, point);
+  HOTMortonToHilbert(&key, 1);
+  return key;
 }
 
 static std::vector<HOTKey> HOTComputeItemKeys(HOTBoundingBox bbox,
-    const HOTItem* begin, const HOTItem* end) {
+    HOTKeyOrder order, HOTDomainMode mode, const HOTItem* begin,
+    const HOTItem* end, size_t* num_outside) {
   int n = std::distance(begin, end);
   std::vector<HOTKey> keys(n);
-  for (int i = 0; i < n; ++i) {
-    keys[i] = HOTComputeHash(bbox, begin[i].position);
+  *num_outside = 0;
+  if (n > 0) {
+    int stride = sizeof(HOTItem) / sizeof(double);
+    if (mode == HOTDomainMode::CLAMPED) {
+      *num_outside = HOTComputeManyClampedHashes(bbox, &begin->position.x, n,
+          stride, &keys[0]);
+    } else {
+      *num_outside = HOTComputeManyHashes(bbox, &begin->position.x, n,
+          stride, &keys[0]);
+    }
+    if (order == HOTKeyOrder::HILBERT) {
+      HOTMortonToHilbert(&keys[0], n);
+    }
   }
   return keys;
 }
@@ -87,10 +241,9 @@ static std::vector<int> find_sort_permutation(const std::vector<HOTKey>& keys) {
 
 template <typename T>
 static std::vector<T> permute(const std::vector<int>& permutation,
-    const std::vector<T>& v) {
-  assert(permutation.size() == v.size());
-  std::vector<T> permuted_v(v.size());
-  int n = v.size();
+    const T* v) {
+  std::vector<T> permuted_v(permutation.size());
+  int n = permutation.size();
   for (int i = 0; i < n; ++i) {
     permuted_v[i] = v[permutation[i]];
   }
@@ -111,152 +264,496 @@ HOTBoundingBox ComputeChildBox(HOTBoundingBox bbox, int octant) {
       });
 }
 
+// Appends (digit, q) to pairs for the children of a node that can contain
+// points within eps of position. The children of the node share the corner
+// split, the node numbers its octants by state of curve, and has children
+// for the digits set in occupancy.
+static void HOTOverlappingChildren(const HOTCurve& curve, int state,
+    unsigned occupancy, const HOTPoint& split, const HOTPoint& position,
+    double eps, int q, std::vector<std::pair<int, int>>* pairs) {
+  unsigned near = HOTNearOctants(split, position, eps);
+  while (near) {
+    int octant = __builtin_ctz(near);
+    near &= near - 1;
+    int digit = curve.digit[state][octant];
+    if (occupancy & (1u << digit)) {
+      pairs->push_back(std::make_pair(digit, q));
+    }
+  }
+}
+
+// BoxDistance in Metric of position from the octants (see ComputeChildBox)
+// of a node with bounding box bbox whose children share the corner split.
+// Like HOTNearOctants this never touches the children.
+template <HOTMetric Metric>
+static inline void HOTOctantDistances(const HOTBoundingBox& bbox,
+    const HOTPoint& split, const HOTPoint& position, double distances[8]) {
+  double dx[2] = {DistanceFromInterval(bbox.min.x, split.x, position.x),
+    DistanceFromInterval(split.x, bbox.max.x, position.x)};
+  double dy[2] = {DistanceFromInterval(bbox.min.y, split.y, position.y),
+    DistanceFromInterval(split.y, bbox.max.y, position.y)};
+  double dz[2] = {DistanceFromInterval(bbox.min.z, split.z, position.z),
+    DistanceFromInterval(split.z, bbox.max.z, position.z)};
+  for (int octant = 0; octant < 8; ++octant) {
+    distances[octant] = AxisDistancesInMetric<Metric>(dx[octant & 1],
+        dy[(octant >> 1) & 1], dz[octant >> 2]);
+  }
+}
+
+// Size of the cells on the given level of a tree with bounding box bbox.
+static HOTPoint HOTCellSize(const HOTBoundingBox& bbox, int level) {
+  double scale = 1.0 / (HOTKey(1) << level);
+  return HOTPoint({scale * (bbox.max.x - bbox.min.x),
+      scale * (bbox.max.y - bbox.min.y), scale * (bbox.max.z - bbox.min.z)});
+}
+
+// Cell of the node with the given key.
+HOTCell HOTNodeCell(HOTNodeKey key, HOTKeyOrder order) {
+  const HOTCurve& curve = HOTCurveOf(order);
+  HOTCell cell{0, 0, 0};
+  int state = 0;
+  for (int l = HOTNodeLevel(key) - 1; l >= 0; --l) {
+    int digit = (key >> (3 * l)) & 7;
+    cell = HOTChildCell(cell, curve.octant[state][digit]);
+    state = curve.child_state[state][digit];
+  }
+  return cell;
+}
+
+HOTBoundingBox HOTNodeBoundingBox(HOTBoundingBox bbox, HOTNodeKey key,
+    HOTKeyOrder order) {
+  return HOTCellBox(bbox, HOTCellSize(bbox, HOTNodeLevel(key)),
+      HOTNodeCell(key, order));
+}
+
 // Convert a triple of binary digits into an integer.
 // i, j, and k should be either 0 or 1.
 static int from_binary_digits(int i, int j, int k) {
   return (i << 2) + (j << 1) + (k << 0);
 }
 
-class HOTNode {
-  public:
-    HOTNode(HOTNodeKey key, HOTBoundingBox bbox, const HOTKey* key_begin, const
-        HOTKey* key_end, HOTItem* items_begin) :
-      key_(key), bbox_(bbox), children_{nullptr},
-      key_begin_(key_begin), key_end_(key_end), items_begin_(items_begin)
-    {
-      // Maximum number of items in leaf nodes. This can be a configurable
-      // parameter, but for now I just hardwire it.
-      static const int MAX_NUM_ITEMS = 32;
-      static const int MAX_LEVELS = BITS_PER_DIM;
-      if (HOTNodeLevel(key_) < MAX_LEVELS && NumItems() > MAX_NUM_ITEMS) {
-        // Build the octants.
-        HOTNodeKey child_keys[8];
-        HOTNodeComputeChildKeys(key_, child_keys);
-        const HOTKey* partition_ptrs[9];
-        HOTNodeComputePartitionPointers(key_begin, key_end, child_keys, partition_ptrs);
-        for (int octant = 0; octant < 8; ++octant) {
-          const HOTKey* begin = partition_ptrs[octant];
-          const HOTKey* end = partition_ptrs[octant + 1];
-          int num_child_items = std::distance(begin, end);
-          if (num_child_items > 0) {
-            children_[octant].reset(
-                new HOTNode(child_keys[octant], 
-                  ComputeChildBox(bbox_, octant),
-                  begin, end, items_begin_ + std::distance(key_begin_, begin)));
-          } else {
-            children_[octant].reset(nullptr);
-          }
-        }
-      }
-    }
+template <typename Box>
+HOTBasicNode<Box>::HOTBasicNode(const HOTTree* tree, HOTNodeKey key,
+    int state, const Box& box,
+    const HOTKey* key_begin, const HOTKey* key_end, HOTItem* items_begin) :
+  Box(box), key_(key), state_(state), children_{nullptr},
+  key_begin_(key_begin), key_end_(key_end), items_begin_(items_begin)
+{
+  Refine(tree);
+}
 
-    bool VisitNearVertices(
-        HOTTree::VertexVisitor* visitor,
-        HOTKey visitor_key,
-        HOTPoint visitor_position,
-        double eps) {
-      int my_level = HOTNodeLevel(key_);
-      int visitor_octant = (visitor_key >> (3 * (BITS_PER_DIM - (my_level + 1)))) & 0x07u;
-      HOTNode* selected_child = children_[visitor_octant].get();
-      if (selected_child &&
-          DistanceFromBoundary(selected_child->bbox_, visitor_position) > eps) {
-        // Most common case: We need to recurse and the item is not near the
-        // surface of the child node.
-        return selected_child->VisitNearVertices(
-            visitor, visitor_key, visitor_position, eps);
-      }
-      // Otherwise this is either a leaf node or we are near the boundary.
-      bool leaf = true;
-      for (int i = 0; i < 8; ++i) {
-        if (children_[i]) {
-          leaf = false;
-          if (LInfinity(children_[i]->bbox_, visitor_position) < eps) {
-            if (!children_[i]->VisitNearVertices(
-                  visitor, visitor_key, visitor_position, eps)) {
-              return false;
-            }
-          }
-        }
+#ifdef HOT_HAVE_TBB
+template <typename Box>
+void* HOTBasicNode<Box>::operator new(size_t size) {
+  void* p = scalable_malloc(size);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+template <typename Box>
+void HOTBasicNode<Box>::operator delete(void* p) {
+  scalable_free(p);
+}
+#endif
+
+template <typename Box>
+void HOTBasicNode<Box>::Update(const HOTTree* tree, const HOTKey* old_keys,
+    const HOTKey* new_keys, HOTItem* new_items,
+    const HOTKey* key_begin, const HOTKey* key_end) {
+  size_t n = std::distance(key_begin, key_end);
+  assert(n >= NumItems());
+  if (n == NumItems()) {
+    Relocate(old_keys, new_keys, new_items,
+        std::distance(new_keys, key_begin) -
+        std::distance(old_keys, key_begin_));
+    return;
+  }
+  bool leaf = IsLeaf();
+  key_begin_ = key_begin;
+  key_end_ = key_end;
+  items_begin_ = new_items + std::distance(new_keys, key_begin);
+  if (leaf) {
+    Refine(tree);
+    return;
+  }
+  HOTNodeKey child_keys[8];
+  HOTNodeComputeChildKeys(key_, child_keys);
+  const HOTKey* partition_ptrs[9];
+  HOTNodeComputePartitionPointers(key_begin_, key_end_, child_keys, partition_ptrs);
+  tree->BuildOctants(NumItems(), [&](int digit) {
+      const HOTKey* begin = partition_ptrs[digit];
+      const HOTKey* end = partition_ptrs[digit + 1];
+      if (children_[digit]) {
+        children_[digit]->Update(
+            tree, old_keys, new_keys, new_items, begin, end);
+      } else if (begin != end) {
+        BuildChild(tree, child_keys, digit, begin, end);
       }
-      if (!leaf) return true;
-      int n = std::distance(key_begin_, key_end_);
-      for (int i = 0; i < n; ++i) {
-        if (LInfinity(items_begin_[i].position, visitor_position) < eps) {
-           bool cont = visitor->Visit(&items_begin_[i]);
-           if (!cont) return false;
-        }
+    });
+}
+
+template <typename Box>
+template <HOTMetric Metric>
+void HOTBasicNode<Box>::SearchNearest(const HOTCurve& curve,
+    const HOTBoundingBox& bbox, const HOTPoint* cell_sizes, int level,
+    Place place, HOTPoint position, HOTNearestItems* nearest) {
+  struct Entry {
+    HOTBasicNode* node;
+    int level;
+    Place place;
+    double distance;
+  };
+  HOTTraversalStack<Entry, HOT_TRAVERSAL_STACK_SIZE> stack;
+  stack.Push(Entry{this, level, place, BoxDistance<Metric>(
+        BoundingBox(bbox, cell_sizes, level, place), position)});
+  while (!stack.Empty()) {
+    Entry entry = stack.Pop();
+    // The bound may have shrunk since the entry was pushed.
+    if (entry.distance >= nearest->Bound()) continue;
+    HOTBasicNode* node = entry.node;
+    if (node->IsLeaf()) {
+      nearest->Scan<Metric>(node->items_begin_,
+          node->items_begin_ + node->NumItems(), position);
+      continue;
+    }
+    double distances[8];
+    HOTOctantDistances<Metric>(
+        node->NodeBox(bbox, cell_sizes, entry.level, entry.place),
+        node->NodeSplit(bbox, cell_sizes, entry.level, entry.place),
+        position, distances);
+    Entry children[8];
+    int num_children = 0;
+    for (int digit = 0; digit < 8; ++digit) {
+      HOTBasicNode* child = node->children_[digit].get();
+      if (!child) continue;
+      int octant = curve.octant[node->state_][digit];
+      if (distances[octant] < nearest->Bound()) {
+        children[num_children++] = Entry{child, entry.level + 1,
+          Box::ChildPlace(entry.place, octant), distances[octant]};
       }
-      return true;
     }
+    // The farthest child is pushed first, so the nearest is popped
+    // first.
+    HOTSortFarthestFirst(children, num_children);
+    for (int i = 0; i < num_children; ++i) {
+      stack.Push(children[i]);
+    }
+  }
+}
 
-    size_t NumItems() const {
-      return std::distance(key_begin_, key_end_);
+template <typename Box>
+void HOTBasicNode<Box>::VisitNearVerticesBatch(const HOTCurve& curve,
+    const HOTBoundingBox& bbox, const HOTPoint* cell_sizes, int level,
+    Place place, HOTBatchTraversal* traversal, size_t first, size_t last) {
+  if (IsLeaf()) {
+    VisitItemsNearBatch(items_begin_, items_begin_ + NumItems(),
+        traversal, first, last);
+    return;
+  }
+  unsigned occupancy = 0;
+  for (int digit = 0; digit < 8; ++digit) {
+    if (children_[digit]) occupancy |= 1u << digit;
+  }
+  HOTPoint split = Box::NodeSplit(bbox, cell_sizes, level, place);
+  size_t offsets[9];
+  PartitionBatchQueries<8>(traversal, first, last,
+      [this, &curve, occupancy, &split, traversal](const HOTPoint& position,
+        int q, std::vector<std::pair<int, int>>* pairs) {
+        HOTOverlappingChildren(curve, state_, occupancy, split, position,
+            traversal->eps, q, pairs);
+      }, offsets);
+  for (int digit = 0; digit < 8; ++digit) {
+    if (offsets[digit + 1] > offsets[digit]) {
+      children_[digit]->VisitNearVerticesBatch(curve, bbox, cell_sizes,
+          level + 1, Box::ChildPlace(place, curve.octant[state_][digit]),
+          traversal, offsets[digit], offsets[digit + 1]);
     }
+  }
+  traversal->active.resize(offsets[0]);
+}
 
-    int NumNodes() const {
-      int num_nodes = 1;
-      for (int i = 0; i < 8; ++i) {
-        if (children_[i]) {
-          num_nodes += children_[i]->NumNodes();
-        }
-      }
-      return num_nodes;
+template <typename Box>
+void HOTBasicNode<Box>::AddToTable(
+    HOTNodeTable<HOTNodeKey, HOTBasicNode*>* table) {
+  table->Insert(key_, this);
+  for (int i = 0; i < 8; ++i) {
+    if (children_[i]) {
+      children_[i]->AddToTable(table);
     }
+  }
+}
 
-    int Depth() const {
-      int depth = 1;
-      for (int i = 0; i < 8; ++i) {
-        if (children_[i]) {
-          depth = std::max(depth, 1 + children_[i]->Depth());
-        }
-      }
-      return depth;
+template <typename Box>
+HOTNodeKey HOTBasicNode<Box>::LeafKey(HOTKey key) const {
+  int my_level = HOTNodeLevel(key_);
+  if (my_level < HOT_BITS_PER_DIM) {
+    int digit = (key >> (3 * (HOT_BITS_PER_DIM - (my_level + 1)))) & 0x07u;
+    if (children_[digit]) return children_[digit]->LeafKey(key);
+  }
+  return key_;
+}
+
+template <typename Box>
+int HOTBasicNode<Box>::NumNodes() const {
+  int num_nodes = 1;
+  for (int i = 0; i < 8; ++i) {
+    if (children_[i]) {
+      num_nodes += children_[i]->NumNodes();
     }
+  }
+  return num_nodes;
+}
 
-    void PrintNumItems(int indent) const {
-      HOTNodePrint(key_);
-      std::cout << " ";
-      for (int i = 0; i < indent; ++i) {
-        std::cout << ".";
-      }
-      std::cout << " ";
-      std::cout << NumItems() << "\n";
-      for (int i = 0; i < 8; ++i) {
-        if (children_[i]) {
-          children_[i]->PrintNumItems(indent + 1);
-        }
-      }
+template <typename Box>
+int HOTBasicNode<Box>::Depth() const {
+  int depth = 1;
+  for (int i = 0; i < 8; ++i) {
+    if (children_[i]) {
+      depth = std::max(depth, 1 + children_[i]->Depth());
     }
+  }
+  return depth;
+}
 
-    size_t Size() const {
-      size_t size = sizeof(*this);
-      for (int i = 0; i < 8; ++i) {
-        if (children_[i]) {
-          size += children_[i]->Size();
+template <typename Box>
+void HOTBasicNode<Box>::PrintNumItems(int indent) const {
+  HOTNodePrint(key_);
+  std::cout << " ";
+  for (int i = 0; i < indent; ++i) {
+    std::cout << ".";
+  }
+  std::cout << " ";
+  std::cout << NumItems() << "\n";
+  for (int i = 0; i < 8; ++i) {
+    if (children_[i]) {
+      children_[i]->PrintNumItems(indent + 1);
+    }
+  }
+}
+
+template <typename Box>
+size_t HOTBasicNode<Box>::Size() const {
+  size_t size = sizeof(*this);
+  for (int i = 0; i < 8; ++i) {
+    if (children_[i]) {
+      size += children_[i]->Size();
+    }
+  }
+  return size;
+}
+
+template <typename Box>
+void HOTBasicNode<Box>::Refine(const HOTTree* tree) {
+  if (HOTNodeLevel(key_) < MAX_LEVELS && NumItems() > MAX_NUM_LEAF_ITEMS) {
+    // Build the octants.
+    HOTNodeKey child_keys[8];
+    HOTNodeComputeChildKeys(key_, child_keys);
+    const HOTKey* partition_ptrs[9];
+    HOTNodeComputePartitionPointers(key_begin_, key_end_, child_keys, partition_ptrs);
+    tree->BuildOctants(NumItems(), [&](int digit) {
+        const HOTKey* begin = partition_ptrs[digit];
+        const HOTKey* end = partition_ptrs[digit + 1];
+        if (begin != end) {
+          BuildChild(tree, child_keys, digit, begin, end);
         }
-      }
-      return size;
+      });
+  }
+}
+
+template <typename Box>
+void HOTBasicNode<Box>::BuildChild(const HOTTree* tree,
+    const HOTNodeKey* child_keys, int digit, const HOTKey* begin,
+    const HOTKey* end) {
+  const HOTCurve& curve = HOTCurveOf(tree->key_order_);
+  children_[digit].reset(
+      new HOTBasicNode(tree, child_keys[digit],
+        curve.child_state[state_][digit],
+        Box::ChildBox(curve.octant[state_][digit]),
+        begin, end, items_begin_ + std::distance(key_begin_, begin)));
+}
+
+template <typename Box>
+void HOTBasicNode<Box>::Relocate(const HOTKey* old_keys,
+    const HOTKey* new_keys, HOTItem* new_items, std::ptrdiff_t shift) {
+  std::ptrdiff_t index = std::distance(old_keys, key_begin_) + shift;
+  size_t n = NumItems();
+  key_begin_ = new_keys + index;
+  key_end_ = key_begin_ + n;
+  items_begin_ = new_items + index;
+  for (int i = 0; i < 8; ++i) {
+    if (children_[i]) {
+      children_[i]->Relocate(old_keys, new_keys, new_items, shift);
     }
+  }
+}
 
-  private:
-    HOTNodeKey key_;
-    HOTBoundingBox bbox_;
-    std::unique_ptr<HOTNode> children_[8];
+template class HOTBasicNode<HOTStoredBox>;
+template class HOTBasicNode<HOTComputedBox>;
 
-    const HOTKey* key_begin_;
-    const HOTKey* key_end_;
-    HOTItem* items_begin_;
 
-    bool IsLeaf() const {
-      for (int i = 0; i < 8; ++i) {
-        if (children_[i]) return false;
+// Functions for the LINEAR node layout.
+
+// Creates the descendants of nodes[index]. All children of a node are
+// appended before any of them is refined.
+static void HOTLinearRefine(const HOTCurve& curve, const HOTKey* keys,
+    std::vector<HOTLinearNode>* nodes, uint32_t index) {
+  HOTLinearNode node = (*nodes)[index];
+  if (HOTNodeLevel(node.key) >= MAX_LEVELS ||
+      node.items_end - node.items_begin <= MAX_NUM_LEAF_ITEMS) {
+    return;
+  }
+  HOTNodeKey child_keys[8];
+  HOTNodeComputeChildKeys(node.key, child_keys);
+  const HOTKey* partition_ptrs[9];
+  HOTNodeComputePartitionPointers(keys + node.items_begin,
+      keys + node.items_end, child_keys, partition_ptrs);
+  uint32_t first_child = nodes->size();
+  uint8_t occupancy = 0;
+  for (int digit = 0; digit < 8; ++digit) {
+    if (partition_ptrs[digit] == partition_ptrs[digit + 1]) continue;
+    occupancy |= 1u << digit;
+    HOTLinearNode child = {child_keys[digit],
+      static_cast<uint32_t>(partition_ptrs[digit] - keys),
+      static_cast<uint32_t>(partition_ptrs[digit + 1] - keys),
+      0, 0, curve.child_state[node.state][digit]};
+    nodes->push_back(child);
+  }
+  (*nodes)[index].first_child = first_child;
+  (*nodes)[index].occupancy = occupancy;
+  uint32_t end_child = nodes->size();
+  for (uint32_t child = first_child; child < end_child; ++child) {
+    HOTLinearRefine(curve, keys, nodes, child);
+  }
+}
+
+// HOTNode::SearchNearest for the linear node index on the given level with
+// the given cell.
+template <HOTMetric Metric>
+static void HOTLinearSearchNearest(const HOTCurve& curve,
+    const HOTLinearNode* nodes, const HOTBoundingBox& bbox,
+    const HOTPoint* cell_sizes, int index, int level, HOTCell cell,
+    HOTItem* items, HOTPoint position, HOTNearestItems* nearest) {
+  struct Entry {
+    int index;
+    int level;
+    HOTCell cell;
+    double distance;
+  };
+  HOTTraversalStack<Entry, HOT_TRAVERSAL_STACK_SIZE> stack;
+  stack.Push(Entry{index, level, cell, BoxDistance<Metric>(
+        HOTCellBox(bbox, cell_sizes[level], cell), position)});
+  while (!stack.Empty()) {
+    Entry entry = stack.Pop();
+    if (entry.distance >= nearest->Bound()) continue;
+    const HOTLinearNode& node = nodes[entry.index];
+    if (!node.occupancy) {
+      nearest->Scan<Metric>(items + node.items_begin, items + node.items_end,
+          position);
+      continue;
+    }
+    double distances[8];
+    HOTOctantDistances<Metric>(
+        HOTCellBox(bbox, cell_sizes[entry.level], entry.cell),
+        HOTCellSplit(bbox, cell_sizes[entry.level + 1], entry.cell),
+        position, distances);
+    Entry children[8];
+    int num_children = 0;
+    for (int digit = 0; digit < 8; ++digit) {
+      if (!(node.occupancy & (1u << digit))) continue;
+      int octant = curve.octant[node.state][digit];
+      if (distances[octant] < nearest->Bound()) {
+        children[num_children++] = Entry{HOTLinearChild(node, digit),
+          entry.level + 1, HOTChildCell(entry.cell, octant),
+          distances[octant]};
       }
-      return true;
     }
-};
+    // Same order as in HOTNode::SearchNearest.
+    HOTSortFarthestFirst(children, num_children);
+    for (int i = 0; i < num_children; ++i) {
+      stack.Push(children[i]);
+    }
+  }
+}
+
+static void HOTLinearVisitNearVerticesBatch(const HOTCurve& curve,
+    const HOTLinearNode* nodes, const HOTBoundingBox& bbox,
+    const HOTPoint* cell_sizes, int index, int level, HOTCell cell,
+    HOTItem* items, HOTBatchTraversal* traversal, size_t first, size_t last) {
+  const HOTLinearNode& node = nodes[index];
+  if (!node.occupancy) {
+    VisitItemsNearBatch(items + node.items_begin, items + node.items_end,
+        traversal, first, last);
+    return;
+  }
+  HOTPoint split = HOTCellSplit(bbox, cell_sizes[level + 1], cell);
+  size_t offsets[9];
+  PartitionBatchQueries<8>(traversal, first, last,
+      [&curve, &node, &split, traversal](const HOTPoint& position, int q,
+        std::vector<std::pair<int, int>>* pairs) {
+        HOTOverlappingChildren(curve, node.state, node.occupancy, split,
+            position, traversal->eps, q, pairs);
+      }, offsets);
+  for (int digit = 0; digit < 8; ++digit) {
+    if (offsets[digit + 1] > offsets[digit]) {
+      HOTLinearVisitNearVerticesBatch(curve, nodes, bbox, cell_sizes,
+          HOTLinearChild(node, digit), level + 1,
+          HOTChildCell(cell, curve.octant[node.state][digit]), items,
+          traversal, offsets[digit], offsets[digit + 1]);
+    }
+  }
+  traversal->active.resize(offsets[0]);
+}
+
+static int HOTLinearDepth(const HOTLinearNode* nodes, int index) {
+  const HOTLinearNode& node = nodes[index];
+  int depth = 1;
+  int num_children = std::bitset<8>(node.occupancy).count();
+  for (int i = 0; i < num_children; ++i) {
+    depth = std::max(depth, 1 + HOTLinearDepth(nodes, node.first_child + i));
+  }
+  return depth;
+}
+
+static void HOTLinearPrintNumItems(const HOTLinearNode* nodes, int index,
+    int indent) {
+  const HOTLinearNode& node = nodes[index];
+  HOTNodePrint(node.key);
+  std::cout << " ";
+  for (int i = 0; i < indent; ++i) {
+    std::cout << ".";
+  }
+  std::cout << " ";
+  std::cout << node.items_end - node.items_begin << "\n";
+  int num_children = std::bitset<8>(node.occupancy).count();
+  for (int i = 0; i < num_children; ++i) {
+    HOTLinearPrintNumItems(nodes, node.first_child + i, indent + 1);
+  }
+}
 
+static HOTNodeKey HOTLinearLeafKey(const HOTLinearNode* nodes, HOTKey key) {
+  int index = 0;
+  while (true) {
+    const HOTLinearNode& node = nodes[index];
+    int level = HOTNodeLevel(node.key);
+    if (level == HOT_BITS_PER_DIM) return node.key;
+    int digit = (key >> (3 * (HOT_BITS_PER_DIM - (level + 1)))) & 0x07u;
+    if (!(node.occupancy & (1u << digit))) return node.key;
+    index = HOTLinearChild(node, digit);
+  }
+}
 
-HOTTree::HOTTree(HOTBoundingBox bbox) : bbox_(bbox) {}
+
+HOTTree::HOTTree(HOTBoundingBox bbox) :
+  bbox_(bbox), node_layout_(HOTNodeLayout::POINTER), use_node_table_(false),
+  sort_algorithm_(HOTSortAlgorithm::RADIX_SORT),
+  last_sort_path_(HOTSortPath::FULL_SORT),
+  domain_mode_(HOTDomainMode::OVERFLOW_LIST),
+  key_order_(HOTKeyOrder::MORTON), num_tombstones_(0),
+  max_tombstone_fraction_(0.25) {
+  for (int level = 0; level <= HOT_BITS_PER_DIM; ++level) {
+    cell_sizes_[level] = HOTCellSize(bbox_, level);
+  }
+}
 HOTTree::HOTTree(HOTTree&&) = default;
 HOTTree& HOTTree::operator=(HOTTree&& rhs) = default;
 HOTTree::~HOTTree() {}
@@ -264,49 +761,408 @@ HOTTree::~HOTTree() {}
 void HOTTree::InsertItems(const HOTItem* begin, const HOTItem* end) {
   if (begin == end) return;
 
-  std::vector<HOTItem> new_items(begin, end);
-  std::vector<HOTKey> new_keys = HOTComputeItemKeys(bbox_, begin, end);
+  size_t num_outside;
+  std::vector<HOTKey> new_keys = ComputeItemKeys(begin, end, &num_outside);
+  std::vector<HOTItem> prepared_items;
+  // The CLAMPED keys already put the items outside of bbox_ onto its faces.
+  if (num_outside > 0 && domain_mode_ != HOTDomainMode::CLAMPED) {
+    // Only now that there are items outside of bbox_ do we pay for
+    // preparing them. The items in the overflow list go last.
+    size_t n = std::distance(begin, end);
+    size_t num_inside;
+    begin = PrepareItems(bbox_, domain_mode_, begin, end, &prepared_items,
+        &num_inside);
+    end = begin + n;
+    new_keys = ComputeItemKeys(begin, begin + num_inside, &num_outside);
+    new_keys.resize(n, HOT_OVERFLOW_KEY);
+  }
+
+  // We now bring items and keys into the order defined by the hash.
+  std::vector<HOTItem> new_items;
+  if (sort_algorithm_ == HOTSortAlgorithm::ADAPTIVE_SORT) {
+    last_sort_path_ = SortNearlySortedItems(begin, end, &new_keys, &new_items);
+  } else {
+    SortItemsByKey(begin, end, &new_keys, &new_items);
+    last_sort_path_ = HOTSortPath::FULL_SORT;
+  }
+
+  if (keys_.empty()) {
+    keys_.swap(new_keys);
+    items_.swap(new_items);
+    RebuildNodes();
+    UpdatePositionArrays();
+    return;
+  }
+
+  // Merge the new items into the existing ones and only rebuild the parts
+  // of the tree that received new items.
+  std::vector<HOTKey> merged_keys(keys_.size() + new_keys.size());
+  std::vector<HOTItem> merged_items(merged_keys.size());
+  MergeItems(new_keys, new_items, &merged_keys[0], &merged_items[0]);
+  keys_.swap(merged_keys);
+  items_.swap(merged_items);
+  if (node_layout_ == HOTNodeLayout::LINEAR || (!root_ && !compact_root_)) {
+    // The linear nodes can't be updated in place, so all of them are
+    // rebuilt in a single pass over the merged keys.
+    // There is no root yet if all items were in the overflow list.
+    RebuildNodes();
+    UpdatePositionArrays();
+    return;
+  }
+  // merged_keys now holds the old keys that the nodes still point into.
+  if (root_) {
+    root_->Update(this, &merged_keys[0], &keys_[0], &items_[0],
+        &keys_[0], &keys_[0] + OverflowBegin());
+  } else {
+    compact_root_->Update(this, &merged_keys[0], &keys_[0], &items_[0],
+        &keys_[0], &keys_[0] + OverflowBegin());
+  }
+  RebuildNodeTable();
+  UpdatePositionArrays();
+}
 
-  // We now bring items and keys into the order defined by the hash. We first
-  // find the permutation needed for the reordering and then we apply the
-  // permutation out-of-place to items and keys. Note that there is potential
-  // for reasonably efficient parallelization here. We can statically partition
-  // the keys, sort each partition in parallel, and then merge.
-  std::vector<int> sort_permutation = find_sort_permutation(new_keys);
-  new_keys = permute(sort_permutation, new_keys);
-  new_items = permute(sort_permutation, new_items);
+int HOTTree::RemoveItems(const HOTItem* begin, const HOTItem* end) {
+  int num_removed = 0;
+  for (const HOTItem* item = begin; item != end; ++item) {
+    std::ptrdiff_t i = FindItem(*item);
+    if (i < 0) continue;
+    items_[i] = HOTTombstone();
+    UpdatePositionArrays(i, i + 1);
+    ++num_tombstones_;
+    ++num_removed;
+  }
+  CompactIfNeeded();
+  return num_removed;
+}
 
-  // TODO: Merge the new keys and items with keys and items we already have.
-  // For now we just clobber the existing keys and items. That resets the tree
-  // with each InsertItems.
-  keys_ = new_keys;
-  items_ = new_items;
+int HOTTree::UpdatePositions(const HOTItem* begin, const HOTItem* end,
+    const HOTPoint* new_positions) {
+  int num_found = 0;
+  std::vector<HOTItem> moved_items;
+  for (int k = 0; k < std::distance(begin, end); ++k) {
+    std::ptrdiff_t i = FindItem(begin[k]);
+    if (i < 0) continue;
+    ++num_found;
+    HOTItem item{StoredPosition(bbox_, domain_mode_, new_positions[k]),
+      begin[k].data};
+    HOTKey new_key = ItemKey(item.position);
+    bool stays;
+    if (keys_[i] == HOT_OVERFLOW_KEY || new_key == HOT_OVERFLOW_KEY) {
+      stays = new_key == keys_[i];
+    } else {
+      HOTNodeKey leaf = LeafKey(keys_[i]);
+      stays = HOTNodeBegin(leaf) <= new_key && new_key < HOTNodeEnd(leaf);
+    }
+    if (stays) {
+      // The item stays in its leaf or in the overflow list. We only need to
+      // move it within their range to keep the keys sorted.
+      std::ptrdiff_t j;
+      if (new_key < keys_[i]) {
+        j = std::distance(keys_.begin(),
+            std::upper_bound(keys_.begin(), keys_.begin() + i, new_key));
+        std::copy_backward(keys_.begin() + j, keys_.begin() + i,
+            keys_.begin() + i + 1);
+        std::copy_backward(items_.begin() + j, items_.begin() + i,
+            items_.begin() + i + 1);
+      } else {
+        j = std::distance(keys_.begin(),
+            std::upper_bound(keys_.begin() + i + 1, keys_.end(), new_key)) - 1;
+        std::copy(keys_.begin() + i + 1, keys_.begin() + j + 1,
+            keys_.begin() + i);
+        std::copy(items_.begin() + i + 1, items_.begin() + j + 1,
+            items_.begin() + i);
+      }
+      keys_[j] = new_key;
+      items_[j] = item;
+      UpdatePositionArrays(std::min(i, j), std::max(i, j) + 1);
+    } else {
+      items_[i] = HOTTombstone();
+      ++num_tombstones_;
+      moved_items.push_back(item);
+    }
+  }
+  if (!moved_items.empty()) {
+    InsertItems(&moved_items[0], &moved_items[0] + moved_items.size());
+  }
+  CompactIfNeeded();
+  return num_found;
+}
 
+void HOTTree::Compact() {
+  if (num_tombstones_ == 0) return;
+  size_t n = 0;
+  for (size_t i = 0; i < items_.size(); ++i) {
+    if (HOTIsTombstone(items_[i])) continue;
+    keys_[n] = keys_[i];
+    items_[n] = items_[i];
+    ++n;
+  }
+  keys_.resize(n);
+  items_.resize(n);
+  num_tombstones_ = 0;
   RebuildNodes();
+  UpdatePositionArrays();
 }
 
-bool HOTTree::VisitNearVertices(
-    VertexVisitor* visitor, HOTPoint position, double eps) {
-  if (root_) {
-    HOTKey visitor_key = HOTComputeHash(bbox_, position);
-    if (LInfinity(bbox_, position) < eps) {
-      return root_->VisitNearVertices(visitor, visitor_key, position, eps);
+void HOTTree::SetMaxTombstoneFraction(double max_tombstone_fraction) {
+  max_tombstone_fraction_ = max_tombstone_fraction;
+}
+
+size_t HOTTree::NumTombstones() const {
+  return num_tombstones_;
+}
+
+std::ptrdiff_t HOTTree::FindItem(const HOTItem& item) const {
+  HOTItem stored{StoredPosition(bbox_, domain_mode_, item.position),
+    item.data};
+  HOTKey key = ItemKey(stored.position);
+  auto range = std::equal_range(keys_.begin(), keys_.end(), key);
+  for (auto k = range.first; k != range.second; ++k) {
+    std::ptrdiff_t i = std::distance(keys_.begin(), k);
+    if (HOTSameItem(items_[i], stored)) return i;
+  }
+  return -1;
+}
+
+HOTKey HOTTree::ItemKey(const HOTPoint& position) const {
+  if (domain_mode_ == HOTDomainMode::CLAMPED) {
+    return PositionKey(MoveIntoBox(bbox_, domain_mode_, position));
+  }
+  if (!InsideBox(bbox_, position)) return HOT_OVERFLOW_KEY;
+  return PositionKey(position);
+}
+
+HOTKey HOTTree::PositionKey(const HOTPoint& position) const {
+  if (key_order_ == HOTKeyOrder::HILBERT) {
+    return HOTComputeHilbertHash(bbox_, position);
+  }
+  return HOTComputeHash(bbox_, position);
+}
+
+size_t HOTTree::OverflowBegin() const {
+  if (keys_.empty() || keys_.back() != HOT_OVERFLOW_KEY) return keys_.size();
+  return std::distance(keys_.begin(),
+      std::lower_bound(keys_.begin(), keys_.end(), HOT_OVERFLOW_KEY));
+}
+
+void HOTTree::CompactIfNeeded() {
+  if (num_tombstones_ > max_tombstone_fraction_ * keys_.size()) {
+    Compact();
+  }
+}
+
+std::vector<HOTKey> HOTTree::ComputeItemKeys(
+    const HOTItem* begin, const HOTItem* end, size_t* num_outside) const {
+  return HOTComputeItemKeys(bbox_, key_order_, domain_mode_, begin, end,
+      num_outside);
+}
+
+void HOTTree::SortItemsByKey(const HOTItem* begin, const HOTItem* end,
+    std::vector<HOTKey>* keys, std::vector<HOTItem>* items) const {
+  switch (sort_algorithm_) {
+    case HOTSortAlgorithm::RADIX_SORT:
+    case HOTSortAlgorithm::ADAPTIVE_SORT:
+      items->assign(begin, end);
+      RadixSortPairs(keys, items, HOT_KEY_BITS);
+      break;
+    case HOTSortAlgorithm::COMPARISON_SORT: {
+      // We first find the permutation needed for the reordering and then we
+      // apply the permutation out-of-place to items and keys.
+      std::vector<int> sort_permutation = find_sort_permutation(*keys);
+      *keys = permute(sort_permutation, &(*keys)[0]);
+      *items = permute(sort_permutation, begin);
+      break;
     }
   }
-  return true;
+}
+
+void HOTTree::MergeItems(
+    const std::vector<HOTKey>& keys, const std::vector<HOTItem>& items,
+    HOTKey* merged_keys, HOTItem* merged_items) const {
+  MergeSortedPairs(&keys_[0], &items_[0], keys_.size(),
+      &keys[0], &items[0], keys.size(), merged_keys, merged_items);
+}
+
+HOTSortPath HOTTree::SortNearlySortedItems(
+    const HOTItem* begin, const HOTItem* end,
+    std::vector<HOTKey>* keys, std::vector<HOTItem>* items) const {
+  // Merging pays off as long as the displaced items are a small fraction
+  // of all items.
+  static const int MIN_ITEMS_PER_DESCENT = 16;
+  int n = std::distance(begin, end);
+  int descents = CountDescents(&(*keys)[0], n);
+  if (descents == 0) {
+    items->assign(begin, end);
+    return HOTSortPath::ALREADY_SORTED;
+  }
+  if (descents <= n / MIN_ITEMS_PER_DESCENT) {
+    std::vector<HOTKey> unsorted_keys;
+    unsorted_keys.swap(*keys);
+    MergeNearlySortedPairs(&unsorted_keys[0], begin, n, HOT_KEY_BITS,
+        keys, items);
+    return HOTSortPath::MERGE;
+  }
+  SortItemsByKey(begin, end, keys, items);
+  return HOTSortPath::FULL_SORT;
+}
+
+void HOTTree::SetSortAlgorithm(HOTSortAlgorithm sort_algorithm) {
+  sort_algorithm_ = sort_algorithm;
+}
+
+void HOTTree::SetNodeLayout(HOTNodeLayout node_layout) {
+  if (node_layout == node_layout_) return;
+  node_layout_ = node_layout;
+  RebuildNodes();
+}
+
+void HOTTree::SetUseNodeTable(bool use_node_table) {
+  if (use_node_table == use_node_table_) return;
+  use_node_table_ = use_node_table;
+  RebuildNodeTable();
+}
+
+HOTSortPath HOTTree::LastSortPath() const {
+  return last_sort_path_;
+}
+
+void HOTTree::SetDomainMode(HOTDomainMode domain_mode) {
+  assert(items_.empty());
+  domain_mode_ = domain_mode;
+}
+
+void HOTTree::SetKeyOrder(HOTKeyOrder key_order) {
+  assert(items_.empty());
+  key_order_ = key_order;
+}
+
+bool HOTTree::VisitNearItemRanges(
+    ItemRangeVisitor* visitor, HOTPoint position, double eps,
+    HOTMetric metric) {
+  return VisitNearRanges(visitor, position, eps, metric);
+}
+
+bool HOTTree::VisitNearVertices(VertexVisitor* visitor, HOTPoint position,
+    double eps) {
+  return VisitNear(position, eps, [visitor](HOTItem* item) {
+      return visitor->Visit(item);
+    });
+}
+
+bool HOTTree::VisitNearVertices(VertexVisitor* visitor, HOTPoint position,
+    double eps, HOTMetric metric) {
+  return VisitNear(position, eps, metric, [visitor](HOTItem* item) {
+      return visitor->Visit(item);
+    });
+}
+
+void HOTTree::VisitNearVerticesBatch(BatchVisitor* visitor,
+    const HOTPoint* points, int n, double eps, HOTMetric metric) {
+  HOTBatchTraversal traversal(visitor, n, eps, metric);
+  ExpandBatchQueries(bbox_, domain_mode_, points, n, eps, &traversal.queries);
+  if (traversal.queries.empty()) return;
+  // Queries next to each other in key order share most of their path.
+  std::vector<HOTKey> keys(traversal.queries.size());
+  for (size_t q = 0; q < keys.size(); ++q) {
+    keys[q] = PositionKey(traversal.queries[q].position);
+  }
+  if (CountDescents(&keys[0], keys.size()) > 0) {
+    RadixSortPairs(&keys, &traversal.queries, HOT_KEY_BITS);
+  }
+  size_t num_active = ActivateBatchQueries(bbox_, &traversal);
+  const HOTCurve& curve = HOTCurveOf(key_order_);
+  if (num_active > 0 && root_) {
+    root_->VisitNearVerticesBatch(curve, bbox_, cell_sizes_, 0,
+        HOTNode::Place(), &traversal, 0, num_active);
+  } else if (num_active > 0 && compact_root_) {
+    compact_root_->VisitNearVerticesBatch(curve, bbox_, cell_sizes_, 0,
+        HOTCompactNode::Place(), &traversal, 0, num_active);
+  } else if (num_active > 0 && !linear_nodes_.empty()) {
+    HOTLinearVisitNearVerticesBatch(curve, &linear_nodes_[0], bbox_,
+        cell_sizes_, 0, 0, HOTCell{0, 0, 0}, &items_[0], &traversal, 0,
+        num_active);
+  }
+  size_t overflow_begin = OverflowBegin();
+  if (overflow_begin < items_.size()) {
+    traversal.active.resize(traversal.queries.size());
+    std::iota(traversal.active.begin(), traversal.active.end(), 0);
+    VisitItemsNearBatch(&items_[0] + overflow_begin,
+        &items_[0] + items_.size(), &traversal, 0, traversal.active.size());
+  }
+}
+
+void HOTTree::KNearest(HOTPoint position, int k,
+    std::vector<HOTItem*>* nearest, HOTMetric metric) {
+  HOTNearestItems items(k);
+  switch (metric) {
+    case HOTMetric::L2:
+      SearchNearest<HOTMetric::L2>(position, &items);
+      break;
+    case HOTMetric::L1:
+      SearchNearest<HOTMetric::L1>(position, &items);
+      break;
+    case HOTMetric::LINFINITY:
+      SearchNearest<HOTMetric::LINFINITY>(position, &items);
+      break;
+  }
+  items.Extract(nearest);
+}
+
+template <HOTMetric Metric>
+void HOTTree::SearchNearest(HOTPoint position, HOTNearestItems* nearest) {
+  HOTItem* items = items_.empty() ? nullptr : &items_[0];
+  const HOTCurve& curve = HOTCurveOf(key_order_);
+  HOTSearchNearest<Metric>(bbox_, domain_mode_, position,
+      items_.size() - num_tombstones_,
+      items + OverflowBegin(), items + items_.size(),
+      [this, items, &curve](HOTPoint query, HOTNearestItems* nearest) {
+        if (root_) {
+          root_->SearchNearest<Metric>(curve, bbox_, cell_sizes_, 0,
+              HOTNode::Place(), query, nearest);
+        } else if (compact_root_) {
+          compact_root_->SearchNearest<Metric>(curve, bbox_, cell_sizes_, 0,
+              HOTCompactNode::Place(), query, nearest);
+        } else if (!linear_nodes_.empty()) {
+          HOTLinearSearchNearest<Metric>(curve, &linear_nodes_[0], bbox_,
+              cell_sizes_, 0, 0, HOTCell{0, 0, 0}, items, query, nearest);
+        }
+      }, nearest);
+}
+
+void HOTTree::KNearestOfItems(int k, std::vector<HOTItem*>* nearest,
+    HOTMetric metric) {
+  k = std::max(k, 0);
+  nearest->assign(items_.size() * k, nullptr);
+  // In tree order consecutive queries search mostly the same nodes.
+  QueryItemRanges(items_.size(),
+      [this, k, nearest, metric](size_t first, size_t last) {
+        std::vector<HOTItem*> item_nearest;
+        for (size_t i = first; i < last; ++i) {
+          if (HOTIsTombstone(items_[i])) continue;
+          KNearest(items_[i].position, k, &item_nearest, metric);
+          std::copy(item_nearest.begin(), item_nearest.end(),
+              nearest->begin() + i * k);
+        }
+      });
 }
 
 int HOTTree::NumNodes() const {
   if (root_) {
     return root_->NumNodes();
+  } else if (compact_root_) {
+    return compact_root_->NumNodes();
   } else {
-    return 0;
+    return linear_nodes_.size();
   }
 }
 
 int HOTTree::Depth() const {
   if (root_) {
     return root_->Depth();
+  } else if (compact_root_) {
+    return compact_root_->Depth();
+  } else if (!linear_nodes_.empty()) {
+    return HOTLinearDepth(&linear_nodes_[0], 0);
   } else {
     return 0;
   }
@@ -314,16 +1170,83 @@ int HOTTree::Depth() const {
 
 void HOTTree::PrintNumItems() const {
   if (root_) root_->PrintNumItems(0);
+  if (compact_root_) compact_root_->PrintNumItems(0);
+  if (!linear_nodes_.empty()) {
+    HOTLinearPrintNumItems(&linear_nodes_[0], 0, 0);
+  }
 }
 
 void HOTTree::RebuildNodes() {
-  if (keys_.size() == 0) {
-    root_.reset(nullptr);
+  root_.reset(nullptr);
+  compact_root_.reset(nullptr);
+  linear_nodes_.clear();
+  size_t num_inside = OverflowBegin();
+  if (num_inside == 0) {
     return;
   }
 
-  root_.reset(new HOTNode(
-        1, bbox_, &keys_[0], &keys_[0] + keys_.size(), &items_[0]));
+  switch (node_layout_) {
+    case HOTNodeLayout::POINTER:
+      root_.reset(new HOTNode(this, 1, 0, HOTStoredBox(bbox_),
+            &keys_[0], &keys_[0] + num_inside, &items_[0]));
+      break;
+    case HOTNodeLayout::COMPACT_POINTER:
+      compact_root_.reset(new HOTCompactNode(this, 1, 0, HOTComputedBox(),
+            &keys_[0], &keys_[0] + num_inside, &items_[0]));
+      break;
+    case HOTNodeLayout::LINEAR: {
+      assert(num_inside <= std::numeric_limits<uint32_t>::max());
+      HOTLinearNode root = {HOTNodeRoot(), 0,
+        static_cast<uint32_t>(num_inside), 0, 0, 0};
+      linear_nodes_.push_back(root);
+      HOTLinearRefine(HOTCurveOf(key_order_), &keys_[0], &linear_nodes_, 0);
+      break;
+    }
+  }
+  RebuildNodeTable();
+}
+
+void HOTTree::RebuildNodeTable() {
+  node_table_.Clear();
+  compact_node_table_.Clear();
+  linear_node_table_.Clear();
+  if (!use_node_table_) return;
+  if (root_) {
+    node_table_.Reset(root_->NumNodes());
+    root_->AddToTable(&node_table_);
+  }
+  if (compact_root_) {
+    compact_node_table_.Reset(compact_root_->NumNodes());
+    compact_root_->AddToTable(&compact_node_table_);
+  }
+  if (!linear_nodes_.empty()) {
+    linear_node_table_.Reset(linear_nodes_.size());
+    for (size_t i = 0; i < linear_nodes_.size(); ++i) {
+      linear_node_table_.Insert(linear_nodes_[i].key, i);
+    }
+  }
+}
+
+void HOTTree::BuildOctants(size_t,
+    const std::function<void(int)>& build_octant) const {
+  for (int octant = 0; octant < 8; ++octant) {
+    build_octant(octant);
+  }
+}
+
+void HOTTree::QueryItemRanges(size_t num_items,
+    const std::function<void(size_t, size_t)>& query) const {
+  query(0, num_items);
+}
+
+HOTNodeKey HOTTree::LeafKey(HOTKey key) const {
+  if (root_) {
+    return root_->LeafKey(key);
+  }
+  if (compact_root_) {
+    return compact_root_->LeafKey(key);
+  }
+  return HOTLinearLeafKey(&linear_nodes_[0], key);
 }
 
 size_t HOTTree::Size() const {
@@ -333,6 +1256,13 @@ size_t HOTTree::Size() const {
   if (root_) {
     size += root_->Size();
   }
+  if (compact_root_) {
+    size += compact_root_->Size();
+  }
+  size += linear_nodes_.size() * sizeof(HOTLinearNode);
+  size += node_table_.Size() + compact_node_table_.Size() +
+    linear_node_table_.Size();
+  size += 3 * positions_.x.size() * sizeof(double);
   return size;
 }
 
@@ -392,21 +1322,17 @@ HOTNodeKey HOTNodeRoot() {
 }
 
 bool HOTNodeValidKey(HOTNodeKey key) {
-  if (key & (1u << (BITS_PER_DIM * 3 + 1))) return false;
-  HOTNodeKey m = 1u << (BITS_PER_DIM * 3);
-  while (m > 0) {
-    if (key & m) return true;
-    for (int i = 0; i < 3; ++i, m >>= 1) {
-      if (key & m) return false;
-    }
-  }
-  return false;
+  if (key == 0) return false;
+  // Valid keys have their most significant bit at position 3 * level.
+  int msb = 0;
+  while (key >>= 1) ++msb;
+  return msb % 3 == 0 && msb / 3 <= HOT_BITS_PER_DIM;
 }
 
 int HOTNodeLevel(HOTNodeKey key) {
-  int level = BITS_PER_DIM;
+  int level = HOT_BITS_PER_DIM;
   while (level > 0) {
-    if (key & (1u << (level * 3))) return level;
+    if (key & (HOTNodeKey(1) << (level * 3))) return level;
     --level;
   }
   return level;
@@ -418,22 +1344,22 @@ HOTNodeKey HOTNodeParent(HOTNodeKey key) {
 
 HOTKey HOTNodeBegin(HOTNodeKey key) {
   int level = HOTNodeLevel(key);
-  HOTKey begin = key ^ (1u << (3 * level));
-  begin <<= 3 * (BITS_PER_DIM - level);
+  HOTKey begin = key ^ (HOTNodeKey(1) << (3 * level));
+  begin <<= 3 * (HOT_BITS_PER_DIM - level);
   return begin;
 }
 
 HOTKey HOTNodeEnd(HOTNodeKey key) {
   int level = HOTNodeLevel(key);
-  HOTKey end = key ^ (1u << (3 * level));
+  HOTKey end = key ^ (HOTNodeKey(1) << (3 * level));
   ++end;
-  end <<= 3 * (BITS_PER_DIM - level);
+  end <<= 3 * (HOT_BITS_PER_DIM - level);
   return end;
 }
 
 void HOTNodePrint(HOTNodeKey key) {
-  for (int i = 31; i >= 0; --i) {
-    if (key & (1u << i)) {
+  for (int i = 8 * sizeof(HOTNodeKey) - 1; i >= 0; --i) {
+    if (key & (HOTNodeKey(1) << i)) {
       std::cout << "1";
     } else {
       std::cout << "0";
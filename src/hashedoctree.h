@@ -2,6 +2,8 @@
 #define HASHED_OCTREE_H
 
 #include <spatialsorttree.h>
+#include <nodetable.h>
+#include <hot_config.h>
 
 #include <cstdint>
 #include <utility>
@@ -9,12 +11,40 @@
 #include <memory>
 #include <limits>
 #include <cmath>
+#include <functional>
 
 
+#ifdef HOT_USE_64BIT_KEYS
+// 64 bit keys are large enough for 2**21 buckets along each dimension.
+typedef uint64_t HOTKey;
+const int HOT_BITS_PER_DIM = 21;
+#else
+// 32 bit keys are large enough for 2**10 buckets along each dimension.
 typedef uint32_t HOTKey;
+const int HOT_BITS_PER_DIM = 10;
+#endif
+
+// Key of the items in the overflow list of the OVERFLOW_LIST domain mode.
+// It sorts behind the keys of all locations inside of the bounding box.
+const HOTKey HOT_OVERFLOW_KEY = HOTKey(1) << (3 * HOT_BITS_PER_DIM);
+// Number of significant bits of the keys including HOT_OVERFLOW_KEY.
+const int HOT_KEY_BITS = 3 * HOT_BITS_PER_DIM + 1;
+
+// Space filling curves along which the keys order the buckets. Every three
+// bits of a key select one of the eight octants of a node, so both orders
+// have the same nodes and only differ in how the octants are numbered.
+enum class HOTKeyOrder {
+  // Z-order. The octant is the interleaved bits of the bucket coordinates.
+  // Consecutive keys can be far apart in space at octant boundaries.
+  MORTON,
+  // Hilbert order. The numbering of the octants depends on the node, and
+  // consecutive buckets always share a face. Computing the keys takes an
+  // extra table lookup per two levels.
+  HILBERT
+};
 
 // Node keys are similar to the vertex keys.
-typedef uint32_t HOTNodeKey;
+typedef HOTKey HOTNodeKey;
 HOTNodeKey HOTNodeRoot();
 void HOTNodeComputeChildKeys(HOTNodeKey key, HOTNodeKey* child_keys);
 bool HOTNodeValidKey(HOTNodeKey key);
@@ -24,12 +54,78 @@ HOTKey HOTNodeBegin(HOTNodeKey key);
 HOTKey HOTNodeEnd(HOTNodeKey key);
 void HOTNodePrint(HOTNodeKey key);
 HOTBoundingBox ComputeChildBox(HOTBoundingBox bbox, int octant);
+// Bounding box of the node with the given key in a tree with bounding box
+// bbox.
+HOTBoundingBox HOTNodeBoundingBox(HOTBoundingBox bbox, HOTNodeKey key,
+    HOTKeyOrder order = HOTKeyOrder::MORTON);
 
 
 // This should become an internal function down the road.
 HOTKey HOTComputeHash(HOTBoundingBox bbox, HOTPoint point);
+// Like HOTComputeHash but in HOTKeyOrder::HILBERT.
+HOTKey HOTComputeHilbertHash(HOTBoundingBox bbox, HOTPoint point);
+// Replaces the n Morton keys at keys by the Hilbert keys of the same
+// buckets.
+void HOTMortonToHilbert(HOTKey* keys, size_t n);
 
-class HOTNode;
+// Algorithms available for bringing items into key order in
+// HOTTree::InsertItems.
+enum class HOTSortAlgorithm {
+  // Least significant digit radix sort that moves keys and items together.
+  RADIX_SORT,
+  // Comparison sort of an index permutation that is then applied to the
+  // keys and items.
+  COMPARISON_SORT,
+  // Checks whether the items are already in key order or only slightly out
+  // of order and handles these cases in linear time. Falls back to
+  // RADIX_SORT otherwise.
+  ADAPTIVE_SORT
+};
+
+// The way InsertItems brought the items into key order.
+enum class HOTSortPath {
+  ALREADY_SORTED,
+  MERGE,
+  FULL_SORT
+};
+
+// Storage of the nodes of a HOTTree.
+enum class HOTNodeLayout {
+  // Every node is a separate heap allocation that points to its children.
+  POINTER,
+  // All nodes are stored in a single array. The children of a node are
+  // stored next to each other, followed by the subtrees of these children
+  // in order. Siblings therefore come before their descendants, so the
+  // array is not in strict preorder. InsertItems on a non-empty tree
+  // rebuilds the whole array.
+  LINEAR,
+  // Like POINTER, but the nodes don't store their bounding boxes, which
+  // are a third of their size. Traversals compute the boxes from the cells
+  // of the nodes like for LINEAR, so single queries are somewhat slower.
+  COMPACT_POINTER
+};
+
+// Node of the LINEAR layout. Children are addressed by the index of the
+// first child and a mask of the occupied octants in key order. Item ranges
+// are indices into the keys and items of the tree, and bounding boxes are
+// computed from the tree's bounding box during traversal. state numbers the
+// octants of the node in the tree's HOTKeyOrder.
+struct HOTLinearNode {
+  HOTNodeKey key;
+  uint32_t items_begin;
+  uint32_t items_end;
+  uint32_t first_child;
+  uint8_t occupancy;
+  uint8_t state;
+};
+
+template <typename Box> class HOTBasicNode;
+class HOTStoredBox;
+class HOTComputedBox;
+// Nodes of the POINTER and COMPACT_POINTER layouts, see hashedoctreenode.h.
+typedef HOTBasicNode<HOTStoredBox> HOTNode;
+typedef HOTBasicNode<HOTComputedBox> HOTCompactNode;
+class HOTNearestItems;
 
 class HOTTree : public SpatialSortTree {
   public:
@@ -39,26 +135,172 @@ class HOTTree : public SpatialSortTree {
     ~HOTTree() override;
 
     void InsertItems(const HOTItem* begin, const HOTItem* end) override;
+    // Removes the items that match [begin, end) in position and data.
+    // Removed items are tombstoned in place (see HOTTombstone) and remain
+    // visible through begin() and end() until the tree is compacted.
+    // Returns the number of items that were found and removed.
+    int RemoveItems(const HOTItem* begin, const HOTItem* end);
+    // Moves the items that match [begin, end) to new_positions. Items that
+    // stay in their leaf are updated in place, the others are tombstoned and
+    // inserted again. Returns the number of items that were found.
+    int UpdatePositions(const HOTItem* begin, const HOTItem* end,
+        const HOTPoint* new_positions);
+    // Removes all tombstones and rebuilds the nodes.
+    void Compact();
+    // RemoveItems and UpdatePositions compact the tree once more than this
+    // fraction of the items are tombstones.
+    void SetMaxTombstoneFraction(double max_tombstone_fraction);
+    size_t NumTombstones() const;
 
-    bool VisitNearVertices(VertexVisitor* visitor, HOTPoint position, double eps2) override;
+    bool VisitNearItemRanges(ItemRangeVisitor* visitor, HOTPoint position,
+        double eps, HOTMetric metric = HOTMetric::LINFINITY) override;
+    // Like SpatialSortTree::VisitNear, but the node traversal is inlined
+    // together with visit, so there is no virtual call at all. Defined in
+    // hashedoctreenode.h.
+    template <typename Callable>
+    bool VisitNear(HOTPoint position, double eps, Callable visit);
+    template <typename Callable>
+    bool VisitNear(HOTPoint position, double eps, HOTMetric metric,
+        Callable visit);
+    bool VisitNearVertices(VertexVisitor* visitor, HOTPoint position,
+        double eps) override;
+    bool VisitNearVertices(VertexVisitor* visitor, HOTPoint position,
+        double eps, HOTMetric metric) override;
+    // Sorts the queries by key and traverses the nodes once for all of
+    // them. The node table isn't used.
+    void VisitNearVerticesBatch(BatchVisitor* visitor,
+        const HOTPoint* points, int n, double eps,
+        HOTMetric metric = HOTMetric::LINFINITY) override;
+    void KNearest(HOTPoint position, int k, std::vector<HOTItem*>* nearest,
+        HOTMetric metric = HOTMetric::L2) override;
+    // KNearest at the position of every item. The k nearest items of the
+    // i-th item in tree order are at [i * k, (i + 1) * k) of *nearest,
+    // padded with nullptr if the tree holds fewer than k items. They
+    // include the item itself. Tombstones have no nearest items.
+    void KNearestOfItems(int k, std::vector<HOTItem*>* nearest,
+        HOTMetric metric = HOTMetric::L2);
 
     std::vector<HOTItem>::iterator begin() override;
     std::vector<HOTItem>::iterator end() override;
 
+    void SetSortAlgorithm(HOTSortAlgorithm sort_algorithm);
+    // Changing the layout of a non-empty tree rebuilds its nodes. With the
+    // LINEAR layout every InsertItems into a non-empty tree costs a full
+    // rebuild of the nodes, so prefer POINTER for many small inserts.
+    void SetNodeLayout(HOTNodeLayout node_layout);
+    // With the node table enabled the tree keeps a hash table from node
+    // keys to nodes. Queries then find their starting node with a binary
+    // search over the levels instead of walking down from the root.
+    void SetUseNodeTable(bool use_node_table);
+    // Sort path taken by the most recent InsertItems.
+    HOTSortPath LastSortPath() const;
+    // How locations outside of the bounding box are handled. The default
+    // is OVERFLOW_LIST, see HOTDomainMode for how it differs from earlier
+    // versions. Can only be changed while the tree is empty.
+    void SetDomainMode(HOTDomainMode domain_mode);
+    // Order of the keys and thus of the items. The default is MORTON. Can
+    // only be changed while the tree is empty.
+    void SetKeyOrder(HOTKeyOrder key_order);
+
     // Some diagnostics;
     int NumNodes() const;
     int Depth() const;
     void PrintNumItems() const;
     size_t Size() const;
 
-  private:
+  protected:
+    template <typename Box> friend class HOTBasicNode;
+
     HOTBoundingBox bbox_;
+    // Size of the cells on each level. The nodes' bounding boxes are
+    // computed from them during traversal, see HOTNodeBoundingBox.
+    HOTPoint cell_sizes_[HOT_BITS_PER_DIM + 1];
     std::vector<HOTItem> items_;
     std::vector<HOTKey> keys_;
+    HOTNodeLayout node_layout_;
     std::unique_ptr<HOTNode> root_;
+    std::unique_ptr<HOTCompactNode> compact_root_;
+    std::vector<HOTLinearNode> linear_nodes_;
+    bool use_node_table_;
+    HOTNodeTable<HOTNodeKey, HOTNode*> node_table_;
+    HOTNodeTable<HOTNodeKey, HOTCompactNode*> compact_node_table_;
+    HOTNodeTable<HOTNodeKey, uint32_t> linear_node_table_;
+    HOTSortAlgorithm sort_algorithm_;
+    HOTSortPath last_sort_path_;
+    HOTDomainMode domain_mode_;
+    HOTKeyOrder key_order_;
+    size_t num_tombstones_;
+    double max_tombstone_fraction_;
+
+    // Key computation and sorting are the expensive phases of InsertItems.
+    // Derived trees can override them, e.g. with parallel implementations.
+    // ComputeItemKeys also stores the number of items outside of bbox_ in
+    // *num_outside. In the CLAMPED mode their keys are those of the nearest
+    // locations on bbox_.
+    virtual std::vector<HOTKey> ComputeItemKeys(
+        const HOTItem* begin, const HOTItem* end, size_t* num_outside) const;
+    // On entry keys holds the keys of the items in [begin, end). On exit
+    // keys is sorted and items holds the items in the same order.
+    virtual void SortItemsByKey(const HOTItem* begin, const HOTItem* end,
+        std::vector<HOTKey>* keys, std::vector<HOTItem>* items) const;
+    // Like SortItemsByKey but takes shortcuts for sorted and nearly sorted
+    // keys.
+    HOTSortPath SortNearlySortedItems(const HOTItem* begin, const HOTItem* end,
+        std::vector<HOTKey>* keys, std::vector<HOTItem>* items) const;
+    // Merges the sorted keys and items with keys_ and items_. merged_keys
+    // and merged_items need to have room for keys_.size() + keys.size()
+    // elements.
+    virtual void MergeItems(
+        const std::vector<HOTKey>& keys, const std::vector<HOTItem>& items,
+        HOTKey* merged_keys, HOTItem* merged_items) const;
 
     void RebuildNodes();
+    void RebuildNodeTable();
+    // Calls build_octant(octant) for all eight octants of a node with
+    // num_items items. Derived trees can build the octants concurrently.
+    // Only used by the POINTER layout.
+    virtual void BuildOctants(size_t num_items,
+        const std::function<void(int)>& build_octant) const;
+    // Calls query(first, last) for ranges of the num_items items that
+    // together cover all of them. Derived trees can query the ranges
+    // concurrently.
+    virtual void QueryItemRanges(size_t num_items,
+        const std::function<void(size_t, size_t)>& query) const;
+    // Key of the leaf whose key range contains key.
+    HOTNodeKey LeafKey(HOTKey key) const;
+    // Index of the item matching item in position and data or -1.
+    std::ptrdiff_t FindItem(const HOTItem& item) const;
+    void CompactIfNeeded();
+    // Key of an item at position after MoveIntoBox.
+    HOTKey ItemKey(const HOTPoint& position) const;
+    // Key of the bucket holding position in key_order_.
+    HOTKey PositionKey(const HOTPoint& position) const;
+    // Index of the first item of the overflow list. The nodes only hold the
+    // items in front of it.
+    size_t OverflowBegin() const;
+    // VisitNear in Metric.
+    template <HOTMetric Metric, typename Callable>
+    bool VisitNearInMetric(HOTPoint position, double eps, Callable* visit);
+    // VisitNearItemRanges for any visitor with a Visit like
+    // ItemRangeVisitor::Visit.
+    template <typename Visitor>
+    bool VisitNearRanges(Visitor* visitor, HOTPoint position, double eps,
+        HOTMetric metric);
+    // VisitNearRanges for the items in the nodes.
+    template <typename Visitor>
+    bool VisitNearRangesInBox(Visitor* visitor, HOTPoint position,
+        double eps, HOTMetric metric);
+    // VisitNearRangesInBox below the root of the POINTER or
+    // COMPACT_POINTER layout.
+    template <typename Node, typename Visitor>
+    bool VisitNearNodeRanges(Node* root,
+        const HOTNodeTable<HOTNodeKey, Node*>& node_table, Visitor* visitor,
+        HOTPoint position, double eps);
+    // KNearest in Metric without extracting the items.
+    template <HOTMetric Metric>
+    void SearchNearest(HOTPoint position, HOTNearestItems* nearest);
 };
 
+#include <hashedoctreenode.h>
 
 #endif
@@ -0,0 +1,610 @@
+#ifndef HASHED_OCTREE_NODE_H
+#define HASHED_OCTREE_NODE_H
+
+// The nodes of HOTTree and their traversal for eps queries. They are in a
+// header so that HOTTree::VisitNear can inline the traversal together with
+// the callable. Only the query code is defined here, the build code is in
+// hashedoctree.cpp.
+
+#include <hashedoctree.h>
+#include <helpers.h>
+
+#include <bitset>
+#include <cassert>
+
+
+// A query leaves at most seven siblings per level for later, so the
+// traversal stack never moves to the heap.
+const int HOT_TRAVERSAL_STACK_SIZE = 7 * HOT_BITS_PER_DIM + 1;
+
+// Numbering of the octants of the nodes along a space filling curve. The
+// curve passes through the octants of a node in state s in the order
+// octant[s][0], ..., octant[s][7], and digit is the inverse permutation.
+// Octants are numbered like in ComputeChildBox and digits are the three
+// bits of the keys. The child with digit d is in state child_state[s][d].
+// The root is in state 0.
+struct HOTCurve {
+  static const int MAX_STATES = 12;
+  uint8_t octant[MAX_STATES][8];
+  uint8_t digit[MAX_STATES][8];
+  uint8_t child_state[MAX_STATES][8];
+  // The digits of two levels for the octants of two levels, with the
+  // octant and digit of the upper level in the upper three bits, and the
+  // state below them in the bits from six on. Lets the encoder do two
+  // levels per lookup.
+  uint16_t two_levels[MAX_STATES][64];
+};
+
+const HOTCurve& HOTCurveOf(HOTKeyOrder order);
+
+// Corner shared by the children of a node with bounding box bbox, see
+// ComputeChildBox.
+inline HOTPoint HOTBoxSplit(const HOTBoundingBox& bbox) {
+  return HOTPoint({bbox.min.x + 0.5 * (bbox.max.x - bbox.min.x),
+      bbox.min.y + 0.5 * (bbox.max.y - bbox.min.y),
+      bbox.min.z + 0.5 * (bbox.max.z - bbox.min.z)});
+}
+
+// lower if the half below split can contain points within eps of x, or'ed
+// with upper if the half above can. Only the distance from the split is
+// tested, x is within eps of the node when the node is visited.
+inline unsigned HOTNearHalves(double split, double x, double eps,
+    unsigned lower, unsigned upper) {
+  return (lower & -unsigned(x - split < eps)) |
+    (upper & -unsigned(split - x < eps));
+}
+
+// Mask of the octants (see ComputeChildBox) of a node whose children share
+// the corner split that can contain points within eps of position, with bit
+// octant set for each one. The distance is the maximum over the axes, so
+// the mask is the intersection of the halves near position along each
+// axis. This takes six compares for all eight children and never touches
+// them.
+inline unsigned HOTNearOctants(const HOTPoint& split,
+    const HOTPoint& position, double eps) {
+  return HOTNearHalves(split.x, position.x, eps, 0x55, 0xaa) &
+    HOTNearHalves(split.y, position.y, eps, 0x33, 0xcc) &
+    HOTNearHalves(split.z, position.z, eps, 0x0f, 0xf0);
+}
+
+// Coordinates of the cell of a node among the cells on its level, i.e. in
+// units of the cell size of the level. Together with the tree's bounding
+// box and cell sizes they give the node's bounding box, see HOTCellBox, so
+// the nodes don't need to store it.
+struct HOTCell {
+  HOTKey i;
+  HOTKey j;
+  HOTKey k;
+};
+
+// Cell of the child in the given octant (see ComputeChildBox).
+inline HOTCell HOTChildCell(HOTCell cell, int octant) {
+  return HOTCell{2 * cell.i + (octant & 1), 2 * cell.j + ((octant >> 1) & 1),
+    2 * cell.k + ((octant >> 2) & 1)};
+}
+
+// Bounding box of a cell with size size in a tree with bounding box bbox.
+inline HOTBoundingBox HOTCellBox(const HOTBoundingBox& bbox,
+    const HOTPoint& size, HOTCell cell) {
+  return HOTBoundingBox({
+      {bbox.min.x + cell.i * size.x, bbox.min.y + cell.j * size.y,
+        bbox.min.z + cell.k * size.z},
+      {bbox.min.x + (cell.i + 1) * size.x, bbox.min.y + (cell.j + 1) * size.y,
+        bbox.min.z + (cell.k + 1) * size.z}
+      });
+}
+
+// Corner shared by the children of the node with the given cell, whose
+// children have cells of size child_size.
+inline HOTPoint HOTCellSplit(const HOTBoundingBox& bbox,
+    const HOTPoint& child_size, HOTCell cell) {
+  return HOTCellBox(bbox, child_size, HOTChildCell(cell, 7)).min;
+}
+
+// Level of the children whose digits are at shift in the keys.
+inline int HOTChildLevel(int shift) {
+  return HOT_BITS_PER_DIM - shift / 3;
+}
+
+// Cell of the node with the given key.
+HOTCell HOTNodeCell(HOTNodeKey key, HOTKeyOrder order);
+
+struct HOTBatchTraversal;
+
+// Bounding boxes of the nodes of the POINTER layout, which stores them in
+// the nodes. The traversals pass each node's Place to its box, the place
+// of the root is Place(). The stored boxes don't need one.
+class HOTStoredBox {
+  public:
+    struct Place {};
+
+    explicit HOTStoredBox(const HOTBoundingBox& bbox) : bbox_(bbox) {}
+
+    // Place of the node with the given key.
+    static Place KeyPlace(HOTNodeKey, HOTKeyOrder) {
+      return Place();
+    }
+    // Place of the child in the given octant of the node at place.
+    static Place ChildPlace(Place, int) {
+      return Place();
+    }
+    // Box of the child in the given octant.
+    HOTStoredBox ChildBox(int octant) const {
+      return HOTStoredBox(ComputeChildBox(bbox_, octant));
+    }
+    // Bounding box of the node on the given level at place in a tree with
+    // bounding box bbox and the given cell sizes.
+    const HOTBoundingBox& NodeBox(const HOTBoundingBox&, const HOTPoint*,
+        int, Place) const {
+      return bbox_;
+    }
+    // Corner shared by the children of the node, see NodeBox.
+    HOTPoint NodeSplit(const HOTBoundingBox&, const HOTPoint*, int,
+        Place) const {
+      return HOTBoxSplit(bbox_);
+    }
+
+  private:
+    HOTBoundingBox bbox_;
+};
+
+// Bounding boxes of the nodes of the COMPACT_POINTER layout. The place of
+// a node is its cell, and the boxes are computed from the cells like for
+// the LINEAR layout, so the nodes store nothing.
+class HOTComputedBox {
+  public:
+    typedef HOTCell Place;
+
+    static HOTCell KeyPlace(HOTNodeKey key, HOTKeyOrder order) {
+      return HOTNodeCell(key, order);
+    }
+    static HOTCell ChildPlace(HOTCell cell, int octant) {
+      return HOTChildCell(cell, octant);
+    }
+    HOTComputedBox ChildBox(int) const {
+      return HOTComputedBox();
+    }
+    HOTBoundingBox NodeBox(const HOTBoundingBox& bbox,
+        const HOTPoint* cell_sizes, int level, HOTCell cell) const {
+      return HOTCellBox(bbox, cell_sizes[level], cell);
+    }
+    HOTPoint NodeSplit(const HOTBoundingBox& bbox, const HOTPoint* cell_sizes,
+        int level, HOTCell cell) const {
+      return HOTCellSplit(bbox, cell_sizes[level + 1], cell);
+    }
+};
+
+// Node of the POINTER and COMPACT_POINTER layouts, with its bounding box
+// from Box. Box is a base, so that HOTComputedBox takes no room.
+template <typename Box>
+class HOTBasicNode : private Box {
+  public:
+    typedef typename Box::Place Place;
+    using Box::KeyPlace;
+
+    // tree decides how the children are built, see HOTTree::BuildOctants.
+    // state numbers the octants of the node, see HOTCurve. The children are
+    // stored in key order.
+    HOTBasicNode(const HOTTree* tree, HOTNodeKey key, int state,
+        const Box& box,
+        const HOTKey* key_begin, const HOTKey* key_end, HOTItem* items_begin);
+
+#ifdef HOT_HAVE_TBB
+    // Nodes may be built concurrently. The scalable allocator keeps them
+    // from contending for the global heap.
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
+#endif
+
+    // Brings the node up to date after new items have been merged into the
+    // keys and items. old_keys is the start of the keys the node currently
+    // points into, new_keys and new_items are the starts of the merged keys
+    // and items, and [key_begin, key_end) is the node's range in the merged
+    // keys. Subtrees that didn't receive new items are only relocated.
+    void Update(const HOTTree* tree, const HOTKey* old_keys,
+        const HOTKey* new_keys, HOTItem* new_items,
+        const HOTKey* key_begin, const HOTKey* key_end);
+
+    // Visits the item ranges of the leaves below the node, which is on the
+    // given level at place, that can hold items within eps of
+    // visitor_position. visitor has a Visit like
+    // SpatialSortTree::ItemRangeVisitor::Visit. bbox and cell_sizes are the
+    // tree's bounding box and the cell sizes of its levels.
+    template <typename Visitor>
+    bool VisitNearItemRanges(
+        Visitor* visitor,
+        const HOTCurve& curve,
+        const HOTBoundingBox& bbox,
+        const HOTPoint* cell_sizes,
+        HOTKey visitor_key,
+        int level,
+        Place place,
+        HOTPoint visitor_position,
+        double eps) {
+      assert(level == HOTNodeLevel(key_));
+      int shift = 3 * (HOT_BITS_PER_DIM - (level + 1));
+      // Most queries end up in a single leaf without ever needing the
+      // stack.
+      HOTBasicNode* node = Descend(curve, bbox, cell_sizes, visitor_key,
+          visitor_position, eps, &shift, &place);
+      if (node->IsLeaf()) {
+        return visitor->Visit(visitor_position, node->items_begin_,
+            node->items_begin_ + node->NumItems());
+      }
+      // shift is the position of the digit of the node's children in the
+      // keys.
+      struct Entry {
+        HOTBasicNode* node;
+        int shift;
+        Place place;
+      };
+      HOTTraversalStack<Entry, HOT_TRAVERSAL_STACK_SIZE> stack;
+      stack.Push(Entry{node, shift, place});
+      while (!stack.Empty()) {
+        Entry entry = stack.Pop();
+        int shift = entry.shift;
+        Place place = entry.place;
+        HOTBasicNode* node = entry.node->Descend(curve, bbox, cell_sizes,
+            visitor_key, visitor_position, eps, &shift, &place);
+        if (node->IsLeaf()) {
+          if (!visitor->Visit(visitor_position, node->items_begin_,
+                node->items_begin_ + node->NumItems())) {
+            return false;
+          }
+          continue;
+        }
+        // We are near the boundary. The children are pushed in reverse, so
+        // that they are visited in octant order.
+        unsigned near = HOTNearOctants(node->NodeSplit(bbox, cell_sizes,
+              HOTChildLevel(shift) - 1, place), visitor_position, eps);
+        while (near) {
+          int octant = 31 - __builtin_clz(near);
+          near &= ~(1u << octant);
+          HOTBasicNode* child =
+            node->children_[curve.digit[node->state_][octant]].get();
+          if (child) {
+            stack.Push(Entry{child, shift - 3,
+                Box::ChildPlace(place, octant)});
+          }
+        }
+      }
+      return true;
+    }
+
+    // Inserts the items of the leaves below the node, which is on the
+    // given level at place, that are nearer to position in Metric than the
+    // bound of nearest. The children are searched nearest first, so that
+    // the bound shrinks early and prunes the farther ones.
+    template <HOTMetric Metric>
+    void SearchNearest(const HOTCurve& curve, const HOTBoundingBox& bbox,
+        const HOTPoint* cell_sizes, int level, Place place,
+        HOTPoint position, HOTNearestItems* nearest);
+
+    // Descends to the deepest descendant that holds visitor_position more
+    // than eps away from its boundary. *shift is the position of the digit
+    // of the children in the keys and *place the place of the node. Both
+    // are updated along the way.
+    HOTBasicNode* Descend(const HOTCurve& curve, const HOTBoundingBox& bbox,
+        const HOTPoint* cell_sizes, HOTKey visitor_key,
+        HOTPoint visitor_position, double eps, int* shift, Place* place) {
+      HOTBasicNode* node = this;
+      while (!node->IsLeaf()) {
+        assert(*shift >= 0);
+        int digit = (visitor_key >> *shift) & 0x07u;
+        HOTBasicNode* selected_child = node->children_[digit].get();
+        if (!selected_child) break;
+        // The key only selects the child holding the position if this node
+        // does.
+        Place child_place = Box::ChildPlace(*place,
+            curve.octant[node->state_][digit]);
+        if (!InsideBoxWithMargin(selected_child->NodeBox(bbox, cell_sizes,
+                HOTChildLevel(*shift), child_place), visitor_position, eps)) {
+          break;
+        }
+        node = selected_child;
+        *shift -= 3;
+        *place = child_place;
+      }
+      return node;
+    }
+
+    // Visits the items near the queries in the range [first, last) of the
+    // traversal's active queries, which overlap the node on the given
+    // level at place.
+    void VisitNearVerticesBatch(const HOTCurve& curve,
+        const HOTBoundingBox& bbox, const HOTPoint* cell_sizes, int level,
+        Place place, HOTBatchTraversal* traversal, size_t first,
+        size_t last);
+
+    size_t NumItems() const {
+      return std::distance(key_begin_, key_end_);
+    }
+
+    HOTNodeKey Key() const {
+      return key_;
+    }
+
+    // Bounding box of the node, which is on the given level at place.
+    HOTBoundingBox BoundingBox(const HOTBoundingBox& bbox,
+        const HOTPoint* cell_sizes, int level, Place place) const {
+      return Box::NodeBox(bbox, cell_sizes, level, place);
+    }
+
+    void AddToTable(HOTNodeTable<HOTNodeKey, HOTBasicNode*>* table);
+
+    // Key of the leaf whose key range contains key.
+    HOTNodeKey LeafKey(HOTKey key) const;
+
+    int NumNodes() const;
+    int Depth() const;
+    void PrintNumItems(int indent) const;
+    size_t Size() const;
+
+  private:
+    HOTNodeKey key_;
+    uint8_t state_;
+    std::unique_ptr<HOTBasicNode> children_[8];
+
+    const HOTKey* key_begin_;
+    const HOTKey* key_end_;
+    HOTItem* items_begin_;
+
+    bool IsLeaf() const {
+      for (int i = 0; i < 8; ++i) {
+        if (children_[i]) return false;
+      }
+      return true;
+    }
+
+    // Splits a leaf into octants if it holds too many items.
+    void Refine(const HOTTree* tree);
+
+    // Builds the child with the given digit over [begin, end).
+    void BuildChild(const HOTTree* tree, const HOTNodeKey* child_keys,
+        int digit, const HOTKey* begin, const HOTKey* end);
+
+    // Moves the subtree to the merged keys and items where its range starts
+    // shift positions later than in the old keys.
+    void Relocate(const HOTKey* old_keys, const HOTKey* new_keys,
+        HOTItem* new_items, std::ptrdiff_t shift);
+};
+
+
+// Functions for the LINEAR node layout.
+
+inline int HOTLinearChild(const HOTLinearNode& node, int digit) {
+  return node.first_child +
+    std::bitset<8>(node.occupancy & ((1u << digit) - 1)).count();
+}
+
+// Descends from *node with cell *cell, whose children's digit is at shift
+// in the keys, to the deepest descendant that holds visitor_position more
+// than eps away from its boundary. bbox and cell_sizes are the tree's
+// bounding box and the cell sizes of its levels.
+inline void HOTLinearDescend(const HOTCurve& curve, const HOTLinearNode* nodes,
+    const HOTBoundingBox& bbox, const HOTPoint* cell_sizes,
+    HOTKey visitor_key, HOTPoint visitor_position, double eps,
+    const HOTLinearNode** node, int* shift, HOTCell* cell) {
+  while ((*node)->occupancy) {
+    assert(*shift >= 0);
+    int visitor_digit = (visitor_key >> *shift) & 0x07u;
+    if (!((*node)->occupancy & (1u << visitor_digit))) return;
+    HOTCell child_cell = HOTChildCell(*cell,
+        curve.octant[(*node)->state][visitor_digit]);
+    HOTBoundingBox child_bbox = HOTCellBox(bbox,
+        cell_sizes[HOTChildLevel(*shift)], child_cell);
+    if (!InsideBoxWithMargin(child_bbox, visitor_position, eps)) return;
+    *node = &nodes[HOTLinearChild(**node, visitor_digit)];
+    *shift -= 3;
+    *cell = child_cell;
+  }
+}
+
+// Visits the item ranges of the leaves below node index on the given level
+// with the given cell that can hold items within eps of visitor_position.
+template <typename Visitor>
+bool HOTLinearVisitNearItemRanges(const HOTCurve& curve,
+    const HOTLinearNode* nodes, const HOTBoundingBox& bbox,
+    const HOTPoint* cell_sizes, int index, int level, HOTCell cell,
+    HOTItem* items, Visitor* visitor, HOTKey visitor_key,
+    HOTPoint visitor_position, double eps) {
+  assert(level == HOTNodeLevel(nodes[index].key));
+  const HOTLinearNode* node = &nodes[index];
+  int shift = 3 * (HOT_BITS_PER_DIM - (level + 1));
+  // Most queries end up in a single leaf without ever needing the stack.
+  HOTLinearDescend(curve, nodes, bbox, cell_sizes, visitor_key,
+      visitor_position, eps, &node, &shift, &cell);
+  if (!node->occupancy) {
+    return visitor->Visit(visitor_position, items + node->items_begin,
+        items + node->items_end);
+  }
+  // shift is the position of the digit of the node's children in the keys.
+  struct Entry {
+    int index;
+    int shift;
+    HOTCell cell;
+  };
+  HOTTraversalStack<Entry, HOT_TRAVERSAL_STACK_SIZE> stack;
+  stack.Push(Entry{int(node - nodes), shift, cell});
+  while (!stack.Empty()) {
+    Entry entry = stack.Pop();
+    const HOTLinearNode* node = &nodes[entry.index];
+    int shift = entry.shift;
+    HOTCell cell = entry.cell;
+    HOTLinearDescend(curve, nodes, bbox, cell_sizes, visitor_key,
+        visitor_position, eps, &node, &shift, &cell);
+    if (!node->occupancy) {
+      if (!visitor->Visit(visitor_position, items + node->items_begin,
+            items + node->items_end)) {
+        return false;
+      }
+      continue;
+    }
+    // Same order as in HOTNode::VisitNearItemRanges.
+    unsigned near = HOTNearOctants(
+        HOTCellSplit(bbox, cell_sizes[HOTChildLevel(shift)], cell),
+        visitor_position, eps);
+    while (near) {
+      int octant = 31 - __builtin_clz(near);
+      near &= ~(1u << octant);
+      int digit = curve.digit[node->state][octant];
+      if (node->occupancy & (1u << digit)) {
+        stack.Push(Entry{HOTLinearChild(*node, digit), shift - 3,
+            HOTChildCell(cell, octant)});
+      }
+    }
+  }
+  return true;
+}
+
+
+// Key of the level level ancestor of the leaf level node containing key.
+inline HOTNodeKey HOTNodeAncestorKey(HOTKey key, int level) {
+  return (HOTNodeKey(1) << (3 * level)) |
+    (key >> (3 * (HOT_BITS_PER_DIM - level)));
+}
+
+// Finds the deepest node from which a query around position can start:
+// The node has to contain position and position has to be further than
+// eps away from its boundary. Both properties also hold for all ancestors
+// of such a node, so the levels can be bisected. find_node(key, &node,
+// &bbox) returns whether the node with the given key exists, and its bbox.
+// The level of the node is stored in *level.
+template <typename Node, typename FindNode>
+Node HOTFindStartNode(HOTKey key, HOTPoint position, double eps,
+    Node root, FindNode find_node, int* level) {
+  Node start = root;
+  int lo = 0;
+  int hi = HOT_BITS_PER_DIM;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    Node node;
+    HOTBoundingBox bbox;
+    if (find_node(HOTNodeAncestorKey(key, mid), &node, &bbox) &&
+        LInfinity(bbox, position) == 0 &&
+        DistanceFromBoundary(bbox, position) > eps) {
+      start = node;
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  *level = lo;
+  return start;
+}
+
+
+template <typename Callable>
+bool HOTTree::VisitNear(HOTPoint position, double eps, Callable visit) {
+  return VisitNearInMetric<HOTMetric::LINFINITY>(position, eps, &visit);
+}
+
+template <typename Callable>
+bool HOTTree::VisitNear(HOTPoint position, double eps, HOTMetric metric,
+    Callable visit) {
+  switch (metric) {
+    case HOTMetric::L2:
+      return VisitNearInMetric<HOTMetric::L2>(position, eps, &visit);
+    case HOTMetric::L1:
+      return VisitNearInMetric<HOTMetric::L1>(position, eps, &visit);
+    case HOTMetric::LINFINITY:
+      break;
+  }
+  return VisitNearInMetric<HOTMetric::LINFINITY>(position, eps, &visit);
+}
+
+template <HOTMetric Metric, typename Callable>
+bool HOTTree::VisitNearInMetric(HOTPoint position, double eps,
+    Callable* visit) {
+  NearItemsVisitor<Metric, Callable> range_visitor(visit, eps,
+      use_position_arrays_ ? &positions_ : nullptr);
+  return VisitNearRanges(&range_visitor, position, eps, Metric);
+}
+
+template <typename Visitor>
+bool HOTTree::VisitNearRanges(Visitor* visitor, HOTPoint position,
+    double eps, HOTMetric metric) {
+  switch (domain_mode_) {
+    case HOTDomainMode::PERIODIC:
+      return VisitPeriodicImages(bbox_, position, eps,
+          [this, visitor, eps, metric](HOTPoint image) {
+            return VisitNearRangesInBox(visitor, image, eps, metric);
+          });
+    case HOTDomainMode::CLAMPED: {
+      HOTRangesForPosition<Visitor> ranges(visitor, position);
+      return VisitNearRangesInBox(&ranges,
+          MoveIntoBox(bbox_, domain_mode_, position), eps, metric);
+    }
+    case HOTDomainMode::OVERFLOW_LIST:
+      break;
+  }
+  if (!VisitNearRangesInBox(visitor, position, eps, metric)) {
+    return false;
+  }
+  size_t overflow_begin = OverflowBegin();
+  if (overflow_begin == items_.size()) return true;
+  return visitor->Visit(position, &items_[0] + overflow_begin,
+      &items_[0] + items_.size());
+}
+
+template <typename Visitor>
+bool HOTTree::VisitNearRangesInBox(Visitor* visitor, HOTPoint position,
+    double eps, HOTMetric metric) {
+  // Only the box of the tree is tested in metric. Below it the children
+  // are skipped for the cube around position, which holds the balls of the
+  // other metrics. Testing each child against the ball cost more than
+  // visiting the leaves in the corners of the cube.
+  if (!NearBox(bbox_, position, eps, metric)) return true;
+  if (root_) {
+    return VisitNearNodeRanges(root_.get(), node_table_, visitor, position,
+        eps);
+  }
+  if (compact_root_) {
+    return VisitNearNodeRanges(compact_root_.get(), compact_node_table_,
+        visitor, position, eps);
+  }
+  if (!linear_nodes_.empty()) {
+    HOTKey visitor_key = PositionKey(position);
+    uint32_t start = 0;
+    int level = 0;
+    if (use_node_table_) {
+      start = HOTFindStartNode(visitor_key, position, eps, start,
+          [this](HOTNodeKey key, uint32_t* node, HOTBoundingBox* bbox) {
+            if (!linear_node_table_.Find(key, node)) return false;
+            *bbox = HOTNodeBoundingBox(bbox_, key, key_order_);
+            return true;
+          }, &level);
+    }
+    return HOTLinearVisitNearItemRanges(HOTCurveOf(key_order_),
+        &linear_nodes_[0], bbox_, cell_sizes_, start, level,
+        HOTNodeCell(linear_nodes_[start].key, key_order_), &items_[0],
+        visitor, visitor_key, position, eps);
+  }
+  return true;
+}
+
+template <typename Node, typename Visitor>
+bool HOTTree::VisitNearNodeRanges(Node* root,
+    const HOTNodeTable<HOTNodeKey, Node*>& node_table, Visitor* visitor,
+    HOTPoint position, double eps) {
+  HOTKey visitor_key = PositionKey(position);
+  Node* start = root;
+  int level = 0;
+  typename Node::Place place = typename Node::Place();
+  if (use_node_table_) {
+    start = HOTFindStartNode(visitor_key, position, eps, start,
+        [this, &node_table](HOTNodeKey key, Node** node,
+          HOTBoundingBox* bbox) {
+          if (!node_table.Find(key, node)) return false;
+          *bbox = (*node)->BoundingBox(bbox_, cell_sizes_, HOTNodeLevel(key),
+              Node::KeyPlace(key, key_order_));
+          return true;
+        }, &level);
+    place = Node::KeyPlace(start->Key(), key_order_);
+  }
+  return start->VisitNearItemRanges(visitor, HOTCurveOf(key_order_), bbox_,
+      cell_sizes_, visitor_key, level, place, position, eps);
+}
+
+
+#endif
@@ -4,6 +4,11 @@
 #include <cmath>
 #include <cassert>
 #include <limits>
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <vector>
 
 
 inline double DistanceFromInterval(double a, double b, double x) {
@@ -22,14 +27,6 @@ inline double LInfinity(const HOTBoundingBox& bbox, const HOTPoint& point) {
   return dist;
 }
 
-inline double LInfinity(const HOTPoint& p0, const HOTPoint& p1) {
-  double dist = 0;
-  dist = std::max(dist, std::fabs(p0.x - p1.x));
-  dist = std::max(dist, std::fabs(p0.y - p1.y));
-  dist = std::max(dist, std::fabs(p0.z - p1.z));
-  return dist;
-}
-
 inline double DistanceFromEdgesOfInterval(double a, double b, double x) {
   assert(b >= a);
   double dist = std::numeric_limits<double>::max();
@@ -46,4 +43,588 @@ inline double DistanceFromBoundary(const HOTBoundingBox& bbox, const HOTPoint& p
   return dist;
 }
 
+// Distance in Metric like HOTMetricDistance of two points that are dx, dy
+// and dz apart along the axes.
+template <HOTMetric Metric>
+inline double AxisDistancesInMetric(double dx, double dy, double dz) {
+  switch (Metric) {
+    case HOTMetric::L2:
+      return dx * dx + dy * dy + dz * dz;
+    case HOTMetric::L1:
+      return dx + dy + dz;
+    case HOTMetric::LINFINITY:
+      break;
+  }
+  return std::max(dx, std::max(dy, dz));
+}
+
+// Distance between point and the nearest point of bbox in Metric, zero if
+// point is inside of bbox.
+template <HOTMetric Metric>
+inline double BoxDistance(const HOTBoundingBox& bbox, const HOTPoint& point) {
+  return AxisDistancesInMetric<Metric>(
+      DistanceFromInterval(bbox.min.x, bbox.max.x, point.x),
+      DistanceFromInterval(bbox.min.y, bbox.max.y, point.y),
+      DistanceFromInterval(bbox.min.z, bbox.max.z, point.z));
+}
+
+// Whether bbox can hold points within eps of point in metric. Like
+// LInfinity(bbox, point) < eps for HOTMetric::LINFINITY.
+inline bool NearBox(const HOTBoundingBox& bbox, const HOTPoint& point,
+    double eps, HOTMetric metric) {
+  double bound = HOTMetricBound(metric, eps);
+  switch (metric) {
+    case HOTMetric::L2:
+      return BoxDistance<HOTMetric::L2>(bbox, point) < bound;
+    case HOTMetric::L1:
+      return BoxDistance<HOTMetric::L1>(bbox, point) < bound;
+    case HOTMetric::LINFINITY:
+      break;
+  }
+  return BoxDistance<HOTMetric::LINFINITY>(bbox, point) < bound;
+}
+
+// Whether point is inside of bbox or on its faces. Cheaper than
+// LInfinity(bbox, point) == 0 since all comparisons can run at once.
+inline bool InsideBox(const HOTBoundingBox& bbox, const HOTPoint& point) {
+  return (point.x >= bbox.min.x) & (point.x <= bbox.max.x) &
+    (point.y >= bbox.min.y) & (point.y <= bbox.max.y) &
+    (point.z >= bbox.min.z) & (point.z <= bbox.max.z);
+}
+
+// Whether point is inside of bbox and more than margin away from its faces,
+// like LInfinity(bbox, point) == 0 && DistanceFromBoundary(bbox, point) >
+// margin for margin >= 0, but without the branches.
+inline bool InsideBoxWithMargin(const HOTBoundingBox& bbox,
+    const HOTPoint& point, double margin) {
+  return (point.x - bbox.min.x > margin) & (bbox.max.x - point.x > margin) &
+    (point.y - bbox.min.y > margin) & (bbox.max.y - point.y > margin) &
+    (point.z - bbox.min.z > margin) & (bbox.max.z - point.z > margin);
+}
+
+// Folds x back into [a, b] for a domain with period b - a.
+inline double FoldIntoInterval(double a, double b, double x) {
+  double width = b - a;
+  double offset = x - a;
+  if (offset >= 0 && offset <= width) return x;
+  offset = std::fmod(offset, width);
+  if (offset < 0) {
+    offset += width;
+  }
+  return std::min(a + offset, b);
+}
+
+// Moves position into bbox as described for mode. Positions outside of
+// bbox stay where they are in the OVERFLOW_LIST mode.
+inline HOTPoint MoveIntoBox(const HOTBoundingBox& bbox, HOTDomainMode mode,
+    HOTPoint position) {
+  switch (mode) {
+    case HOTDomainMode::PERIODIC:
+      return HOTPoint{
+        FoldIntoInterval(bbox.min.x, bbox.max.x, position.x),
+        FoldIntoInterval(bbox.min.y, bbox.max.y, position.y),
+        FoldIntoInterval(bbox.min.z, bbox.max.z, position.z)};
+    case HOTDomainMode::CLAMPED:
+      return HOTPoint{
+        std::min(std::max(position.x, bbox.min.x), bbox.max.x),
+        std::min(std::max(position.y, bbox.min.y), bbox.max.y),
+        std::min(std::max(position.z, bbox.min.z), bbox.max.z)};
+    case HOTDomainMode::OVERFLOW_LIST:
+      break;
+  }
+  return position;
+}
+
+// Position at which a tree over bbox in mode stores an item at position.
+// Only PERIODIC moves items into bbox. CLAMPED keeps the position and
+// clamps only the keys of the item.
+inline HOTPoint StoredPosition(const HOTBoundingBox& bbox, HOTDomainMode mode,
+    HOTPoint position) {
+  if (mode != HOTDomainMode::PERIODIC) return position;
+  return MoveIntoBox(bbox, mode, position);
+}
+
+// Prepares the items in [begin, end) for a tree over bbox. PERIODIC moves
+// all positions into bbox. OVERFLOW_LIST moves the items outside of bbox
+// behind the others, keeping the order of both groups. CLAMPED leaves the
+// items as they are, all of them count as inside. The items are only
+// copied to *prepared if anything changes. Returns the prepared items and
+// stores the number of items inside of bbox in *num_inside.
+inline const HOTItem* PrepareItems(const HOTBoundingBox& bbox,
+    HOTDomainMode mode, const HOTItem* begin, const HOTItem* end,
+    std::vector<HOTItem>* prepared, size_t* num_inside) {
+  *num_inside = std::distance(begin, end);
+  if (mode == HOTDomainMode::CLAMPED) return begin;
+  // Counting without an early exit lets the compiler vectorize the loop.
+  size_t num_outside = 0;
+  for (const HOTItem* item = begin; item != end; ++item) {
+    num_outside += !InsideBox(bbox, item->position);
+  }
+  if (num_outside == 0) return begin;
+  auto inside = [&bbox](const HOTItem& item) {
+    return InsideBox(bbox, item.position);
+  };
+  prepared->assign(begin, end);
+  if (mode == HOTDomainMode::OVERFLOW_LIST) {
+    auto overflow = std::stable_partition(
+        prepared->begin(), prepared->end(), inside);
+    *num_inside = std::distance(prepared->begin(), overflow);
+  } else {
+    for (auto& item : *prepared) {
+      item.position = MoveIntoBox(bbox, mode, item.position);
+    }
+  }
+  return &(*prepared)[0];
+}
+
+// Passes the item ranges a tree finds for one position on to visitor as
+// ranges for another position. The CLAMPED mode searches the nodes at the
+// query position clamped onto the box, but the items are tested against
+// the query position itself. Clamping doesn't increase distances, so the
+// search finds all items near the query position. Visitor has a Visit like
+// SpatialSortTree::ItemRangeVisitor, so the trees can use it with their
+// own visitors without a virtual call.
+template <typename Visitor>
+class HOTRangesForPosition {
+  public:
+    HOTRangesForPosition(Visitor* visitor, HOTPoint position) :
+      visitor_(visitor), position_(position) {}
+    bool Visit(HOTPoint, HOTItem* begin, HOTItem* end) {
+      return visitor_->Visit(position_, begin, end);
+    }
+
+  private:
+    Visitor* visitor_;
+    HOTPoint position_;
+};
+
+// Calls visit(image) for the images of position that are within eps of
+// the periodic domain bbox, starting with position itself folded into
+// bbox. Stops as soon as visit returns false and returns whether all
+// calls returned true.
+template <typename Visit>
+bool VisitPeriodicImages(const HOTBoundingBox& bbox, HOTPoint position,
+    double eps, Visit visit) {
+  HOTPoint folded = MoveIntoBox(bbox, HOTDomainMode::PERIODIC, position);
+  const double lo[3] = {bbox.min.x, bbox.min.y, bbox.min.z};
+  const double hi[3] = {bbox.max.x, bbox.max.y, bbox.max.z};
+  const double x[3] = {folded.x, folded.y, folded.z};
+  // Per dimension the shifts that bring an image within eps of bbox.
+  double shifts[3][2];
+  int num_shifts[3];
+  for (int d = 0; d < 3; ++d) {
+    double width = hi[d] - lo[d];
+    assert(2 * eps <= width);
+    shifts[d][0] = 0;
+    num_shifts[d] = 1;
+    if (x[d] - eps < lo[d]) {
+      shifts[d][num_shifts[d]++] = width;
+    } else if (x[d] + eps > hi[d]) {
+      shifts[d][num_shifts[d]++] = -width;
+    }
+  }
+  for (int i = 0; i < num_shifts[0]; ++i) {
+    for (int j = 0; j < num_shifts[1]; ++j) {
+      for (int k = 0; k < num_shifts[2]; ++k) {
+        HOTPoint image{
+          x[0] + shifts[0][i], x[1] + shifts[1][j], x[2] + shifts[2][k]};
+        if (!visit(image)) return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Stack of the nodes still to visit in a depth first traversal. The first
+// Capacity entries are kept in the stack itself. Only traversals deeper
+// than the trees were built for move the entries to the heap.
+template <typename Entry, int Capacity>
+class HOTTraversalStack {
+  public:
+    HOTTraversalStack() : entries_(local_), size_(0), capacity_(Capacity) {}
+
+    bool Empty() const {
+      return size_ == 0;
+    }
+
+    void Push(const Entry& entry) {
+      if (size_ == capacity_) Grow();
+      entries_[size_++] = entry;
+    }
+
+    Entry Pop() {
+      return entries_[--size_];
+    }
+
+  private:
+    Entry local_[Capacity];
+    Entry* entries_;
+    int size_;
+    int capacity_;
+    std::unique_ptr<Entry[]> heap_;
+
+    void Grow() {
+      std::unique_ptr<Entry[]> entries(new Entry[2 * capacity_]);
+      std::copy(entries_, entries_ + size_, entries.get());
+      heap_ = std::move(entries);
+      entries_ = heap_.get();
+      capacity_ *= 2;
+    }
+};
+
+// A query of a batch (see SpatialSortTree::VisitNearVerticesBatch) at
+// position on behalf of the point with index point. The nodes are searched
+// at position and the items are measured from origin. The two only differ
+// in the CLAMPED mode, where position is clamped onto the box.
+struct HOTBatchQuery {
+  HOTPoint position;
+  HOTPoint origin;
+  int point;
+};
+
+// State of a traversal for a batch of queries. active holds indices into
+// queries. Every node gets the range of active with the queries that
+// overlap it, and the ranges of its children are pushed behind it.
+struct HOTBatchTraversal {
+  HOTBatchTraversal(SpatialSortTree::BatchVisitor* visitor, int num_points,
+      double eps, HOTMetric metric) :
+    visitor(visitor), eps(eps), metric(metric), done(num_points, 0) {}
+
+  SpatialSortTree::BatchVisitor* visitor;
+  double eps;
+  HOTMetric metric;
+  std::vector<HOTBatchQuery> queries;
+  std::vector<int> active;
+  // Set for the points whose visits were stopped by the visitor.
+  std::vector<char> done;
+  // Pairs of child and query used by PartitionBatchQueries.
+  std::vector<std::pair<int, int>> pairs;
+};
+
+// Appends the queries that a tree over bbox in mode does for the n points
+// to *queries: one for every periodic image within eps of bbox in the
+// PERIODIC mode, and one at MoveIntoBox of the point from the point itself
+// otherwise.
+inline void ExpandBatchQueries(const HOTBoundingBox& bbox, HOTDomainMode mode,
+    const HOTPoint* points, int n, double eps,
+    std::vector<HOTBatchQuery>* queries) {
+  queries->reserve(queries->size() + n);
+  for (int i = 0; i < n; ++i) {
+    if (mode == HOTDomainMode::PERIODIC) {
+      VisitPeriodicImages(bbox, points[i], eps, [queries, i](HOTPoint image) {
+          queries->push_back(HOTBatchQuery{image, image, i});
+          return true;
+        });
+    } else {
+      queries->push_back(HOTBatchQuery{MoveIntoBox(bbox, mode, points[i]),
+          points[i], i});
+    }
+  }
+}
+
+// Makes active hold the queries within eps of bbox, the root of the
+// traversal. Returns their number.
+inline size_t ActivateBatchQueries(const HOTBoundingBox& bbox,
+    HOTBatchTraversal* traversal) {
+  traversal->active.clear();
+  for (size_t q = 0; q < traversal->queries.size(); ++q) {
+    if (NearBox(bbox, traversal->queries[q].position, traversal->eps,
+          traversal->metric)) {
+      traversal->active.push_back(q);
+    }
+  }
+  return traversal->active.size();
+}
+
+// Pushes the queries of the range [first, last) of active that overlap
+// each of the N children of a node onto active, grouped by child.
+// overlapping(position, q, &pairs) appends (c, q) to pairs for the children
+// c that can hold points within eps of position. On return the queries of
+// child c are at [offsets[c], offsets[c + 1]) of active.
+template <int N, typename Overlapping>
+void PartitionBatchQueries(HOTBatchTraversal* traversal, size_t first,
+    size_t last, Overlapping overlapping, size_t offsets[N + 1]) {
+  std::vector<std::pair<int, int>>& pairs = traversal->pairs;
+  pairs.clear();
+  for (size_t a = first; a < last; ++a) {
+    int q = traversal->active[a];
+    const HOTBatchQuery& query = traversal->queries[q];
+    if (traversal->done[query.point]) continue;
+    overlapping(query.position, q, &pairs);
+  }
+  size_t counts[N] = {0};
+  for (const auto& pair : pairs) {
+    ++counts[pair.first];
+  }
+  offsets[0] = traversal->active.size();
+  for (int c = 0; c < N; ++c) {
+    offsets[c + 1] = offsets[c] + counts[c];
+  }
+  traversal->active.resize(offsets[N]);
+  size_t* next = counts;
+  std::copy(offsets, offsets + N, next);
+  for (const auto& pair : pairs) {
+    traversal->active[next[pair.first]++] = pair.second;
+  }
+}
+
+// Visits the items in [begin, end) near the queries of the range [first,
+// last) of active in Metric, the traversal's metric. The items stay in
+// cache from query to query.
+template <HOTMetric Metric>
+void VisitItemsNearBatch(HOTItem* begin, HOTItem* end,
+    HOTBatchTraversal* traversal, size_t first, size_t last) {
+  double bound = HOTMetricBound(Metric, traversal->eps);
+  for (size_t a = first; a < last; ++a) {
+    const HOTBatchQuery& query = traversal->queries[traversal->active[a]];
+    if (traversal->done[query.point]) continue;
+    for (HOTItem* item = begin; item != end; ++item) {
+      if (HOTMetricDistance<Metric>(item->position, query.origin) < bound) {
+        if (!traversal->visitor->Visit(query.point, item)) {
+          traversal->done[query.point] = 1;
+          break;
+        }
+      }
+    }
+  }
+}
+
+inline void VisitItemsNearBatch(HOTItem* begin, HOTItem* end,
+    HOTBatchTraversal* traversal, size_t first, size_t last) {
+  switch (traversal->metric) {
+    case HOTMetric::L2:
+      VisitItemsNearBatch<HOTMetric::L2>(begin, end, traversal, first, last);
+      return;
+    case HOTMetric::L1:
+      VisitItemsNearBatch<HOTMetric::L1>(begin, end, traversal, first, last);
+      return;
+    case HOTMetric::LINFINITY:
+      break;
+  }
+  VisitItemsNearBatch<HOTMetric::LINFINITY>(begin, end, traversal, first,
+      last);
+}
+
+// Range [*first, *last] of the cells of a grid of n equal cells over [a, b]
+// that can contain points within eps of x. The range is empty if *first >
+// *last. Cells touching the range only at their boundary may be included.
+inline void OverlappingCells(double a, double b, int n, double x, double eps,
+    int* first, int* last) {
+  double scale = n / (b - a);
+  double lo = std::floor((x - eps - a) * scale);
+  double hi = std::floor((x + eps - a) * scale);
+  *first = static_cast<int>(std::min(std::max(lo, 0.0), double(n)));
+  *last = static_cast<int>(std::min(std::max(hi, -1.0), n - 1.0));
+}
+
+
+// The k items nearest to a position found so far in a max-heap on their
+// distance, see SpatialSortTree::KNearest. Until k items are found every
+// item nearer than the initial bound is taken, then only items nearer than
+// the farthest one, which is dropped. Distances are HOTMetricDistance, so
+// squared for L2.
+class HOTNearestItems {
+  public:
+    explicit HOTNearestItems(int k) :
+      k_(std::max(k, 0)), unique_(false), origin_(nullptr) {
+      heap_.reserve(k_);
+      Clear(std::numeric_limits<double>::infinity());
+    }
+
+    int K() const {
+      return k_;
+    }
+
+    // Only items nearer than the bound can still be among the k nearest
+    // items. Searches skip the nodes whose BoxDistance isn't below it.
+    double Bound() const {
+      return bound_;
+    }
+
+    // Whether k items were found. With a finite initial bound they are the
+    // k nearest items only then.
+    bool Full() const {
+      return heap_.size() == size_t(k_);
+    }
+
+    // Drops the items found so far and starts over with bound.
+    void Clear(double bound) {
+      heap_.clear();
+      bound_ = k_ > 0 ? bound : -std::numeric_limits<double>::infinity();
+    }
+
+    // With unique set an item found again keeps its smaller distance
+    // instead of being held twice. Needed when the same item is searched
+    // at several positions, e.g. at the periodic images of the query.
+    void SetUnique(bool unique) {
+      unique_ = unique;
+    }
+
+    // With an origin set Scan measures the items from it instead of from
+    // the position searched. The CLAMPED mode searches the nodes at the
+    // query position clamped onto the box, but the items are measured from
+    // the query position itself.
+    void SetOrigin(const HOTPoint* origin) {
+      origin_ = origin;
+    }
+
+    void Insert(double distance, HOTItem* item) {
+      if (unique_) {
+        for (auto& entry : heap_) {
+          if (entry.second != item) continue;
+          if (distance < entry.first) {
+            entry.first = distance;
+            std::make_heap(heap_.begin(), heap_.end());
+            UpdateBound();
+          }
+          return;
+        }
+      }
+      if (Full()) {
+        std::pop_heap(heap_.begin(), heap_.end());
+        heap_.back() = std::make_pair(distance, item);
+      } else {
+        heap_.push_back(std::make_pair(distance, item));
+      }
+      std::push_heap(heap_.begin(), heap_.end());
+      UpdateBound();
+    }
+
+    // Inserts the items in [begin, end) nearer to position, or to the
+    // origin if one is set, in Metric than the bound.
+    template <HOTMetric Metric>
+    void Scan(HOTItem* begin, HOTItem* end, const HOTPoint& position) {
+      const HOTPoint& origin = origin_ ? *origin_ : position;
+      for (HOTItem* item = begin; item != end; ++item) {
+        double distance = HOTMetricDistance<Metric>(item->position, origin);
+        if (distance < bound_) Insert(distance, item);
+      }
+    }
+
+    // Stores the items nearest first in *items and empties the heap.
+    void Extract(std::vector<HOTItem*>* items) {
+      std::sort_heap(heap_.begin(), heap_.end());
+      items->resize(heap_.size());
+      for (size_t i = 0; i < heap_.size(); ++i) {
+        (*items)[i] = heap_[i].second;
+      }
+      heap_.clear();
+    }
+
+  private:
+    int k_;
+    double bound_;
+    bool unique_;
+    const HOTPoint* origin_;
+    std::vector<std::pair<double, HOTItem*>> heap_;
+
+    void UpdateBound() {
+      if (Full()) bound_ = heap_.front().first;
+    }
+};
+
+// Sorts the n entries, which have a distance, farthest first, so that the
+// nearest is popped first once they are pushed in order. For the at most
+// eight children of a HOTTree node an insertion sort is cheaper than
+// std::sort.
+template <typename Entry>
+inline void HOTSortFarthestFirst(Entry* entries, int n) {
+  for (int i = 1; i < n; ++i) {
+    Entry entry = entries[i];
+    int j = i;
+    for (; j > 0 && entries[j - 1].distance < entry.distance; --j) {
+      entries[j] = entries[j - 1];
+    }
+    entries[j] = entry;
+  }
+}
+
+// Initial bound for a search of the k nearest items in Metric among
+// num_items items spread over bbox. Its ball is expected to hold four times
+// k items if they are spread evenly, which leaves some slack for denser
+// and sparser regions.
+template <HOTMetric Metric>
+double HOTGuessNearestBound(const HOTBoundingBox& bbox, size_t num_items,
+    int k) {
+  double volume = (bbox.max.x - bbox.min.x) * (bbox.max.y - bbox.min.y) *
+    (bbox.max.z - bbox.min.z);
+  // Volume of the ball of radius one.
+  double unit_volume =
+    Metric == HOTMetric::L2 ? 4.0 / 3.0 * M_PI :
+    Metric == HOTMetric::L1 ? 4.0 / 3.0 : 8.0;
+  double radius = std::cbrt(4.0 * k * volume / (unit_volume * num_items));
+  return HOTMetricBound(Metric, radius);
+}
+
+// Searches the k nearest items of position in Metric for a tree over bbox
+// in mode, once with the bound of nearest. search(query, nearest) searches
+// the nodes of the tree for query, and the items in [overflow_begin,
+// overflow_end) are those of the overflow list of the OVERFLOW_LIST mode.
+template <HOTMetric Metric, typename Search>
+void HOTSearchNearestInDomain(const HOTBoundingBox& bbox, HOTDomainMode mode,
+    HOTPoint position, HOTItem* overflow_begin, HOTItem* overflow_end,
+    Search search, HOTNearestItems* nearest) {
+  switch (mode) {
+    case HOTDomainMode::PERIODIC: {
+      // Unlike for VisitPeriodicImages the radius can exceed half of the
+      // domain, e.g. while fewer than k items are found, so all 26
+      // neighbouring images are candidates. Each is only searched while
+      // its box can still hold nearer items. The nearest image of every
+      // item is among them.
+      HOTPoint folded = MoveIntoBox(bbox, mode, position);
+      search(folded, nearest);
+      nearest->SetUnique(true);
+      double width[3] = {bbox.max.x - bbox.min.x, bbox.max.y - bbox.min.y,
+        bbox.max.z - bbox.min.z};
+      for (int i = -1; i <= 1; ++i) {
+        for (int j = -1; j <= 1; ++j) {
+          for (int k = -1; k <= 1; ++k) {
+            if (i == 0 && j == 0 && k == 0) continue;
+            HOTPoint image{folded.x + i * width[0], folded.y + j * width[1],
+              folded.z + k * width[2]};
+            if (BoxDistance<Metric>(bbox, image) < nearest->Bound()) {
+              search(image, nearest);
+            }
+          }
+        }
+      }
+      nearest->SetUnique(false);
+      return;
+    }
+    case HOTDomainMode::CLAMPED:
+      // Clamping doesn't increase distances, so the BoxDistance of a node
+      // from the clamped position bounds the distances of its items from
+      // position.
+      nearest->SetOrigin(&position);
+      search(MoveIntoBox(bbox, mode, position), nearest);
+      nearest->SetOrigin(nullptr);
+      return;
+    case HOTDomainMode::OVERFLOW_LIST:
+      break;
+  }
+  search(position, nearest);
+  nearest->Scan<Metric>(overflow_begin, overflow_end, position);
+}
+
+// HOTSearchNearestInDomain for the nearest items of a tree with num_items
+// items. Until k items are found nothing can be pruned, and the nodes
+// on the way to the first leaves would have all of their children queued.
+// The first search therefore starts from HOTGuessNearestBound, and only if
+// it finds fewer than k items the search is repeated without a bound.
+template <HOTMetric Metric, typename Search>
+void HOTSearchNearest(const HOTBoundingBox& bbox, HOTDomainMode mode,
+    HOTPoint position, size_t num_items, HOTItem* overflow_begin,
+    HOTItem* overflow_end, Search search, HOTNearestItems* nearest) {
+  if (num_items > size_t(nearest->K())) {
+    nearest->Clear(HOTGuessNearestBound<Metric>(bbox, num_items,
+          nearest->K()));
+    HOTSearchNearestInDomain<Metric>(bbox, mode, position, overflow_begin,
+        overflow_end, search, nearest);
+    if (nearest->Full()) return;
+  }
+  nearest->Clear(std::numeric_limits<double>::infinity());
+  HOTSearchNearestInDomain<Metric>(bbox, mode, position, overflow_begin,
+      overflow_end, search, nearest);
+}
+
 #endif
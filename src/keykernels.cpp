@@ -0,0 +1,557 @@
+#include <keykernels.h>
+#include <helpers.h>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HOT_HAVE_X86_KERNELS
+// GCC before 12.3 passes undefined vectors to the builtins of its unmasked
+// AVX-512 intrinsics and then warns about them in the kernels below. Only
+// warnings located in the intrinsic headers are silenced.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+#endif
+
+
+static const HOTKey NUM_LEAF_BUCKETS = HOTKey(1) << HOT_BITS_PER_DIM;
+
+#ifdef HOT_HAVE_X86_KERNELS
+
+// The kernels are compiled for their instruction set with function
+// attributes, so the rest of the library doesn't need any -m flags.
+#define HOT_AVX2 __attribute__((target("avx2")))
+#define HOT_AVX512 __attribute__((target("avx512f")))
+
+// Loads the coordinates of the four locations at l, which are stride
+// doubles apart.
+HOT_AVX2 static inline void LoadLocations4(const double* l, int stride,
+    __m256d* x, __m256d* y, __m256d* z) {
+  if (stride >= 4) {
+    // Two unpacks and two lane permutes transpose four rows of x, y, z and
+    // whatever follows.
+    __m256d r0 = _mm256_loadu_pd(l);
+    __m256d r1 = _mm256_loadu_pd(l + stride);
+    __m256d r2 = _mm256_loadu_pd(l + 2 * stride);
+    __m256d r3 = _mm256_loadu_pd(l + 3 * stride);
+    __m256d xz01 = _mm256_unpacklo_pd(r0, r1);
+    __m256d yw01 = _mm256_unpackhi_pd(r0, r1);
+    __m256d xz23 = _mm256_unpacklo_pd(r2, r3);
+    __m256d yw23 = _mm256_unpackhi_pd(r2, r3);
+    *x = _mm256_permute2f128_pd(xz01, xz23, 0x20);
+    *y = _mm256_permute2f128_pd(yw01, yw23, 0x20);
+    *z = _mm256_permute2f128_pd(xz01, xz23, 0x31);
+  } else {
+    // The unmasked gathers leave their source undefined, which GCC warns
+    // about.
+    __m128i index = _mm_mullo_epi32(_mm_setr_epi32(0, 1, 2, 3),
+        _mm_set1_epi32(stride));
+    __m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+    *x = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), l, index, all, 8);
+    *y = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), l + 1, index, all, 8);
+    *z = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), l + 2, index, all, 8);
+  }
+}
+
+HOT_AVX512 static inline void LoadLocations8(const double* l, int stride,
+    __m512d* x, __m512d* y, __m512d* z) {
+  if (stride >= 4) {
+    __m256d x0, y0, z0, x1, y1, z1;
+    LoadLocations4(l, stride, &x0, &y0, &z0);
+    LoadLocations4(l + 4 * stride, stride, &x1, &y1, &z1);
+    *x = _mm512_insertf64x4(_mm512_castpd256_pd512(x0), x1, 1);
+    *y = _mm512_insertf64x4(_mm512_castpd256_pd512(y0), y1, 1);
+    *z = _mm512_insertf64x4(_mm512_castpd256_pd512(z0), z1, 1);
+  } else {
+    __m256i index = _mm256_mullo_epi32(
+        _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+    *x = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), 0xff, index, l, 8);
+    *y = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), 0xff, index, l + 1,
+        8);
+    *z = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), 0xff, index, l + 2,
+        8);
+  }
+}
+
+// Part1By2_64 from hashedoctree.cpp on every 64 bit lane. The buckets of
+// 32 bit keys have only 10 bits, for which both spreads agree.
+HOT_AVX2 static inline __m256i Part1By2(__m256i a) {
+  a = _mm256_and_si256(_mm256_or_si256(a, _mm256_slli_epi64(a, 32)),
+      _mm256_set1_epi64x(0x1f00000000ffff));
+  a = _mm256_and_si256(_mm256_or_si256(a, _mm256_slli_epi64(a, 16)),
+      _mm256_set1_epi64x(0x1f0000ff0000ff));
+  a = _mm256_and_si256(_mm256_or_si256(a, _mm256_slli_epi64(a, 8)),
+      _mm256_set1_epi64x(0x100f00f00f00f00f));
+  a = _mm256_and_si256(_mm256_or_si256(a, _mm256_slli_epi64(a, 4)),
+      _mm256_set1_epi64x(0x10c30c30c30c30c3));
+  a = _mm256_and_si256(_mm256_or_si256(a, _mm256_slli_epi64(a, 2)),
+      _mm256_set1_epi64x(0x1249249249249249));
+  return a;
+}
+
+HOT_AVX512 static inline __m512i Part1By2(__m512i a) {
+  a = _mm512_and_si512(_mm512_or_si512(a, _mm512_slli_epi64(a, 32)),
+      _mm512_set1_epi64(0x1f00000000ffff));
+  a = _mm512_and_si512(_mm512_or_si512(a, _mm512_slli_epi64(a, 16)),
+      _mm512_set1_epi64(0x1f0000ff0000ff));
+  a = _mm512_and_si512(_mm512_or_si512(a, _mm512_slli_epi64(a, 8)),
+      _mm512_set1_epi64(0x100f00f00f00f00f));
+  a = _mm512_and_si512(_mm512_or_si512(a, _mm512_slli_epi64(a, 4)),
+      _mm512_set1_epi64(0x10c30c30c30c30c3));
+  a = _mm512_and_si512(_mm512_or_si512(a, _mm512_slli_epi64(a, 2)),
+      _mm512_set1_epi64(0x1249249249249249));
+  return a;
+}
+
+// Bit i is set if location i is inside of bbox or on its faces, like in
+// InsideBox.
+HOT_AVX2 static inline int InsideMask4(__m256d x, __m256d y, __m256d z,
+    __m256d min_x, __m256d min_y, __m256d min_z,
+    __m256d max_x, __m256d max_y, __m256d max_z) {
+  __m256d inside = _mm256_and_pd(
+      _mm256_and_pd(
+        _mm256_and_pd(_mm256_cmp_pd(x, min_x, _CMP_GE_OQ),
+          _mm256_cmp_pd(x, max_x, _CMP_LE_OQ)),
+        _mm256_and_pd(_mm256_cmp_pd(y, min_y, _CMP_GE_OQ),
+          _mm256_cmp_pd(y, max_y, _CMP_LE_OQ))),
+      _mm256_and_pd(_mm256_cmp_pd(z, min_z, _CMP_GE_OQ),
+        _mm256_cmp_pd(z, max_z, _CMP_LE_OQ)));
+  return _mm256_movemask_pd(inside);
+}
+
+HOT_AVX512 static inline __mmask8 InsideMask8(__m512d x, __m512d y, __m512d z,
+    __m512d min_x, __m512d min_y, __m512d min_z,
+    __m512d max_x, __m512d max_y, __m512d max_z) {
+  return _mm512_cmp_pd_mask(x, min_x, _CMP_GE_OQ) &
+    _mm512_cmp_pd_mask(x, max_x, _CMP_LE_OQ) &
+    _mm512_cmp_pd_mask(y, min_y, _CMP_GE_OQ) &
+    _mm512_cmp_pd_mask(y, max_y, _CMP_LE_OQ) &
+    _mm512_cmp_pd_mask(z, min_z, _CMP_GE_OQ) &
+    _mm512_cmp_pd_mask(z, max_z, _CMP_LE_OQ);
+}
+
+// The scalar fallback for a block with locations outside of bbox, which
+// need to be folded back.
+static void ComputeHashes(const HOTBoundingBox& bbox, const double* l,
+    int n, int stride, HOTKey* keys) {
+  for (int i = 0; i < n; ++i, l += stride) {
+    keys[i] = HOTComputeHash(bbox, HOTPoint({l[0], l[1], l[2]}));
+  }
+}
+
+// The buckets are computed with the same operations as in ComputeBucket in
+// hashedoctree.cpp, so that the keys are bit for bit identical.
+HOT_AVX2 static int ComputeManyHashesAvx2(const HOTBoundingBox& bbox,
+    const double* locations, int n, int stride, HOTKey* keys, bool clamp,
+    int* num_outside) {
+  const __m256d min_x = _mm256_set1_pd(bbox.min.x);
+  const __m256d min_y = _mm256_set1_pd(bbox.min.y);
+  const __m256d min_z = _mm256_set1_pd(bbox.min.z);
+  const __m256d max_x = _mm256_set1_pd(bbox.max.x);
+  const __m256d max_y = _mm256_set1_pd(bbox.max.y);
+  const __m256d max_z = _mm256_set1_pd(bbox.max.z);
+  const __m256d scale_x = _mm256_set1_pd(NUM_LEAF_BUCKETS / (bbox.max.x - bbox.min.x));
+  const __m256d scale_y = _mm256_set1_pd(NUM_LEAF_BUCKETS / (bbox.max.y - bbox.min.y));
+  const __m256d scale_z = _mm256_set1_pd(NUM_LEAF_BUCKETS / (bbox.max.z - bbox.min.z));
+  const __m128i max_bucket = _mm_set1_epi32(NUM_LEAF_BUCKETS - 1);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const double* l = locations + i * stride;
+    __m256d x, y, z;
+    LoadLocations4(l, stride, &x, &y, &z);
+    int inside = InsideMask4(x, y, z, min_x, min_y, min_z, max_x, max_y, max_z);
+    if (inside != 0xf) {
+      *num_outside += 4 - __builtin_popcount(inside);
+      if (!clamp) {
+        ComputeHashes(bbox, l, 4, stride, keys + i);
+        continue;
+      }
+      x = _mm256_min_pd(_mm256_max_pd(x, min_x), max_x);
+      y = _mm256_min_pd(_mm256_max_pd(y, min_y), max_y);
+      z = _mm256_min_pd(_mm256_max_pd(z, min_z), max_z);
+    }
+    __m256d dx = _mm256_sub_pd(x, min_x);
+    __m256d dy = _mm256_sub_pd(y, min_y);
+    __m256d dz = _mm256_sub_pd(z, min_z);
+    __m256i a = _mm256_cvtepu32_epi64(_mm_min_epi32(
+          _mm256_cvttpd_epi32(_mm256_mul_pd(dx, scale_x)), max_bucket));
+    __m256i b = _mm256_cvtepu32_epi64(_mm_min_epi32(
+          _mm256_cvttpd_epi32(_mm256_mul_pd(dy, scale_y)), max_bucket));
+    __m256i c = _mm256_cvtepu32_epi64(_mm_min_epi32(
+          _mm256_cvttpd_epi32(_mm256_mul_pd(dz, scale_z)), max_bucket));
+    __m256i key = _mm256_or_si256(Part1By2(a), _mm256_or_si256(
+          _mm256_slli_epi64(Part1By2(b), 1), _mm256_slli_epi64(Part1By2(c), 2)));
+#ifdef HOT_USE_64BIT_KEYS
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(keys + i), key);
+#else
+    key = _mm256_permutevar8x32_epi32(key, _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(keys + i),
+        _mm256_castsi256_si128(key));
+#endif
+  }
+  return i;
+}
+
+HOT_AVX512 static int ComputeManyHashesAvx512(const HOTBoundingBox& bbox,
+    const double* locations, int n, int stride, HOTKey* keys, bool clamp,
+    int* num_outside) {
+  const __m512d min_x = _mm512_set1_pd(bbox.min.x);
+  const __m512d min_y = _mm512_set1_pd(bbox.min.y);
+  const __m512d min_z = _mm512_set1_pd(bbox.min.z);
+  const __m512d max_x = _mm512_set1_pd(bbox.max.x);
+  const __m512d max_y = _mm512_set1_pd(bbox.max.y);
+  const __m512d max_z = _mm512_set1_pd(bbox.max.z);
+  const __m512d scale_x = _mm512_set1_pd(NUM_LEAF_BUCKETS / (bbox.max.x - bbox.min.x));
+  const __m512d scale_y = _mm512_set1_pd(NUM_LEAF_BUCKETS / (bbox.max.y - bbox.min.y));
+  const __m512d scale_z = _mm512_set1_pd(NUM_LEAF_BUCKETS / (bbox.max.z - bbox.min.z));
+  const __m256i max_bucket = _mm256_set1_epi32(NUM_LEAF_BUCKETS - 1);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const double* l = locations + i * stride;
+    __m512d x, y, z;
+    LoadLocations8(l, stride, &x, &y, &z);
+    __mmask8 inside =
+      InsideMask8(x, y, z, min_x, min_y, min_z, max_x, max_y, max_z);
+    if (inside != 0xff) {
+      *num_outside += 8 - __builtin_popcount(inside);
+      if (!clamp) {
+        ComputeHashes(bbox, l, 8, stride, keys + i);
+        continue;
+      }
+      x = _mm512_min_pd(_mm512_max_pd(x, min_x), max_x);
+      y = _mm512_min_pd(_mm512_max_pd(y, min_y), max_y);
+      z = _mm512_min_pd(_mm512_max_pd(z, min_z), max_z);
+    }
+    __m512d dx = _mm512_sub_pd(x, min_x);
+    __m512d dy = _mm512_sub_pd(y, min_y);
+    __m512d dz = _mm512_sub_pd(z, min_z);
+    __m512i a = _mm512_cvtepu32_epi64(_mm256_min_epi32(
+          _mm512_cvttpd_epi32(_mm512_mul_pd(dx, scale_x)), max_bucket));
+    __m512i b = _mm512_cvtepu32_epi64(_mm256_min_epi32(
+          _mm512_cvttpd_epi32(_mm512_mul_pd(dy, scale_y)), max_bucket));
+    __m512i c = _mm512_cvtepu32_epi64(_mm256_min_epi32(
+          _mm512_cvttpd_epi32(_mm512_mul_pd(dz, scale_z)), max_bucket));
+    __m512i key = _mm512_or_si512(Part1By2(a), _mm512_or_si512(
+          _mm512_slli_epi64(Part1By2(b), 1), _mm512_slli_epi64(Part1By2(c), 2)));
+#ifdef HOT_USE_64BIT_KEYS
+    _mm512_storeu_si512(keys + i, key);
+#else
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(keys + i),
+        _mm512_cvtepi64_epi32(key));
+#endif
+  }
+  return i;
+}
+
+// The cells are computed with the same operations as in the scalar
+// ComputeManyWideKeys.
+HOT_AVX2 static int ComputeManyGridKeysAvx2(const HOTBoundingBox& bbox,
+    int log_nx, int log_ny, int log_nz, const double* locations, int n,
+    int stride, uint8_t* keys, int* num_outside) {
+  const __m256d min_x = _mm256_set1_pd(bbox.min.x);
+  const __m256d min_y = _mm256_set1_pd(bbox.min.y);
+  const __m256d min_z = _mm256_set1_pd(bbox.min.z);
+  const __m256d max_x = _mm256_set1_pd(bbox.max.x);
+  const __m256d max_y = _mm256_set1_pd(bbox.max.y);
+  const __m256d max_z = _mm256_set1_pd(bbox.max.z);
+  const __m256d scale_x = _mm256_set1_pd((1 << log_nx) / (bbox.max.x - bbox.min.x));
+  const __m256d scale_y = _mm256_set1_pd((1 << log_ny) / (bbox.max.y - bbox.min.y));
+  const __m256d scale_z = _mm256_set1_pd((1 << log_nz) / (bbox.max.z - bbox.min.z));
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i last_x = _mm_set1_epi32((1 << log_nx) - 1);
+  const __m128i last_y = _mm_set1_epi32((1 << log_ny) - 1);
+  const __m128i last_z = _mm_set1_epi32((1 << log_nz) - 1);
+  const __m128i shift_x = _mm_cvtsi32_si128(log_ny + log_nz);
+  const __m128i shift_y = _mm_cvtsi32_si128(log_nz);
+  // Picks the low byte of every 32 bit lane.
+  const __m128i low_bytes = _mm_setr_epi8(
+      0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d x, y, z;
+    LoadLocations4(locations + i * stride, stride, &x, &y, &z);
+    *num_outside += 4 - __builtin_popcount(
+        InsideMask4(x, y, z, min_x, min_y, min_z, max_x, max_y, max_z));
+    __m128i a = _mm_min_epi32(_mm_max_epi32(_mm256_cvttpd_epi32(
+          _mm256_mul_pd(_mm256_sub_pd(x, min_x), scale_x)), zero), last_x);
+    __m128i b = _mm_min_epi32(_mm_max_epi32(_mm256_cvttpd_epi32(
+          _mm256_mul_pd(_mm256_sub_pd(y, min_y), scale_y)), zero), last_y);
+    __m128i c = _mm_min_epi32(_mm_max_epi32(_mm256_cvttpd_epi32(
+          _mm256_mul_pd(_mm256_sub_pd(z, min_z), scale_z)), zero), last_z);
+    __m128i key = _mm_or_si128(_mm_or_si128(
+          _mm_sll_epi32(a, shift_x), _mm_sll_epi32(b, shift_y)), c);
+    int32_t packed = _mm_cvtsi128_si32(_mm_shuffle_epi8(key, low_bytes));
+    std::memcpy(keys + i, &packed, sizeof(packed));
+  }
+  return i;
+}
+
+HOT_AVX512 static int ComputeManyGridKeysAvx512(const HOTBoundingBox& bbox,
+    int log_nx, int log_ny, int log_nz, const double* locations, int n,
+    int stride, uint8_t* keys, int* num_outside) {
+  const __m512d min_x = _mm512_set1_pd(bbox.min.x);
+  const __m512d min_y = _mm512_set1_pd(bbox.min.y);
+  const __m512d min_z = _mm512_set1_pd(bbox.min.z);
+  const __m512d max_x = _mm512_set1_pd(bbox.max.x);
+  const __m512d max_y = _mm512_set1_pd(bbox.max.y);
+  const __m512d max_z = _mm512_set1_pd(bbox.max.z);
+  const __m512d scale_x = _mm512_set1_pd((1 << log_nx) / (bbox.max.x - bbox.min.x));
+  const __m512d scale_y = _mm512_set1_pd((1 << log_ny) / (bbox.max.y - bbox.min.y));
+  const __m512d scale_z = _mm512_set1_pd((1 << log_nz) / (bbox.max.z - bbox.min.z));
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i last_x = _mm256_set1_epi32((1 << log_nx) - 1);
+  const __m256i last_y = _mm256_set1_epi32((1 << log_ny) - 1);
+  const __m256i last_z = _mm256_set1_epi32((1 << log_nz) - 1);
+  const __m128i shift_x = _mm_cvtsi32_si128(log_ny + log_nz);
+  const __m128i shift_y = _mm_cvtsi32_si128(log_nz);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m512d x, y, z;
+    LoadLocations8(locations + i * stride, stride, &x, &y, &z);
+    *num_outside += 8 - __builtin_popcount(
+        InsideMask8(x, y, z, min_x, min_y, min_z, max_x, max_y, max_z));
+    __m256i a = _mm256_min_epi32(_mm256_max_epi32(_mm512_cvttpd_epi32(
+          _mm512_mul_pd(_mm512_sub_pd(x, min_x), scale_x)), zero), last_x);
+    __m256i b = _mm256_min_epi32(_mm256_max_epi32(_mm512_cvttpd_epi32(
+          _mm512_mul_pd(_mm512_sub_pd(y, min_y), scale_y)), zero), last_y);
+    __m256i c = _mm256_min_epi32(_mm256_max_epi32(_mm512_cvttpd_epi32(
+          _mm512_mul_pd(_mm512_sub_pd(z, min_z), scale_z)), zero), last_z);
+    __m256i key = _mm256_or_si256(_mm256_or_si256(
+          _mm256_sll_epi32(a, shift_x), _mm256_sll_epi32(b, shift_y)), c);
+    // Only the low eight bytes are valid.
+    __m128i packed = _mm512_cvtepi32_epi8(_mm512_zextsi256_si512(key));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(keys + i), packed);
+  }
+  return i;
+}
+
+// Lanes of the four positions that are near the query position, given
+// their differences dx, dy and dz to it, like HOTMetricDistance<Metric>(...)
+// < bound. The distances add up in the same order as in HOTMetricDistance.
+template <HOTMetric Metric>
+HOT_AVX2 static inline __m256d Near4(__m256d dx, __m256d dy, __m256d dz,
+    __m256d bound) {
+  // Clearing the sign bit takes the absolute value.
+  __m256d sign = _mm256_set1_pd(-0.0);
+  switch (Metric) {
+    case HOTMetric::L2:
+      return _mm256_cmp_pd(_mm256_add_pd(_mm256_add_pd(
+              _mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)),
+            _mm256_mul_pd(dz, dz)), bound, _CMP_LT_OQ);
+    case HOTMetric::L1:
+      return _mm256_cmp_pd(_mm256_add_pd(_mm256_add_pd(
+              _mm256_andnot_pd(sign, dx), _mm256_andnot_pd(sign, dy)),
+            _mm256_andnot_pd(sign, dz)), bound, _CMP_LT_OQ);
+    case HOTMetric::LINFINITY:
+      break;
+  }
+  return _mm256_and_pd(
+      _mm256_and_pd(
+        _mm256_cmp_pd(_mm256_andnot_pd(sign, dx), bound, _CMP_LT_OQ),
+        _mm256_cmp_pd(_mm256_andnot_pd(sign, dy), bound, _CMP_LT_OQ)),
+      _mm256_cmp_pd(_mm256_andnot_pd(sign, dz), bound, _CMP_LT_OQ));
+}
+
+// Sets the bits of the near positions among the first n in *mask four at a
+// time. Only whole vectors are done. Returns the number of positions done.
+template <HOTMetric Metric>
+HOT_AVX2 static int NearMaskAvx2(const double* x, const double* y,
+    const double* z, int n, HOTPoint position, double bound,
+    uint64_t* mask) {
+  __m256d px = _mm256_set1_pd(position.x);
+  __m256d py = _mm256_set1_pd(position.y);
+  __m256d pz = _mm256_set1_pd(position.z);
+  __m256d vbound = _mm256_set1_pd(bound);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d near = Near4<Metric>(_mm256_sub_pd(_mm256_loadu_pd(x + i), px),
+        _mm256_sub_pd(_mm256_loadu_pd(y + i), py),
+        _mm256_sub_pd(_mm256_loadu_pd(z + i), pz), vbound);
+    *mask |= static_cast<uint64_t>(_mm256_movemask_pd(near)) << i;
+  }
+  return i;
+}
+
+// Like Near4 for the valid ones of eight positions.
+template <HOTMetric Metric>
+HOT_AVX512 static inline __mmask8 Near8(__mmask8 valid, __m512d dx,
+    __m512d dy, __m512d dz, __m512d bound) {
+  switch (Metric) {
+    case HOTMetric::L2:
+      return _mm512_mask_cmp_pd_mask(valid, _mm512_add_pd(_mm512_add_pd(
+              _mm512_mul_pd(dx, dx), _mm512_mul_pd(dy, dy)),
+            _mm512_mul_pd(dz, dz)), bound, _CMP_LT_OQ);
+    case HOTMetric::L1:
+      return _mm512_mask_cmp_pd_mask(valid, _mm512_add_pd(_mm512_add_pd(
+              _mm512_abs_pd(dx), _mm512_abs_pd(dy)), _mm512_abs_pd(dz)),
+          bound, _CMP_LT_OQ);
+    case HOTMetric::LINFINITY:
+      break;
+  }
+  __mmask8 near = _mm512_mask_cmp_pd_mask(valid, _mm512_abs_pd(dx), bound,
+      _CMP_LT_OQ);
+  near = _mm512_mask_cmp_pd_mask(near, _mm512_abs_pd(dy), bound, _CMP_LT_OQ);
+  return _mm512_mask_cmp_pd_mask(near, _mm512_abs_pd(dz), bound, _CMP_LT_OQ);
+}
+
+// Eight at a time. The last partial vector is done with masked loads, so
+// all n positions are done.
+template <HOTMetric Metric>
+HOT_AVX512 static int NearMaskAvx512(const double* x, const double* y,
+    const double* z, int n, HOTPoint position, double bound,
+    uint64_t* mask) {
+  __m512d px = _mm512_set1_pd(position.x);
+  __m512d py = _mm512_set1_pd(position.y);
+  __m512d pz = _mm512_set1_pd(position.z);
+  __m512d vbound = _mm512_set1_pd(bound);
+  for (int i = 0; i < n; i += 8) {
+    __mmask8 valid = n - i >= 8 ? 0xff : (1u << (n - i)) - 1;
+    __mmask8 near = Near8<Metric>(valid,
+        _mm512_sub_pd(_mm512_maskz_loadu_pd(valid, x + i), px),
+        _mm512_sub_pd(_mm512_maskz_loadu_pd(valid, y + i), py),
+        _mm512_sub_pd(_mm512_maskz_loadu_pd(valid, z + i), pz), vbound);
+    *mask |= static_cast<uint64_t>(near) << i;
+  }
+  return n;
+}
+
+#endif  // HOT_HAVE_X86_KERNELS
+
+
+bool HOTKeyKernelSupported(HOTKeyKernel kernel) {
+  switch (kernel) {
+    case HOTKeyKernel::SCALAR:
+      return true;
+#ifdef HOT_HAVE_X86_KERNELS
+    case HOTKeyKernel::AVX2:
+      return __builtin_cpu_supports("avx2");
+    case HOTKeyKernel::AVX512:
+      return __builtin_cpu_supports("avx512f");
+#else
+    case HOTKeyKernel::AVX2:
+    case HOTKeyKernel::AVX512:
+      return false;
+#endif
+  }
+  return false;
+}
+
+HOTKeyKernel HOTBestKeyKernel() {
+  static const HOTKeyKernel best =
+    HOTKeyKernelSupported(HOTKeyKernel::AVX512) ? HOTKeyKernel::AVX512 :
+    HOTKeyKernelSupported(HOTKeyKernel::AVX2) ? HOTKeyKernel::AVX2 :
+    HOTKeyKernel::SCALAR;
+  return best;
+}
+
+const char* HOTKeyKernelName(HOTKeyKernel kernel) {
+  switch (kernel) {
+    case HOTKeyKernel::SCALAR: return "scalar";
+    case HOTKeyKernel::AVX2: return "avx2";
+    case HOTKeyKernel::AVX512: return "avx512";
+  }
+  return "unknown";
+}
+
+static int ComputeManyHashes(const HOTBoundingBox& bbox,
+    const double* locations, int n, int stride, HOTKey* keys, bool clamp,
+    HOTKeyKernel kernel) {
+  assert(HOTKeyKernelSupported(kernel));
+  int done = 0;
+  int num_outside = 0;
+#ifdef HOT_HAVE_X86_KERNELS
+  if (kernel == HOTKeyKernel::AVX512) {
+    done = ComputeManyHashesAvx512(bbox, locations, n, stride, keys, clamp,
+        &num_outside);
+  } else if (kernel == HOTKeyKernel::AVX2) {
+    done = ComputeManyHashesAvx2(bbox, locations, n, stride, keys, clamp,
+        &num_outside);
+  }
+#endif
+  for (int i = done; i < n; ++i) {
+    const double* l = locations + i * stride;
+    HOTPoint p({l[0], l[1], l[2]});
+    bool inside = InsideBox(bbox, p);
+    num_outside += !inside;
+    if (!inside && clamp) {
+      p = MoveIntoBox(bbox, HOTDomainMode::CLAMPED, p);
+    }
+    keys[i] = HOTComputeHash(bbox, p);
+  }
+  return num_outside;
+}
+
+int HOTComputeManyHashes(const HOTBoundingBox& bbox, const double* locations,
+    int n, int stride, HOTKey* keys, HOTKeyKernel kernel) {
+  return ComputeManyHashes(bbox, locations, n, stride, keys, false, kernel);
+}
+
+int HOTComputeManyClampedHashes(const HOTBoundingBox& bbox,
+    const double* locations, int n, int stride, HOTKey* keys,
+    HOTKeyKernel kernel) {
+  return ComputeManyHashes(bbox, locations, n, stride, keys, true, kernel);
+}
+
+int ComputeManyGridKeys(const HOTBoundingBox& bbox,
+    int log_nx, int log_ny, int log_nz, const double* locations, int n,
+    int stride, uint8_t* keys, int* num_outside, HOTKeyKernel kernel) {
+  assert(HOTKeyKernelSupported(kernel));
+  assert(log_nx + log_ny + log_nz <= 8);
+#ifdef HOT_HAVE_X86_KERNELS
+  if (kernel == HOTKeyKernel::AVX512) {
+    return ComputeManyGridKeysAvx512(bbox, log_nx, log_ny, log_nz, locations,
+        n, stride, keys, num_outside);
+  } else if (kernel == HOTKeyKernel::AVX2) {
+    return ComputeManyGridKeysAvx2(bbox, log_nx, log_ny, log_nz, locations,
+        n, stride, keys, num_outside);
+  }
+#else
+  (void)bbox; (void)log_nx; (void)log_ny; (void)log_nz; (void)locations;
+  (void)n; (void)stride; (void)keys; (void)num_outside;
+#endif
+  return 0;
+}
+
+template <HOTMetric Metric>
+static uint64_t NearMask(const double* x, const double* y, const double* z,
+    int n, HOTPoint position, double eps, HOTKeyKernel kernel) {
+  assert(HOTKeyKernelSupported(kernel));
+  assert(n <= 64);
+  double bound = HOTMetricBound(Metric, eps);
+  uint64_t mask = 0;
+  int done = 0;
+#ifdef HOT_HAVE_X86_KERNELS
+  if (kernel == HOTKeyKernel::AVX512) {
+    done = NearMaskAvx512<Metric>(x, y, z, n, position, bound, &mask);
+  } else if (kernel == HOTKeyKernel::AVX2) {
+    done = NearMaskAvx2<Metric>(x, y, z, n, position, bound, &mask);
+  }
+#endif
+  for (int i = done; i < n; ++i) {
+    bool near = HOTMetricDistance<Metric>(HOTPoint{x[i], y[i], z[i]},
+        position) < bound;
+    mask |= static_cast<uint64_t>(near) << i;
+  }
+  return mask;
+}
+
+uint64_t HOTNearMask(const double* x, const double* y, const double* z,
+    int n, HOTPoint position, double eps, HOTMetric metric,
+    HOTKeyKernel kernel) {
+  switch (metric) {
+    case HOTMetric::L2:
+      return NearMask<HOTMetric::L2>(x, y, z, n, position, eps, kernel);
+    case HOTMetric::L1:
+      return NearMask<HOTMetric::L1>(x, y, z, n, position, eps, kernel);
+    case HOTMetric::LINFINITY:
+      break;
+  }
+  return NearMask<HOTMetric::LINFINITY>(x, y, z, n, position, eps, kernel);
+}
+
+uint64_t HOTNearMask(const double* x, const double* y, const double* z,
+    int n, HOTPoint position, double eps, HOTMetric metric) {
+  return HOTNearMask(x, y, z, n, position, eps, metric, HOTBestKeyKernel());
+}
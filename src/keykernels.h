@@ -0,0 +1,56 @@
+#ifndef KEY_KERNELS_H
+#define KEY_KERNELS_H
+
+#include <hashedoctree.h>
+#include <cstdint>
+
+
+// Instruction sets of the batched key kernels. The kernel is picked at
+// runtime so that one binary runs on all x86-64 CPUs.
+enum class HOTKeyKernel : uint8_t {
+  SCALAR,
+  AVX2,
+  AVX512
+};
+
+// The fastest kernel supported by the CPU.
+HOTKeyKernel HOTBestKeyKernel();
+bool HOTKeyKernelSupported(HOTKeyKernel kernel);
+const char* HOTKeyKernelName(HOTKeyKernel kernel);
+
+// Computes HOTComputeHash(bbox, p) for the n locations p at locations,
+// which are stride doubles apart. The keys are identical for all kernels.
+// With a stride of four or more the vector kernels also read the double
+// after each location, like the data pointer of a HOTItem. Returns the
+// number of locations outside of bbox (see InsideBox), which comes for free
+// with the keys.
+int HOTComputeManyHashes(const HOTBoundingBox& bbox, const double* locations,
+    int n, int stride, HOTKey* keys,
+    HOTKeyKernel kernel = HOTBestKeyKernel());
+// Like HOTComputeManyHashes, but locations outside of bbox get the key of
+// the nearest location on bbox, as in the CLAMPED domain mode, instead of
+// being folded back. The vector kernels clamp in registers, so blocks with
+// such locations don't fall back to scalar code.
+int HOTComputeManyClampedHashes(const HOTBoundingBox& bbox,
+    const double* locations, int n, int stride, HOTKey* keys,
+    HOTKeyKernel kernel = HOTBestKeyKernel());
+
+// Keys of the cells holding the locations in a grid of 2^log_nx x 2^log_ny
+// x 2^log_nz cells over bbox like ComputeManyWideKeys. Only whole vectors
+// are done. Returns the number of locations done, the remaining ones are
+// left to the caller. The number of locations done that are outside of
+// bbox is added to *num_outside.
+int ComputeManyGridKeys(const HOTBoundingBox& bbox,
+    int log_nx, int log_ny, int log_nz, const double* locations, int n,
+    int stride, uint8_t* keys, int* num_outside, HOTKeyKernel kernel);
+
+// HOTNearMask with the given kernel. The masks are identical for all
+// kernels, except that for L2 the compiler may fuse the multiplies and adds
+// of some kernels. Their masks can then differ for positions whose squared
+// distance rounds to either side of eps * eps.
+uint64_t HOTNearMask(const double* x, const double* y, const double* z,
+    int n, HOTPoint position, double eps, HOTMetric metric,
+    HOTKeyKernel kernel);
+
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef MERGE_H
+#define MERGE_H
+
+#include <vector>
+
+
+// Merges the sorted sequences (a_keys, a_values) of length na and
+// (b_keys, b_values) of length nb into out_keys and out_values, which need
+// to have room for na + nb elements. The merge is stable: for equal keys the
+// pairs from a come first.
+template <typename Key, typename Value>
+void MergeSortedPairs(
+    const Key* a_keys, const Value* a_values, int na,
+    const Key* b_keys, const Value* b_values, int nb,
+    Key* out_keys, Value* out_values) {
+  int i = 0;
+  int j = 0;
+  int k = 0;
+  while (i < na && j < nb) {
+    if (b_keys[j] < a_keys[i]) {
+      out_keys[k] = b_keys[j];
+      out_values[k] = b_values[j];
+      ++j;
+    } else {
+      out_keys[k] = a_keys[i];
+      out_values[k] = a_values[i];
+      ++i;
+    }
+    ++k;
+  }
+  for (; i < na; ++i, ++k) {
+    out_keys[k] = a_keys[i];
+    out_values[k] = a_values[i];
+  }
+  for (; j < nb; ++j, ++k) {
+    out_keys[k] = b_keys[j];
+    out_values[k] = b_values[j];
+  }
+}
+
+// Number of elements of a that precede the k-th element of the stable merge
+// of a and b. This is where the merge path crosses the k-th anti-diagonal
+// and lets independent workers start merging at arbitrary output positions.
+template <typename Key>
+int MergePathSplit(const Key* a, int na, const Key* b, int nb, int k) {
+  int lo = k > nb ? k - nb : 0;
+  int hi = k < na ? k : na;
+  while (lo < hi) {
+    int i = lo + (hi - lo) / 2;
+    // a[i] belongs to the first k elements unless b[k - i - 1] is strictly
+    // smaller.
+    if (a[i] <= b[k - i - 1]) {
+      lo = i + 1;
+    } else {
+      hi = i;
+    }
+  }
+  return lo;
+}
+
+#endif
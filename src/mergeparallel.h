@@ -0,0 +1,45 @@
+#ifndef MERGE_PARALLEL_H
+#define MERGE_PARALLEL_H
+
+#include <merge.h>
+#include <algorithm>
+#include <cstdint>
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
+
+
+// Minimum number of output elements per block of the parallel merge.
+static const int MERGE_MIN_BLOCK_SIZE = 1 << 14;
+
+// Parallel version of MergeSortedPairs.
+//
+// The output is split into one block per thread. The start of each block
+// in a and b is found by a binary search along the merge path so that the
+// blocks can be merged independently.
+template <typename Key, typename Value>
+void ParallelMergeSortedPairs(
+    const Key* a_keys, const Value* a_values, int na,
+    const Key* b_keys, const Value* b_values, int nb,
+    Key* out_keys, Value* out_values) {
+  int n = na + nb;
+  int num_blocks = std::min(
+      std::max(1, n / MERGE_MIN_BLOCK_SIZE),
+      tbb::this_task_arena::max_concurrency());
+  auto block_begin = [n, num_blocks](int b) {
+    return static_cast<int>(static_cast<int64_t>(n) * b / num_blocks);
+  };
+  tbb::parallel_for(0, num_blocks, [&](int b) {
+      int k_begin = block_begin(b);
+      int k_end = block_begin(b + 1);
+      int i_begin = MergePathSplit(a_keys, na, b_keys, nb, k_begin);
+      int i_end = MergePathSplit(a_keys, na, b_keys, nb, k_end);
+      int j_begin = k_begin - i_begin;
+      int j_end = k_end - i_end;
+      MergeSortedPairs(
+          a_keys + i_begin, a_values + i_begin, i_end - i_begin,
+          b_keys + j_begin, b_values + j_begin, j_end - j_begin,
+          out_keys + k_begin, out_values + k_begin);
+    });
+}
+
+#endif
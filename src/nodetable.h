@@ -0,0 +1,73 @@
+#ifndef NODE_TABLE_H
+#define NODE_TABLE_H
+
+#include <cstdint>
+#include <vector>
+
+
+// Hash table from node keys to nodes with open addressing and linear
+// probing. Node keys are never zero, so zero marks empty slots.
+template <typename Key, typename Value>
+class HOTNodeTable {
+  public:
+    HOTNodeTable() : mask_(0) {}
+
+    // Removes all entries and makes room for n entries.
+    void Reset(size_t n) {
+      size_t capacity = 2;
+      // Keep the load factor at or below one half.
+      while (capacity < 2 * n) capacity *= 2;
+      keys_.assign(capacity, 0);
+      values_.resize(capacity);
+      mask_ = capacity - 1;
+    }
+
+    void Clear() {
+      keys_.clear();
+      values_.clear();
+      mask_ = 0;
+    }
+
+    void Insert(Key key, Value value) {
+      size_t i = Slot(key);
+      while (keys_[i] != 0 && keys_[i] != key) {
+        i = (i + 1) & mask_;
+      }
+      keys_[i] = key;
+      values_[i] = value;
+    }
+
+    bool Find(Key key, Value* value) const {
+      if (keys_.empty()) return false;
+      size_t i = Slot(key);
+      while (keys_[i] != 0) {
+        if (keys_[i] == key) {
+          *value = values_[i];
+          return true;
+        }
+        i = (i + 1) & mask_;
+      }
+      return false;
+    }
+
+    bool Empty() const {
+      return keys_.empty();
+    }
+
+    size_t Size() const {
+      return keys_.size() * (sizeof(Key) + sizeof(Value));
+    }
+
+  private:
+    std::vector<Key> keys_;
+    std::vector<Value> values_;
+    size_t mask_;
+
+    size_t Slot(Key key) const {
+      // Fibonacci hashing spreads the consecutive keys of siblings.
+      uint64_t h = static_cast<uint64_t>(key) * 0x9e3779b97f4a7c15ull;
+      return static_cast<size_t>(h >> 32) & mask_;
+    }
+};
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef RADIX_SORT_H
+#define RADIX_SORT_H
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+
+
+// Number of key bits handled in each pass of the radix sort. 11 bits give
+// three passes for 30 bit keys and six passes for 63 bit keys while the
+// histogram of a digit still fits comfortably in L1.
+static const int RADIX_BITS = 11;
+static const int RADIX_NUM_BUCKETS = 1 << RADIX_BITS;
+
+inline int RadixNumPasses(int num_bits) {
+  return (num_bits + RADIX_BITS - 1) / RADIX_BITS;
+}
+
+template <typename Key>
+inline int RadixDigit(Key key, int pass) {
+  return (key >> (pass * RADIX_BITS)) & (RADIX_NUM_BUCKETS - 1);
+}
+
+// Histograms of all digits of keys, computed in a single pass over the keys.
+// counts needs to have room for RadixNumPasses(num_bits) * RADIX_NUM_BUCKETS
+// entries and is overwritten.
+template <typename Key>
+void RadixHistograms(const Key* keys, int n, int num_bits, int* counts) {
+  int num_passes = RadixNumPasses(num_bits);
+  std::fill(counts, counts + num_passes * RADIX_NUM_BUCKETS, 0);
+  for (int i = 0; i < n; ++i) {
+    for (int pass = 0; pass < num_passes; ++pass) {
+      ++counts[pass * RADIX_NUM_BUCKETS + RadixDigit(keys[i], pass)];
+    }
+  }
+}
+
+// A pass can be skipped if all keys have the same digit.
+inline bool RadixPassIsTrivial(const int* counts, int n) {
+  for (int d = 0; d < RADIX_NUM_BUCKETS; ++d) {
+    if (counts[d] == n) return true;
+    if (counts[d] != 0) return false;
+  }
+  return false;
+}
+
+// Sorts keys and values together by the lowest num_bits bits of the keys.
+// This is a stable least significant digit radix sort. Keys and values are
+// moved together in each pass so no permutation has to be applied
+// afterwards. Passes in which all keys share the same digit are skipped.
+template <typename Key, typename Value>
+void RadixSortPairs(std::vector<Key>* keys, std::vector<Value>* values,
+    int num_bits) {
+  assert(keys->size() == values->size());
+  int n = keys->size();
+  if (n < 2) return;
+  int num_passes = RadixNumPasses(num_bits);
+  std::vector<int> counts(num_passes * RADIX_NUM_BUCKETS);
+  RadixHistograms(&(*keys)[0], n, num_bits, &counts[0]);
+
+  std::vector<Key> key_buffer;
+  std::vector<Value> value_buffer;
+  for (int pass = 0; pass < num_passes; ++pass) {
+    int* count = &counts[pass * RADIX_NUM_BUCKETS];
+    if (RadixPassIsTrivial(count, n)) continue;
+    if (key_buffer.empty()) {
+      key_buffer.resize(n);
+      value_buffer.resize(n);
+    }
+    int offset = 0;
+    for (int d = 0; d < RADIX_NUM_BUCKETS; ++d) {
+      int c = count[d];
+      count[d] = offset;
+      offset += c;
+    }
+    const Key* key_in = &(*keys)[0];
+    const Value* value_in = &(*values)[0];
+    Key* key_out = &key_buffer[0];
+    Value* value_out = &value_buffer[0];
+    for (int i = 0; i < n; ++i) {
+      int j = count[RadixDigit(key_in[i], pass)]++;
+      key_out[j] = key_in[i];
+      value_out[j] = value_in[i];
+    }
+    keys->swap(key_buffer);
+    values->swap(value_buffer);
+  }
+}
+
+#endif
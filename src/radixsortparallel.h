@@ -0,0 +1,137 @@
+#ifndef RADIX_SORT_PARALLEL_H
+#define RADIX_SORT_PARALLEL_H
+
+#include <radixsort.h>
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
+
+
+// Minimum number of keys per block of the parallel radix sort. Smaller
+// blocks don't amortize the cost of their histograms.
+static const int RADIX_MIN_BLOCK_SIZE = 1 << 14;
+
+// Parallel version of RadixSortPairs.
+//
+// The input is statically partitioned into one block per thread. In each
+// pass every block computes the histogram of its digits, a prefix sum over
+// (digit, block) pairs yields the output offset of each block's buckets,
+// and then the blocks scatter their keys and values concurrently. The
+// passes alternate between the output vectors and a scratch buffer such
+// that the last pass scatters directly into keys and values.
+//
+// keys_in and values_in are not modified. keys and values are resized to n.
+template <typename Key, typename Value>
+void ParallelRadixSortPairs(const Key* keys_in, const Value* values_in,
+    int n, int num_bits, std::vector<Key>* keys, std::vector<Value>* values) {
+  keys->resize(n);
+  values->resize(n);
+  if (n == 0) return;
+
+  int num_blocks = std::min(
+      std::max(1, n / RADIX_MIN_BLOCK_SIZE),
+      tbb::this_task_arena::max_concurrency());
+  auto block_begin = [n, num_blocks](int b) {
+    return static_cast<int>(static_cast<int64_t>(n) * b / num_blocks);
+  };
+  int num_passes = RadixNumPasses(num_bits);
+
+  // Global histograms of all digits tell us which passes can be skipped.
+  std::vector<int> block_counts(num_blocks * num_passes * RADIX_NUM_BUCKETS);
+  tbb::parallel_for(0, num_blocks, [&](int b) {
+      int begin = block_begin(b);
+      RadixHistograms(keys_in + begin, block_begin(b + 1) - begin, num_bits,
+          &block_counts[b * num_passes * RADIX_NUM_BUCKETS]);
+    });
+  std::vector<int> active_passes;
+  {
+    std::vector<int> counts(RADIX_NUM_BUCKETS);
+    for (int pass = 0; pass < num_passes; ++pass) {
+      std::fill(counts.begin(), counts.end(), 0);
+      for (int b = 0; b < num_blocks; ++b) {
+        const int* c =
+          &block_counts[(b * num_passes + pass) * RADIX_NUM_BUCKETS];
+        for (int d = 0; d < RADIX_NUM_BUCKETS; ++d) {
+          counts[d] += c[d];
+        }
+      }
+      if (!RadixPassIsTrivial(&counts[0], n)) active_passes.push_back(pass);
+    }
+  }
+
+  int num_active = active_passes.size();
+  if (num_active == 0) {
+    tbb::parallel_for(0, num_blocks, [&](int b) {
+        std::copy(keys_in + block_begin(b), keys_in + block_begin(b + 1),
+          keys->begin() + block_begin(b));
+        std::copy(values_in + block_begin(b), values_in + block_begin(b + 1),
+          values->begin() + block_begin(b));
+      });
+    return;
+  }
+
+  std::vector<Key> key_buffer;
+  std::vector<Value> value_buffer;
+  if (num_active > 1) {
+    key_buffer.resize(n);
+    value_buffer.resize(n);
+  }
+
+  // offsets[b * RADIX_NUM_BUCKETS + d] is where block b writes the next key
+  // with digit d.
+  std::vector<int> offsets(num_blocks * RADIX_NUM_BUCKETS);
+  const Key* key_src = keys_in;
+  const Value* value_src = values_in;
+  for (int i = 0; i < num_active; ++i) {
+    int pass = active_passes[i];
+    // Odd distance from the last pass writes to the scratch buffer.
+    bool to_output = (num_active - 1 - i) % 2 == 0;
+    Key* key_dst = to_output ? &(*keys)[0] : &key_buffer[0];
+    Value* value_dst = to_output ? &(*values)[0] : &value_buffer[0];
+
+    // The block histograms of the first pass were computed above. Later
+    // passes see a different distribution of keys over the blocks.
+    if (i > 0) {
+      tbb::parallel_for(0, num_blocks, [&](int b) {
+          int* c = &offsets[b * RADIX_NUM_BUCKETS];
+          std::fill(c, c + RADIX_NUM_BUCKETS, 0);
+          for (int j = block_begin(b); j < block_begin(b + 1); ++j) {
+            ++c[RadixDigit(key_src[j], pass)];
+          }
+        });
+    } else {
+      for (int b = 0; b < num_blocks; ++b) {
+        const int* c =
+          &block_counts[(b * num_passes + pass) * RADIX_NUM_BUCKETS];
+        std::copy(c, c + RADIX_NUM_BUCKETS, &offsets[b * RADIX_NUM_BUCKETS]);
+      }
+    }
+
+    int offset = 0;
+    for (int d = 0; d < RADIX_NUM_BUCKETS; ++d) {
+      for (int b = 0; b < num_blocks; ++b) {
+        int c = offsets[b * RADIX_NUM_BUCKETS + d];
+        offsets[b * RADIX_NUM_BUCKETS + d] = offset;
+        offset += c;
+      }
+    }
+    assert(offset == n);
+
+    tbb::parallel_for(0, num_blocks, [&](int b) {
+        int* offset = &offsets[b * RADIX_NUM_BUCKETS];
+        for (int j = block_begin(b); j < block_begin(b + 1); ++j) {
+          int k = offset[RadixDigit(key_src[j], pass)]++;
+          key_dst[k] = key_src[j];
+          value_dst[k] = value_src[j];
+        }
+      });
+
+    key_src = key_dst;
+    value_src = value_dst;
+  }
+}
+
+#endif
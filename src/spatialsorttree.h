@@ -2,6 +2,12 @@
 #define SPATIAL_SORT_TREE_H
 
 #include <vector>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <algorithm>
 
 
 struct HOTPoint {
@@ -20,22 +26,314 @@ struct HOTItem {
   void* data;
 };
 
+// Removed items are replaced by tombstones until the tree is compacted.
+// Tombstones are infinitely far away from every point, so queries never
+// visit them.
+inline HOTItem HOTTombstone() {
+  double inf = std::numeric_limits<double>::infinity();
+  return HOTItem{{inf, inf, inf}, nullptr};
+}
+
+// Compares the bits, because -ffinite-math-only folds std::isinf to false.
+inline bool HOTIsTombstone(const HOTItem& item) {
+  double inf = std::numeric_limits<double>::infinity();
+  return std::memcmp(&item.position.x, &inf, sizeof(inf)) == 0;
+}
+
+inline double LInfinity(const HOTPoint& p0, const HOTPoint& p1) {
+  double dist = 0;
+  dist = std::max(dist, std::fabs(p0.x - p1.x));
+  dist = std::max(dist, std::fabs(p0.y - p1.y));
+  dist = std::max(dist, std::fabs(p0.z - p1.z));
+  return dist;
+}
+
+inline double L2Squared(const HOTPoint& p0, const HOTPoint& p1) {
+  double dx = p0.x - p1.x;
+  double dy = p0.y - p1.y;
+  double dz = p0.z - p1.z;
+  return dx * dx + dy * dy + dz * dz;
+}
+
+inline double L1(const HOTPoint& p0, const HOTPoint& p1) {
+  return std::fabs(p0.x - p1.x) + std::fabs(p0.y - p1.y) +
+    std::fabs(p0.z - p1.z);
+}
+
+// Metrics of the queries. Items are near a position if they are less than
+// eps away from it in the metric, so LINFINITY finds the items in a cube
+// around the position and L2 those in a ball.
+enum class HOTMetric {
+  LINFINITY,
+  L2,
+  L1
+};
+
+// Distance between p0 and p1 in Metric. For L2 it is the squared distance,
+// which HOTMetricBound compares with eps * eps.
+template <HOTMetric Metric>
+inline double HOTMetricDistance(const HOTPoint& p0, const HOTPoint& p1) {
+  switch (Metric) {
+    case HOTMetric::L2:
+      return L2Squared(p0, p1);
+    case HOTMetric::L1:
+      return L1(p0, p1);
+    case HOTMetric::LINFINITY:
+      break;
+  }
+  return LInfinity(p0, p1);
+}
+
+// Points are near if their HOTMetricDistance is less than this bound.
+inline double HOTMetricBound(HOTMetric metric, double eps) {
+  return metric == HOTMetric::L2 ? eps * eps : eps;
+}
+
+// Copy of the positions of the items of a tree in tree order as separate x,
+// y and z arrays. items is the first item of the tree the copy was made
+// from.
+struct HOTPositionArrays {
+  const HOTItem* items = nullptr;
+  std::vector<double> x;
+  std::vector<double> y;
+  std::vector<double> z;
+};
+
+// Bit i of the result is set if the i-th of the n <= 64 positions
+// (x[i], y[i], z[i]) is within eps of position in metric, like
+// HOTMetricDistance(...) < HOTMetricBound(metric, eps). Uses the fastest
+// kernel supported by the CPU (see keykernels.h).
+uint64_t HOTNearMask(const double* x, const double* y, const double* z,
+    int n, HOTPoint position, double eps,
+    HOTMetric metric = HOTMetric::LINFINITY);
+
+inline bool HOTSameItem(const HOTItem& a, const HOTItem& b) {
+  return a.data == b.data &&
+    a.position.x == b.position.x &&
+    a.position.y == b.position.y &&
+    a.position.z == b.position.z;
+}
+
+// How a tree treats locations outside of its bounding box.
+//
+// Behaviour change: trees used to fold locations outside of the box back
+// into it for their keys only, without a mode to choose. Queries near the
+// faces then missed neighbours. Trees now default to OVERFLOW_LIST, which
+// finds exactly the items within eps of any query. Code that relied on
+// the folding should choose PERIODIC.
+enum class HOTDomainMode {
+  // The bounding box is one period of a periodic domain. Locations are
+  // folded back into the box, and queries find neighbours across opposite
+  // faces (minimum image convention). eps has to be at most half the
+  // smallest side of the box.
+  PERIODIC,
+  // Items keep their positions, but are sorted into the nodes as if they
+  // were clamped onto the bounding box. Queries search the nodes at the
+  // clamped query position and test the items against the query position
+  // itself, so results are exact. This is the cheapest mode for data that
+  // is known to be inside of the box, and data slightly outside of it
+  // only crowds the leaves on the faces.
+  CLAMPED,
+  // Items outside of the bounding box are kept in an overflow list behind
+  // the other items, which every query searches linearly.
+  OVERFLOW_LIST
+};
+
 
 class SpatialSortTree {
   public:
+    SpatialSortTree() = default;
+    SpatialSortTree(SpatialSortTree&&) = default;
+    SpatialSortTree& operator=(SpatialSortTree&&) = default;
     virtual ~SpatialSortTree() = default;
 
     virtual void InsertItems(const HOTItem* begin, const HOTItem* end) = 0;
 
+    class ItemRangeVisitor {
+      public:
+        virtual ~ItemRangeVisitor() = default;
+        // Visits the items in [begin, end), which can be within eps of
+        // position. position is where the tree searched, e.g. a periodic
+        // image of the query position.
+        virtual bool Visit(HOTPoint position, HOTItem* begin,
+            HOTItem* end) = 0;
+    };
+    // Visits ranges of items that together hold all items within eps of
+    // position in metric, e.g. the items of the leaves near position. Stops
+    // as soon as visitor returns false and returns whether it never did.
+    virtual bool VisitNearItemRanges(ItemRangeVisitor* visitor,
+        HOTPoint position, double eps,
+        HOTMetric metric = HOTMetric::LINFINITY) = 0;
+
+    // Calls visit(item) for the items within eps of position until visit
+    // returns false. Returns whether it never did. The nodes are
+    // traversed through VisitNearItemRanges, which costs a virtual call
+    // per range, but the loop over the items of a range inlines the
+    // distance test and visit. With position arrays the loop only calls
+    // visit for the set bits of HOTNearMask. HOTTree and WideTree have
+    // their own VisitNear that inlines the traversal as well.
+    template <typename Callable>
+    bool VisitNear(HOTPoint position, double eps, Callable visit) {
+      return VisitNearInMetric<HOTMetric::LINFINITY>(position, eps, &visit);
+    }
+
+    // Like VisitNear for the items within eps of position in metric.
+    template <typename Callable>
+    bool VisitNear(HOTPoint position, double eps, HOTMetric metric,
+        Callable visit) {
+      switch (metric) {
+        case HOTMetric::L2:
+          return VisitNearInMetric<HOTMetric::L2>(position, eps, &visit);
+        case HOTMetric::L1:
+          return VisitNearInMetric<HOTMetric::L1>(position, eps, &visit);
+        case HOTMetric::LINFINITY:
+          break;
+      }
+      return VisitNearInMetric<HOTMetric::LINFINITY>(position, eps, &visit);
+    }
+
     class VertexVisitor {
       public:
         virtual ~VertexVisitor() = default;
         virtual bool Visit(HOTItem* item) = 0;
     };
     virtual bool VisitNearVertices(VertexVisitor* visitor, HOTPoint position, double eps) = 0;
+    // Like VisitNearVertices for the items within eps of position in
+    // metric.
+    virtual bool VisitNearVertices(VertexVisitor* visitor, HOTPoint position,
+        double eps, HOTMetric metric) {
+      return VisitNear(position, eps, metric, [visitor](HOTItem* item) {
+          return visitor->Visit(item);
+        });
+    }
+
+    class BatchVisitor {
+      public:
+        virtual ~BatchVisitor() = default;
+        // Visits item near the point with index point of the batch.
+        // Returning false stops the visits for that point only.
+        virtual bool Visit(int point, HOTItem* item) = 0;
+    };
+    // Visits the items near each of the n points, like calling
+    // VisitNearVertices for every point. The visits of different points
+    // can interleave. This implementation does exactly that. Trees
+    // override it to traverse their nodes once for the whole batch.
+    virtual void VisitNearVerticesBatch(BatchVisitor* visitor,
+        const HOTPoint* points, int n, double eps,
+        HOTMetric metric = HOTMetric::LINFINITY) {
+      for (int i = 0; i < n; ++i) {
+        VisitNear(points[i], eps, metric, [visitor, i](HOTItem* item) {
+            return visitor->Visit(i, item);
+          });
+      }
+    }
+
+    // Stores the k items nearest to position in metric in *nearest, nearest
+    // first, or all items if the tree holds fewer. Unlike the eps queries
+    // it needs no radius: the nodes are searched nearest first, and the
+    // search radius shrinks to the k-th nearest item found so far. The
+    // domain mode applies like for VisitNearItemRanges. Unlike for the eps
+    // queries the default metric is L2.
+    virtual void KNearest(HOTPoint position, int k,
+        std::vector<HOTItem*>* nearest,
+        HOTMetric metric = HOTMetric::L2) = 0;
 
     virtual std::vector<HOTItem>::iterator begin() = 0;
     virtual std::vector<HOTItem>::iterator end() = 0;
+
+    // With position arrays the tree keeps a copy of the item positions in
+    // HOTPositionArrays, and VisitNear tests up to eight items per
+    // instruction in them. They cost 24 bytes per item, and every change
+    // of the items has to update them. Changes through begin() and end()
+    // aren't picked up.
+    void SetUsePositionArrays(bool use_position_arrays) {
+      use_position_arrays_ = use_position_arrays;
+      UpdatePositionArrays();
+    }
+
+  protected:
+    bool use_position_arrays_ = false;
+    HOTPositionArrays positions_;
+
+    // Copies the positions of all items if the tree uses position arrays.
+    // Trees call this whenever they replace their items.
+    void UpdatePositionArrays() {
+      positions_ = HOTPositionArrays();
+      if (!use_position_arrays_ || begin() == end()) return;
+      size_t n = end() - begin();
+      positions_.items = &*begin();
+      positions_.x.resize(n);
+      positions_.y.resize(n);
+      positions_.z.resize(n);
+      UpdatePositionArrays(0, n);
+    }
+    // Copies the positions of the items [first, last) only, after they
+    // changed in place.
+    void UpdatePositionArrays(size_t first, size_t last) {
+      if (!use_position_arrays_) return;
+      for (size_t i = first; i < last; ++i) {
+        const HOTPoint& p = positions_.items[i].position;
+        positions_.x[i] = p.x;
+        positions_.y[i] = p.y;
+        positions_.z[i] = p.z;
+      }
+    }
+
+    // Calls visit for the items of the ranges within eps of the position in
+    // Metric. It is final, so that trees that traverse their nodes for it
+    // directly call Visit without a virtual call.
+    template <HOTMetric Metric, typename Callable>
+    class NearItemsVisitor final : public ItemRangeVisitor {
+      public:
+        NearItemsVisitor(Callable* visit, double eps,
+            const HOTPositionArrays* positions) :
+          visit_(visit), eps_(eps), bound_(HOTMetricBound(Metric, eps)),
+          positions_(positions) {}
+        bool Visit(HOTPoint position, HOTItem* begin,
+            HOTItem* end) override {
+          if (positions_) {
+            return VisitPositions(position, begin, end);
+          }
+          for (HOTItem* item = begin; item != end; ++item) {
+            if (HOTMetricDistance<Metric>(item->position, position) <
+                bound_) {
+              if (!(*visit_)(item)) return false;
+            }
+          }
+          return true;
+        }
+      private:
+        Callable* visit_;
+        double eps_;
+        double bound_;
+        const HOTPositionArrays* positions_;
+
+        bool VisitPositions(HOTPoint position, HOTItem* begin,
+            HOTItem* end) {
+          size_t first = begin - positions_->items;
+          size_t n = end - begin;
+          for (size_t i = 0; i < n; i += 64) {
+            uint64_t mask = HOTNearMask(&positions_->x[first + i],
+                &positions_->y[first + i], &positions_->z[first + i],
+                static_cast<int>(std::min<size_t>(n - i, 64)), position,
+                eps_, Metric);
+            while (mask) {
+              int bit = __builtin_ctzll(mask);
+              mask &= mask - 1;
+              if (!(*visit_)(begin + i + bit)) return false;
+            }
+          }
+          return true;
+        }
+    };
+
+  private:
+    template <HOTMetric Metric, typename Callable>
+    bool VisitNearInMetric(HOTPoint position, double eps, Callable* visit) {
+      NearItemsVisitor<Metric, Callable> range_visitor(visit, eps,
+          use_position_arrays_ ? &positions_ : nullptr);
+      return VisitNearItemRanges(&range_visitor, position, eps, Metric);
+    }
 };
 
 #endif
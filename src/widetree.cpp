@@ -1,44 +1,178 @@
 #include <widetree.h>
 #include <helpers.h>
+#include <bitset>
 #include <cassert>
 #include <cmath>
+#include <limits>
+#include <algorithm>
+#include <numeric>
 
 
+// The same bucket as in ComputeManyWideKeys. Locations outside of [min, max]
+// are folded back periodically.
 static uint8_t ComputeBucket(double min, double max, double pos, int num_buckets) {
+  // Axes without extent are never split (see ChooseWideSplit).
+  if (num_buckets == 1) return 0;
   assert(max > min);
-  double folded_pos = std::fmod(pos - min, max - min);
-  if (folded_pos < 0) {
-    folded_pos += max - min;
+  double width = max - min;
+  double offset = pos - min;
+  if (!(pos >= min && pos <= max)) {
+    offset = std::fmod(offset, width);
+    if (offset < 0) {
+      offset += width;
+    }
+  }
+  // Locations on the upper face belong to the last bucket like in
+  // ComputeManyWideKeys.
+  return std::min(static_cast<int>(offset * (num_buckets / width)),
+      num_buckets - 1);
+}
+
+static constexpr int Log2(int n) {
+  return n > 1 ? 1 + Log2(n / 2) : 0;
+}
+
+WideSplitFactors GetWideSplitFactors(WideSplit split) {
+  switch (split) {
+    case WideSplit::SPLIT_8x8x4: return {8, 8, 4};
+    case WideSplit::SPLIT_4x4x4: return {4, 4, 4};
+    case WideSplit::SPLIT_16x16x1: return {16, 16, 1};
+    case WideSplit::SPLIT_2x2x2: return {2, 2, 2};
+    case WideSplit::ADAPTIVE: break;
   }
-  uint8_t bucket = num_buckets * folded_pos / (max - min);
-  assert(bucket < num_buckets);
-  return bucket;
+  assert(false);
+  return {8, 8, 4};
 }
 
+WideSplit ChooseWideSplit(const HOTBoundingBox& bbox) {
+  static const WideSplit splits[] = {WideSplit::SPLIT_8x8x4,
+    WideSplit::SPLIT_16x16x1, WideSplit::SPLIT_4x4x4, WideSplit::SPLIT_2x2x2};
+  WideSplit best = splits[0];
+  double best_ratio = std::numeric_limits<double>::max();
+  double extents[3] = {bbox.max.x - bbox.min.x, bbox.max.y - bbox.min.y,
+    bbox.max.z - bbox.min.z};
+  for (WideSplit split : splits) {
+    WideSplitFactors f = GetWideSplitFactors(split);
+    int factors[3] = {f.nx, f.ny, f.nz};
+    double longest = 0;
+    double shortest = std::numeric_limits<double>::max();
+    bool splits_flat_axis = false;
+    for (int d = 0; d < 3; ++d) {
+      if (extents[d] > 0) {
+        double length = extents[d] / factors[d];
+        longest = std::max(longest, length);
+        shortest = std::min(shortest, length);
+      } else if (factors[d] > 1) {
+        splits_flat_axis = true;
+      }
+    }
+    // Splitting an axis without extent, e.g. of planar data, only adds
+    // empty cells. The other axes decide among the remaining splits.
+    if (splits_flat_axis) continue;
+    // Ratio of the longest to the shortest side of the cells.
+    double ratio = longest / shortest;
+    if (ratio < best_ratio) {
+      best = split;
+      best_ratio = ratio;
+    }
+  }
+  return best;
+}
+
+template <int NX, int NY, int NZ>
 uint8_t ComputeWideKey(const HOTBoundingBox& bbox, HOTPoint point) {
-  uint8_t a, b, c;
-  a = ComputeBucket(bbox.min.x, bbox.max.x, point.x, 8);
-  assert(a < 8);
-  b = ComputeBucket(bbox.min.y, bbox.max.y, point.y, 8);
-  assert(b < 8);
-  c = ComputeBucket(bbox.min.z, bbox.max.z, point.z, 4);
-  assert(c < 4);
-  return (a << 5) + (b << 2) + (c << 0);
-}
-
-void ComputeManyWideKeys(const HOTBoundingBox& bbox, const double* locations,
-    int n, int stride, uint8_t* keys) {
-  double dx = (bbox.max.x - bbox.min.x) / 8;
-  double dy = (bbox.max.y - bbox.min.y) / 8;
-  double dz = (bbox.max.z - bbox.min.z) / 4;
-  for (int i = 0; i < n; ++i) {
-    uint8_t a, b, c;
+  static_assert(NX * NY * NZ <= 256, "Too many cells for uint8_t keys");
+  int a = ComputeBucket(bbox.min.x, bbox.max.x, point.x, NX);
+  int b = ComputeBucket(bbox.min.y, bbox.max.y, point.y, NY);
+  int c = ComputeBucket(bbox.min.z, bbox.max.z, point.z, NZ);
+  return (a * NY + b) * NZ + c;
+}
+
+template <int NX, int NY, int NZ>
+int ComputeManyWideKeys(const HOTBoundingBox& bbox, const double* locations,
+    int n, int stride, uint8_t* keys, HOTKeyKernel kernel) {
+  static_assert(NX * NY * NZ <= 256, "Too many cells for uint8_t keys");
+  static_assert((NX & (NX - 1)) == 0 && (NY & (NY - 1)) == 0 &&
+      (NZ & (NZ - 1)) == 0, "Split factors need to be powers of two");
+  // Axes that aren't split may have no extent, their scale is zero.
+  double sx = NX > 1 ? NX / (bbox.max.x - bbox.min.x) : 0;
+  double sy = NY > 1 ? NY / (bbox.max.y - bbox.min.y) : 0;
+  double sz = NZ > 1 ? NZ / (bbox.max.z - bbox.min.z) : 0;
+  int num_outside = 0;
+  int done = ComputeManyGridKeys(bbox, Log2(NX), Log2(NY), Log2(NZ),
+      locations, n, stride, keys, &num_outside, kernel);
+  for (int i = done; i < n; ++i) {
     const double *l = locations + i * stride;
-    a = (l[0] - bbox.min.x) / dx;
-    b = (l[1] - bbox.min.y) / dy;
-    c = (l[2] - bbox.min.z) / dz;
-    keys[i] = (a << 5) + (b << 2) + (c << 0);
+    num_outside += !InsideBox(bbox, HOTPoint({l[0], l[1], l[2]}));
+    // Locations on the upper faces of bbox belong to the last cell like in
+    // ComputeWideKey. Clamping also catches locations that rounding puts
+    // just outside of bbox.
+    int a = std::min(std::max(
+          static_cast<int>((l[0] - bbox.min.x) * sx), 0), NX - 1);
+    int b = std::min(std::max(
+          static_cast<int>((l[1] - bbox.min.y) * sy), 0), NY - 1);
+    int c = std::min(std::max(
+          static_cast<int>((l[2] - bbox.min.z) * sz), 0), NZ - 1);
+    keys[i] = (a * NY + b) * NZ + c;
   }
+  return num_outside;
+}
+
+#define INSTANTIATE_WIDE_KEYS(NX, NY, NZ) \
+  template uint8_t ComputeWideKey<NX, NY, NZ>( \
+      const HOTBoundingBox& bbox, HOTPoint point); \
+  template int ComputeManyWideKeys<NX, NY, NZ>(const HOTBoundingBox& bbox, \
+      const double* locations, int n, int stride, uint8_t* keys, \
+      HOTKeyKernel kernel);
+INSTANTIATE_WIDE_KEYS(8, 8, 4)
+INSTANTIATE_WIDE_KEYS(4, 4, 4)
+INSTANTIATE_WIDE_KEYS(16, 16, 1)
+INSTANTIATE_WIDE_KEYS(2, 2, 2)
+#undef INSTANTIATE_WIDE_KEYS
+
+uint8_t ComputeWideKey(const HOTBoundingBox& bbox, HOTPoint point) {
+  return ComputeWideKey<8, 8, 4>(bbox, point);
+}
+
+int ComputeManyWideKeys(const HOTBoundingBox& bbox, const double* locations,
+    int n, int stride, uint8_t* keys, HOTKeyKernel kernel) {
+  return ComputeManyWideKeys<8, 8, 4>(bbox, locations, n, stride, keys,
+      kernel);
+}
+
+uint8_t ComputeWideKey(WideSplit split, const HOTBoundingBox& bbox,
+    HOTPoint point) {
+  switch (split) {
+    case WideSplit::SPLIT_8x8x4: return ComputeWideKey<8, 8, 4>(bbox, point);
+    case WideSplit::SPLIT_4x4x4: return ComputeWideKey<4, 4, 4>(bbox, point);
+    case WideSplit::SPLIT_16x16x1: return ComputeWideKey<16, 16, 1>(bbox, point);
+    case WideSplit::SPLIT_2x2x2: return ComputeWideKey<2, 2, 2>(bbox, point);
+    case WideSplit::ADAPTIVE: break;
+  }
+  assert(false);
+  return 0;
+}
+
+int ComputeManyWideKeys(WideSplit split, const HOTBoundingBox& bbox,
+    const double* locations, int n, int stride, uint8_t* keys,
+    HOTKeyKernel kernel) {
+  switch (split) {
+    case WideSplit::SPLIT_8x8x4:
+      return ComputeManyWideKeys<8, 8, 4>(bbox, locations, n, stride, keys,
+          kernel);
+    case WideSplit::SPLIT_4x4x4:
+      return ComputeManyWideKeys<4, 4, 4>(bbox, locations, n, stride, keys,
+          kernel);
+    case WideSplit::SPLIT_16x16x1:
+      return ComputeManyWideKeys<16, 16, 1>(bbox, locations, n, stride, keys,
+          kernel);
+    case WideSplit::SPLIT_2x2x2:
+      return ComputeManyWideKeys<2, 2, 2>(bbox, locations, n, stride, keys,
+          kernel);
+    case WideSplit::ADAPTIVE: break;
+  }
+  assert(false);
+  return 0;
 }
 
 void SortByKey(const uint8_t* keys, int n, int buckets[257], int* perm) {
@@ -56,97 +190,339 @@ void SortByKey(const uint8_t* keys, int n, int buckets[257], int* perm) {
   }
 }
 
-class WideNode {
-  public:
-    WideNode(HOTBoundingBox bbox) : bbox_(bbox) {}
+static HOTBoundingBox ChildBoundingBox(const HOTBoundingBox& bbox,
+    const WideSplitFactors& f, int key) {
+  double dx = (bbox.max.x - bbox.min.x) / f.nx;
+  double dy = (bbox.max.y - bbox.min.y) / f.ny;
+  double dz = (bbox.max.z - bbox.min.z) / f.nz;
+  int a = key / (f.ny * f.nz);
+  int b = (key / f.nz) % f.ny;
+  int c = key % f.nz;
+  return HOTBoundingBox{
+      {bbox.min.x + a * dx, bbox.min.y + b * dy, bbox.min.z + c * dz},
+      {bbox.min.x + (a + 1) * dx, bbox.min.y + (b + 1) * dy, bbox.min.z + (c + 1) * dz}};
+}
 
-    void InsertItemsInPlace(HOTItem* begin, HOTItem* end, int max_num_leaf_items) {
-      int n = std::distance(begin, end);
-      if (n == 0) {
-        items_begin_ = begin;
-        items_end_ = end;
-        return;
-      }
-      std::vector<HOTItem> temp(n);
-      InsertItems(begin, end, &temp[0], max_num_leaf_items);
-      std::copy(temp.begin(), temp.end(), begin);
-      items_begin_ = begin;
-      items_end_ = end;
+WideNode::~WideNode() {}
+
+void WideLeafNode::VisitNearVerticesBatch(HOTBatchTraversal* traversal,
+    size_t first, size_t last) {
+  VisitItemsNearBatch(items_begin_, items_end_, traversal, first, last);
+}
+
+HOTItem* WideLeafNode::FindItem(const HOTItem& item, HOTPoint,
+    const HOTBoundingBox** leaf_bbox) {
+  for (HOTItem* i = items_begin_; i != items_end_; ++i) {
+    if (HOTSameItem(*i, item)) {
+      *leaf_bbox = &bbox_;
+      return i;
     }
+  }
+  return nullptr;
+}
 
-    void InsertItems(const HOTItem* begin, const HOTItem* end,
-        HOTItem* sorted_items, int max_num_leaf_items) {
-      items_begin_ = sorted_items;
-      items_end_ = sorted_items + std::distance(begin, end);
-      int n = std::distance(begin, end);
-      if (n <= max_num_leaf_items) {
-        std::copy(begin, end, sorted_items);
-        return;
-      }
-      std::vector<uint8_t> keys(n);
-      ComputeManyWideKeys(bbox_, &begin->position.x, n, 4, &keys[0]);
-      std::vector<int> perm(n);
-      SortByKey(&keys[0], n, buckets_, &perm[0]);
-      ApplyPermutation(&perm[0], n, begin, sorted_items);
-      double dx = (bbox_.max.x - bbox_.min.x) / 8;
-      double dy = (bbox_.max.y - bbox_.min.y) / 8;
-      double dz = (bbox_.max.z - bbox_.min.z) / 4;
-      for (int i = 0; i < 256; ++i) {
-        if (buckets_[i + 1] - buckets_[i] == 0) continue;
-        if (!children_[i]) {
-          int a = (i >> 5) & 0x7;
-          int b = (i >> 2) & 0x7;
-          int c = (i >> 0) & 0x3;
-          HOTBoundingBox child_box{
-              {bbox_.min.x + a * dx, bbox_.min.y + b * dy, bbox_.min.z + c * dz},
-              {bbox_.min.x + (a + 1) * dx, bbox_.min.y + (b + 1) * dy, bbox_.min.z + (c + 1) * dz}};
-          children_[i].reset(new WideNode(child_box));
-        }
-        children_[i]->InsertItemsInPlace(
-            items_begin_ + buckets_[i], items_begin_ + buckets_[i + 1], max_num_leaf_items);
+void WideLeafNode::Relocate(HOTItem** out) {
+  HOTItem* begin = *out;
+  *out = std::copy(items_begin_, items_end_, *out);
+  items_begin_ = begin;
+  items_end_ = *out;
+}
+
+int WideLeafNode::NumNodes() const {
+  return 1;
+}
+
+size_t WideLeafNode::Size() const {
+  return sizeof(*this);
+}
+
+template <HOTMetric Metric, typename Push>
+void WideInnerNode::PushChildrenNearer(HOTPoint position, double bound,
+    Push push) const {
+  WideSplitFactors f = GetWideSplitFactors(split_);
+  // Distances along each axis from the cells, like ChildBoundingBox.
+  double dx[16];
+  double dy[16];
+  double dz[16];
+  CellDistances(bbox_.min.x, bbox_.max.x, f.nx, position.x, dx);
+  CellDistances(bbox_.min.y, bbox_.max.y, f.ny, position.y, dy);
+  CellDistances(bbox_.min.z, bbox_.max.z, f.nz, position.z, dz);
+  // The cells are visited in key order, which is the order of
+  // children_.
+  int key = 0;
+  int index = 0;
+  for (int a = 0; a < f.nx; ++a) {
+    for (int b = 0; b < f.ny; ++b) {
+      for (int c = 0; c < f.nz; ++c, ++key) {
+        if (!HasChild(key)) continue;
+        double distance = AxisDistancesInMetric<Metric>(dx[a], dy[b],
+            dz[c]);
+        if (distance < bound) push(children_[index].get(), distance);
+        ++index;
       }
     }
+  }
+}
 
-    bool VisitNearVertices(SpatialSortTree::VertexVisitor* visitor,
-        HOTPoint visitor_position, double eps2) {
-      uint8_t key = ComputeWideKey(bbox_, visitor_position);
-      WideNode* selected_child = children_[key].get();
-      if (selected_child &&
-          DistanceFromBoundary(selected_child->bbox_, visitor_position) > eps2) {
-        return selected_child->VisitNearVertices(visitor, visitor_position, eps2);
-      }
-      bool leaf = true;
-      for (int i = 0; i < 256; ++i) {
-        if (children_[i]) {
-          leaf = false;
-          if (LInfinity(children_[i]->bbox_, visitor_position) < eps2) {
-            if (!children_[i]->VisitNearVertices(
-                  visitor, visitor_position, eps2)) {
-              return false;
+void WideInnerNode::VisitNearVerticesBatch(HOTBatchTraversal* traversal,
+    size_t first, size_t last) {
+  WideSplitFactors f = GetWideSplitFactors(split_);
+  size_t offsets[257];
+  PartitionBatchQueries<256>(traversal, first, last,
+      [this, &f, traversal](const HOTPoint& position, int q,
+        std::vector<std::pair<int, int>>* pairs) {
+        // Same shortcut as in VisitNearItemRanges.
+        uint8_t key = ComputeWideKey(split_, bbox_, position);
+        WideNode* child = Child(key);
+        if (child && LInfinity(child->bbox_, position) == 0 &&
+            DistanceFromBoundary(child->bbox_, position) > traversal->eps) {
+          pairs->push_back(std::make_pair(key, q));
+          return;
+        }
+        int a0, a1, b0, b1, c0, c1;
+        OverlappingCellRanges(f, position, traversal->eps,
+            &a0, &a1, &b0, &b1, &c0, &c1);
+        for (int a = a0; a <= a1; ++a) {
+          for (int b = b0; b <= b1; ++b) {
+            for (int c = c0; c <= c1; ++c) {
+              int key = (a * f.ny + b) * f.nz + c;
+              if (HasChild(key)) pairs->push_back(std::make_pair(key, q));
             }
           }
         }
-      }
-      if (!leaf) return true;
-      int n = std::distance(items_begin_, items_end_);
-      for (int i = 0; i < n; ++i) {
-        if (LInfinity(items_begin_[i].position, visitor_position) < eps2) {
-           bool cont = visitor->Visit(&items_begin_[i]);
-           if (!cont) return false;
+      }, offsets);
+  int index = 0;
+  for (int key = 0; key < 256; ++key) {
+    if (!HasChild(key)) continue;
+    if (offsets[key + 1] > offsets[key]) {
+      children_[index]->VisitNearVerticesBatch(traversal,
+          offsets[key], offsets[key + 1]);
+    }
+    ++index;
+  }
+  traversal->active.resize(offsets[0]);
+}
+
+HOTItem* WideInnerNode::FindItem(const HOTItem& item, HOTPoint key_position,
+    const HOTBoundingBox** leaf_bbox) {
+  for (const auto& child : children_) {
+    // Items on the boundary between children could be in either of
+    // them.
+    if (LInfinity(child->bbox_, key_position) == 0) {
+      HOTItem* found = child->FindItem(item, key_position, leaf_bbox);
+      if (found) return found;
+    }
+  }
+  return nullptr;
+}
+
+void WideInnerNode::Relocate(HOTItem** out) {
+  for (const auto& child : children_) {
+    child->Relocate(out);
+  }
+}
+
+int WideInnerNode::NumNodes() const {
+  int num_nodes = 1;
+  for (const auto& child : children_) {
+    num_nodes += child->NumNodes();
+  }
+  return num_nodes;
+}
+
+size_t WideInnerNode::Size() const {
+  size_t size = sizeof(*this);
+  size += children_.capacity() * sizeof(children_[0]);
+  for (const auto& child : children_) {
+    size += child->Size();
+  }
+  return size;
+}
+
+void WideInnerNode::CellDistances(double a, double b, int n, double x,
+    double* distances) {
+  assert(n <= 16);
+  double d = (b - a) / n;
+  for (int i = 0; i < n; ++i) {
+    distances[i] = DistanceFromInterval(a + i * d, a + (i + 1) * d, x);
+  }
+}
+
+template <HOTMetric Metric>
+void WideNode::SearchNearest(WideNode* root, HOTPoint position,
+    HOTNearestItems* nearest) {
+  struct Entry {
+    WideNode* node;
+    double distance;
+  };
+  // Until the bound shrinks a node can push all of its children, so there
+  // is room for those of a few levels.
+  HOTTraversalStack<Entry, 4 * 256> stack;
+  stack.Push(Entry{root, BoxDistance<Metric>(root->bbox_, position)});
+  while (!stack.Empty()) {
+    Entry entry = stack.Pop();
+    // The bound may have shrunk since the entry was pushed.
+    if (entry.distance >= nearest->Bound()) continue;
+    if (entry.node->IsLeaf()) {
+      static_cast<WideLeafNode*>(entry.node)->ScanNearest<Metric>(position,
+          nearest);
+      continue;
+    }
+    Entry children[256];
+    int num_children = 0;
+    static_cast<WideInnerNode*>(entry.node)->PushChildrenNearer<Metric>(
+        position, nearest->Bound(),
+        [&children, &num_children](WideNode* child, double distance) {
+          children[num_children++] = Entry{child, distance};
+        });
+    // Same order as in HOTNode::SearchNearest.
+    std::sort(children, children + num_children,
+        [](const Entry& a, const Entry& b) {
+          return a.distance > b.distance;
+        });
+    for (int i = 0; i < num_children; ++i) {
+      stack.Push(children[i]);
+    }
+  }
+}
+
+std::unique_ptr<WideNode> WideNode::Build(WideTree* tree,
+    const HOTBoundingBox& bbox, const HOTItem* begin, const HOTItem* end,
+    HOTItem* sorted_items, HOTItem* spare_items, int max_num_leaf_items,
+    int* num_outside) {
+  int n = std::distance(begin, end);
+  // The CLAMPED keys put the items outside of bbox onto its faces, so all
+  // of them go into the nodes.
+  bool clamped = tree->domain_mode_ == HOTDomainMode::CLAMPED;
+  if (n <= max_num_leaf_items) {
+    *num_outside = clamped ? 0 :
+      std::count_if(begin, end, [&bbox](const HOTItem& item) {
+          return !InsideBox(bbox, item.position);
+        });
+    if (*num_outside > 0) return nullptr;
+    std::copy(begin, end, sorted_items);
+    return std::unique_ptr<WideNode>(
+        new WideLeafNode(bbox, sorted_items, sorted_items + n));
+  }
+  WideSplit split = NodeSplit(tree, bbox);
+  int buckets[257];
+  *num_outside = tree->SortByWideKey(bbox, split, begin, n, sorted_items,
+      buckets);
+  if (clamped) *num_outside = 0;
+  if (*num_outside > 0) return nullptr;
+  return BuildInner(tree, bbox, split, sorted_items, spare_items, false,
+      buckets, max_num_leaf_items);
+}
+
+std::unique_ptr<WideNode> WideNode::BuildLevel(WideTree* tree,
+    const HOTBoundingBox& bbox, HOTItem* items, HOTItem* spare_items, int n,
+    bool in_spare, int max_num_leaf_items) {
+  if (n <= max_num_leaf_items) {
+    if (in_spare) std::copy(spare_items, spare_items + n, items);
+    return std::unique_ptr<WideNode>(new WideLeafNode(bbox, items, items + n));
+  }
+  WideSplit split = NodeSplit(tree, bbox);
+  int buckets[257];
+  if (!spare_items) {
+    WideNodeScratch* scratch = tree->LocalScratch();
+    if (scratch->items.size() < size_t(n)) scratch->items.resize(n);
+    tree->SortByWideKey(bbox, split, items, n, &scratch->items[0], buckets);
+    std::copy(scratch->items.begin(), scratch->items.begin() + n, items);
+    return BuildInner(tree, bbox, split, items, spare_items, false, buckets,
+        max_num_leaf_items);
+  }
+  if (in_spare) {
+    tree->SortByWideKey(bbox, split, spare_items, n, items, buckets);
+  } else {
+    tree->SortByWideKey(bbox, split, items, n, spare_items, buckets);
+  }
+  return BuildInner(tree, bbox, split, items, spare_items, !in_spare,
+      buckets, max_num_leaf_items);
+}
+
+WideSplit WideNode::NodeSplit(const WideTree* tree,
+    const HOTBoundingBox& bbox) {
+  if (tree->split_ == WideSplit::ADAPTIVE) return ChooseWideSplit(bbox);
+  return tree->split_;
+}
+
+std::unique_ptr<WideNode> WideNode::BuildInner(WideTree* tree,
+    const HOTBoundingBox& bbox, WideSplit split, HOTItem* items,
+    HOTItem* spare_items, bool in_spare, const int buckets[257],
+    int max_num_leaf_items) {
+  WideInnerNode* inner = new WideInnerNode(bbox, split);
+  std::unique_ptr<WideNode> node(inner);
+  // The occupancy and the child slots are set up front so that the
+  // children can be built concurrently.
+  int num_children = 0;
+  for (int i = 0; i < 256; ++i) {
+    if (buckets[i + 1] > buckets[i]) {
+      inner->occupancy_[i >> 6] |= uint64_t(1) << (i & 63);
+      ++num_children;
+    }
+  }
+  inner->children_.resize(num_children);
+  WideSplitFactors f = GetWideSplitFactors(split);
+  tree->BuildChildren(buckets[256], [&](int i) {
+      if (!inner->HasChild(i)) return;
+      inner->children_[inner->ChildIndex(i)] = BuildLevel(tree,
+          ChildBoundingBox(bbox, f, i), items + buckets[i],
+          spare_items ? spare_items + buckets[i] : nullptr,
+          buckets[i + 1] - buckets[i], in_spare, max_num_leaf_items);
+    });
+  return node;
+}
+
+std::unique_ptr<WideNode> WideNode::Reinsert(WideTree* tree,
+    std::unique_ptr<WideNode> node, const HOTBoundingBox& bbox,
+    const HOTItem* added, int n, HOTItem** out) {
+  if (n == 0) {
+    if (node) node->Relocate(out);
+    return node;
+  }
+  if (!node || node->IsLeaf()) {
+    HOTItem* items = *out;
+    if (node) {
+      WideLeafNode* leaf = static_cast<WideLeafNode*>(node.get());
+      for (HOTItem* item = leaf->items_begin_; item != leaf->items_end_;
+          ++item) {
+        if (HOTIsTombstone(*item)) {
+          --tree->num_tombstones_;
+        } else {
+          *(*out)++ = *item;
         }
       }
-      return true;
     }
+    *out = std::copy(added, added + n, *out);
+    return BuildLevel(tree, bbox, items, nullptr, *out - items, false,
+        tree->max_num_leaf_items_);
+  }
+  WideInnerNode* inner = static_cast<WideInnerNode*>(node.get());
+  std::vector<HOTItem> sorted(n);
+  int buckets[257];
+  tree->SortByWideKey(bbox, inner->split_, added, n, &sorted[0], buckets);
+  WideSplitFactors f = GetWideSplitFactors(inner->split_);
+  std::vector<std::unique_ptr<WideNode>> children;
+  int index = 0;
+  for (int key = 0; key < 256; ++key) {
+    std::unique_ptr<WideNode> child;
+    if (inner->HasChild(key)) child = std::move(inner->children_[index++]);
+    int m = buckets[key + 1] - buckets[key];
+    if (!child && m == 0) continue;
+    children.push_back(Reinsert(tree, std::move(child),
+          ChildBoundingBox(bbox, f, key), &sorted[buckets[key]], m, out));
+    inner->occupancy_[key >> 6] |= uint64_t(1) << (key & 63);
+  }
+  inner->children_.swap(children);
+  return node;
+}
 
-  private:
-    HOTBoundingBox bbox_;
-    std::unique_ptr<WideNode> children_[256];
-    HOTItem* items_begin_;
-    HOTItem* items_end_;
-    int buckets_[257];
-};
-
-WideTree::WideTree(HOTBoundingBox bbox) : bbox_(bbox), max_num_leaf_items_(32) {}
+WideTree::WideTree(HOTBoundingBox bbox) :
+  bbox_(bbox), max_num_leaf_items_(32),
+  build_mode_(WideBuildMode::SCRATCH), split_(WideSplit::SPLIT_8x8x4),
+  domain_mode_(HOTDomainMode::OVERFLOW_LIST), overflow_begin_(0),
+  num_tombstones_(0),
+  max_tombstone_fraction_(0.25) {}
 WideTree::WideTree(WideTree&&) = default;
 WideTree& WideTree::operator=(WideTree&&) = default;
 WideTree::~WideTree() = default;
@@ -155,16 +531,219 @@ void WideTree::InsertItems(const HOTItem* begin, const HOTItem* end) {
   int n = std::distance(begin, end);
   if (n == 0) return;
   items_.resize(n);
-  if (!root_) {
-    root_.reset(new WideNode(bbox_));
+  overflow_begin_ = n;
+  num_tombstones_ = 0;
+  int num_outside;
+  root_ = Build(begin, end, &num_outside);
+  if (num_outside == 0) {
+    UpdatePositionArrays();
+    return;
+  }
+
+  // Only now that there are items outside of bbox_ do we pay for
+  // preparing them.
+  size_t num_inside;
+  std::vector<HOTItem> prepared_items;
+  begin = PrepareItems(bbox_, domain_mode_, begin, end, &prepared_items,
+      &num_inside);
+  end = begin + n;
+  std::copy(begin + num_inside, end, items_.begin() + num_inside);
+  overflow_begin_ = num_inside;
+  if (num_inside > 0) {
+    root_ = Build(begin, begin + num_inside, &num_outside);
+    assert(num_outside == 0);
+  }
+  UpdatePositionArrays();
+}
+
+std::unique_ptr<WideNode> WideTree::Build(const HOTItem* begin,
+    const HOTItem* end, int* num_outside) {
+  int n = std::distance(begin, end);
+  std::vector<HOTItem> spare_items;
+  if (build_mode_ == WideBuildMode::PING_PONG && n > max_num_leaf_items_) {
+    spare_items.resize(n);
+  }
+  std::unique_ptr<WideNode> root = WideNode::Build(this, bbox_, begin, end,
+      &items_[0], spare_items.empty() ? nullptr : &spare_items[0],
+      max_num_leaf_items_, num_outside);
+  ReleaseScratch();
+  return root;
+}
+
+int WideTree::SortByWideKey(const HOTBoundingBox& bbox, WideSplit split,
+    const HOTItem* in, int n, HOTItem* out, int buckets[257]) {
+  WideNodeScratch* scratch = LocalScratch();
+  // WideTreeParallel grows the keys without the permutation.
+  if (scratch->keys.size() < size_t(n)) {
+    scratch->keys.resize(n);
+  }
+  if (scratch->perm.size() < size_t(n)) {
+    scratch->perm.resize(n);
   }
-  root_->InsertItems(begin, end, &items_[0], max_num_leaf_items_);
+  int num_outside = ComputeManyWideKeys(split, bbox, &in->position.x, n, 4,
+      &scratch->keys[0]);
+  SortByKey(&scratch->keys[0], n, buckets, &scratch->perm[0]);
+  ApplyPermutation(&scratch->perm[0], n, in, out);
+  return num_outside;
+}
+
+void WideTree::BuildChildren(size_t,
+    const std::function<void(int)>& build_child) {
+  for (int i = 0; i < 256; ++i) {
+    build_child(i);
+  }
+}
+
+WideNodeScratch* WideTree::LocalScratch() {
+  return &scratch_;
+}
+
+void WideTree::ReleaseScratch() {
+  scratch_ = WideNodeScratch();
+}
+
+int WideTree::RemoveItems(const HOTItem* begin, const HOTItem* end) {
+  int num_removed = 0;
+  for (const HOTItem* item = begin; item != end; ++item) {
+    const HOTBoundingBox* leaf_bbox;
+    HOTItem* found = FindItem(*item, &leaf_bbox);
+    if (!found) continue;
+    *found = HOTTombstone();
+    size_t i = found - &items_[0];
+    UpdatePositionArrays(i, i + 1);
+    ++num_tombstones_;
+    ++num_removed;
+  }
+  if (num_tombstones_ > max_tombstone_fraction_ * items_.size()) {
+    Compact();
+  }
+  return num_removed;
+}
+
+int WideTree::UpdatePositions(const HOTItem* begin, const HOTItem* end,
+    const HOTPoint* new_positions) {
+  int num_found = 0;
+  std::vector<HOTItem> moved_items;
+  for (int k = 0; k < std::distance(begin, end); ++k) {
+    const HOTBoundingBox* leaf_bbox;
+    HOTItem* found = FindItem(begin[k], &leaf_bbox);
+    if (!found) continue;
+    ++num_found;
+    HOTPoint new_position = StoredPosition(bbox_, domain_mode_,
+        new_positions[k]);
+    // Items in the overflow list stay there as long as they are outside of
+    // the bounding box.
+    bool stays = leaf_bbox ?
+      LInfinity(*leaf_bbox, MoveIntoBox(bbox_, domain_mode_, new_position))
+        == 0 :
+      !InsideBox(bbox_, new_position);
+    if (stays) {
+      found->position = new_position;
+      size_t i = found - &items_[0];
+      UpdatePositionArrays(i, i + 1);
+    } else {
+      *found = HOTTombstone();
+      ++num_tombstones_;
+      moved_items.push_back(HOTItem{new_position, begin[k].data});
+    }
+  }
+  if (!moved_items.empty()) {
+    Reinsert(&moved_items[0], &moved_items[0] + moved_items.size());
+  }
+  if (num_tombstones_ > max_tombstone_fraction_ * items_.size()) {
+    Compact();
+  }
+  return num_found;
+}
+
+void WideTree::Compact() {
+  if (num_tombstones_ == 0) return;
+  std::vector<HOTItem> items;
+  items.reserve(items_.size() - num_tombstones_);
+  for (const auto& item : items_) {
+    if (!HOTIsTombstone(item)) items.push_back(item);
+  }
+  root_.reset(nullptr);
+  items_.clear();
+  overflow_begin_ = 0;
+  num_tombstones_ = 0;
+  if (!items.empty()) {
+    InsertItems(&items[0], &items[0] + items.size());
+  } else {
+    UpdatePositionArrays();
+  }
+}
+
+void WideTree::Reinsert(const HOTItem* begin, const HOTItem* end) {
+  size_t n = std::distance(begin, end);
+  size_t num_inside;
+  std::vector<HOTItem> prepared_items;
+  begin = PrepareItems(bbox_, domain_mode_, begin, end, &prepared_items,
+      &num_inside);
+  // The items in front of the overflow list are copied to the new items in
+  // tree order with the added ones in their leaves.
+  std::vector<HOTItem> items(items_.size() + n);
+  HOTItem* out = &items[0];
+  root_ = WideNode::Reinsert(this, std::move(root_), bbox_, begin,
+      num_inside, &out);
+  ReleaseScratch();
+  size_t overflow_begin = std::distance(&items[0], out);
+  out = std::copy(items_.begin() + overflow_begin_, items_.end(), out);
+  out = std::copy(begin + num_inside, begin + n, out);
+  items.resize(std::distance(&items[0], out));
+  items_.swap(items);
+  overflow_begin_ = overflow_begin;
+  UpdatePositionArrays();
+}
+
+HOTItem* WideTree::FindItem(const HOTItem& item,
+    const HOTBoundingBox** leaf_bbox) {
+  HOTItem stored{StoredPosition(bbox_, domain_mode_, item.position),
+    item.data};
+  if (root_) {
+    // The nodes sort the items by their position after MoveIntoBox.
+    HOTItem* found = root_->FindItem(stored,
+        MoveIntoBox(bbox_, domain_mode_, stored.position), leaf_bbox);
+    if (found) return found;
+  }
+  for (size_t i = overflow_begin_; i < items_.size(); ++i) {
+    if (HOTSameItem(items_[i], stored)) {
+      *leaf_bbox = nullptr;
+      return &items_[i];
+    }
+  }
+  return nullptr;
+}
+
+void WideTree::SetMaxTombstoneFraction(double max_tombstone_fraction) {
+  max_tombstone_fraction_ = max_tombstone_fraction;
+}
+
+size_t WideTree::NumTombstones() const {
+  return num_tombstones_;
+}
+
+int WideTree::NumNodes() const {
+  if (root_) {
+    return root_->NumNodes();
+  }
+  return 0;
 }
 
 size_t WideTree::Size() const {
   return items_.size();
 }
 
+size_t WideTree::SizeInBytes() const {
+  size_t size = sizeof(*this);
+  size += items_.size() * sizeof(HOTItem);
+  if (root_) {
+    size += root_->Size();
+  }
+  size += 3 * positions_.x.size() * sizeof(double);
+  return size;
+}
+
 std::vector<HOTItem>::iterator WideTree::begin() {
   return items_.begin();
 }
@@ -173,15 +752,88 @@ std::vector<HOTItem>::iterator WideTree::end() {
   return items_.end();
 }
 
-bool WideTree::VisitNearVertices(SpatialSortTree::VertexVisitor* visitor,
-    HOTPoint position, double eps2) {
-  if (root_) {
-    return root_->VisitNearVertices(visitor, position, eps2);
+bool WideTree::VisitNearItemRanges(
+    SpatialSortTree::ItemRangeVisitor* visitor, HOTPoint position,
+    double eps2, HOTMetric metric) {
+  return VisitNearRanges(visitor, position, eps2, metric);
+}
+
+bool WideTree::VisitNearVertices(VertexVisitor* visitor, HOTPoint position,
+    double eps) {
+  return VisitNear(position, eps, [visitor](HOTItem* item) {
+      return visitor->Visit(item);
+    });
+}
+
+bool WideTree::VisitNearVertices(VertexVisitor* visitor, HOTPoint position,
+    double eps, HOTMetric metric) {
+  return VisitNear(position, eps, metric, [visitor](HOTItem* item) {
+      return visitor->Visit(item);
+    });
+}
+
+void WideTree::VisitNearVerticesBatch(BatchVisitor* visitor,
+    const HOTPoint* points, int n, double eps, HOTMetric metric) {
+  HOTBatchTraversal traversal(visitor, n, eps, metric);
+  ExpandBatchQueries(bbox_, domain_mode_, points, n, eps, &traversal.queries);
+  if (traversal.queries.empty()) return;
+  // The items aren't in Morton order, so there is no global sort. The
+  // partition at each node sorts the queries into the cells of the node,
+  // which leaves them in the order of the items.
+  size_t num_active = ActivateBatchQueries(bbox_, &traversal);
+  if (num_active > 0 && root_) {
+    root_->VisitNearVerticesBatch(&traversal, 0, num_active);
+  }
+  if (overflow_begin_ < items_.size()) {
+    traversal.active.resize(traversal.queries.size());
+    std::iota(traversal.active.begin(), traversal.active.end(), 0);
+    VisitItemsNearBatch(&items_[0] + overflow_begin_,
+        &items_[0] + items_.size(), &traversal, 0, traversal.active.size());
+  }
+}
+
+void WideTree::KNearest(HOTPoint position, int k,
+    std::vector<HOTItem*>* nearest, HOTMetric metric) {
+  HOTNearestItems items(k);
+  switch (metric) {
+    case HOTMetric::L2:
+      SearchNearest<HOTMetric::L2>(position, &items);
+      break;
+    case HOTMetric::L1:
+      SearchNearest<HOTMetric::L1>(position, &items);
+      break;
+    case HOTMetric::LINFINITY:
+      SearchNearest<HOTMetric::LINFINITY>(position, &items);
+      break;
   }
-  return true;
+  items.Extract(nearest);
+}
+
+template <HOTMetric Metric>
+void WideTree::SearchNearest(HOTPoint position, HOTNearestItems* nearest) {
+  HOTItem* items = items_.empty() ? nullptr : &items_[0];
+  HOTSearchNearest<Metric>(bbox_, domain_mode_, position,
+      items_.size() - num_tombstones_,
+      items + overflow_begin_, items + items_.size(),
+      [this](HOTPoint query, HOTNearestItems* nearest) {
+        if (root_) WideNode::SearchNearest<Metric>(root_.get(), query, nearest);
+      }, nearest);
 }
 
 void WideTree::SetMaxNumLeafItems(int max_num_leaf_items) {
   max_num_leaf_items_ = max_num_leaf_items;
 }
 
+void WideTree::SetBuildMode(WideBuildMode build_mode) {
+  build_mode_ = build_mode;
+}
+
+void WideTree::SetSplit(WideSplit split) {
+  split_ = split;
+}
+
+void WideTree::SetDomainMode(HOTDomainMode domain_mode) {
+  assert(items_.empty());
+  domain_mode_ = domain_mode;
+}
+
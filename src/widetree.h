@@ -2,11 +2,55 @@
 #define WIDE_TREE_H
 
 #include <spatialsorttree.h>
+#include <keykernels.h>
 #include <vector>
 #include <memory>
+#include <functional>
+#include <cstdint>
 
 
 class WideNode;
+class HOTNearestItems;
+
+// Buffers used while sorting the items of WideNodes. They are reused from
+// node to node so that the build doesn't allocate temporaries for every
+// node.
+struct WideNodeScratch {
+  std::vector<uint8_t> keys;
+  std::vector<int> perm;
+  std::vector<HOTItem> items;
+  // Bucket offsets of the blocks of a parallel sort.
+  std::vector<int> block_offsets;
+};
+
+// Buffers a WideTree sorts the items of a node into during the build.
+enum class WideBuildMode {
+  // Every node sorts its items into the scratch buffer of the thread and
+  // copies them back. The scratch buffer stays in cache from node to node.
+  SCRATCH,
+  // The build alternates between the tree's items and a second buffer of
+  // the same size from level to level. This avoids the copy back but
+  // touches twice as much memory.
+  PING_PONG
+};
+
+// Number of cells a WideNode is split into along x, y and z. All splits
+// have at most 256 cells so that the cells can be numbered by a uint8_t.
+enum class WideSplit : uint8_t {
+  SPLIT_8x8x4,
+  SPLIT_4x4x4,
+  SPLIT_16x16x1,
+  SPLIT_2x2x2,
+  // Every node uses the split above that gives it the most cube shaped
+  // cells (see ChooseWideSplit).
+  ADAPTIVE
+};
+
+struct WideSplitFactors {
+  int nx;
+  int ny;
+  int nz;
+};
 
 class WideTree : public SpatialSortTree {
   public:
@@ -18,25 +62,158 @@ class WideTree : public SpatialSortTree {
     ~WideTree() override;
 
     void InsertItems(const HOTItem* begin, const HOTItem* end) override;
+    // Removes the items that match [begin, end) in position and data.
+    // Removed items are tombstoned in place (see HOTTombstone) and remain
+    // visible through begin() and end() until the tree is compacted.
+    // Returns the number of items that were found and removed.
+    int RemoveItems(const HOTItem* begin, const HOTItem* end);
+    // Moves the items that match [begin, end) to new_positions. Items that
+    // stay inside their leaf are updated in place. Items that leave their
+    // leaf are tombstoned and reinserted; only the leaves that receive them
+    // are built again. Returns the number of items that were found.
+    int UpdatePositions(const HOTItem* begin, const HOTItem* end,
+        const HOTPoint* new_positions);
+    // Removes all tombstones and rebuilds the tree.
+    void Compact();
+    // RemoveItems and UpdatePositions compact the tree once more than this
+    // fraction of the items are tombstones.
+    void SetMaxTombstoneFraction(double max_tombstone_fraction);
+    size_t NumTombstones() const;
 
-    bool VisitNearVertices(SpatialSortTree::VertexVisitor* visitor, HOTPoint position, double eps2) override;
+    bool VisitNearItemRanges(SpatialSortTree::ItemRangeVisitor* visitor,
+        HOTPoint position, double eps2,
+        HOTMetric metric = HOTMetric::LINFINITY) override;
+    // Like SpatialSortTree::VisitNear, but the node traversal is inlined
+    // together with visit. Defined in widetreenode.h.
+    template <typename Callable>
+    bool VisitNear(HOTPoint position, double eps, Callable visit);
+    template <typename Callable>
+    bool VisitNear(HOTPoint position, double eps, HOTMetric metric,
+        Callable visit);
+    bool VisitNearVertices(VertexVisitor* visitor, HOTPoint position,
+        double eps) override;
+    bool VisitNearVertices(VertexVisitor* visitor, HOTPoint position,
+        double eps, HOTMetric metric) override;
+    // Traverses the nodes once for all queries, sorting them into the
+    // cells of each node on the way down.
+    void VisitNearVerticesBatch(BatchVisitor* visitor,
+        const HOTPoint* points, int n, double eps,
+        HOTMetric metric = HOTMetric::LINFINITY) override;
+    void KNearest(HOTPoint position, int k, std::vector<HOTItem*>* nearest,
+        HOTMetric metric = HOTMetric::L2) override;
 
+    // Some diagnostics;
+    int NumNodes() const;
+    // Number of stored items, including tombstones.
     size_t Size() const;
+    // Bytes used by the tree, its items and its nodes. Comparable to
+    // HOTTree::Size().
+    size_t SizeInBytes() const;
     std::vector<HOTItem>::iterator begin() override;
     std::vector<HOTItem>::iterator end() override;
 
     void SetMaxNumLeafItems(int max_num_leaf_items);
+    void SetBuildMode(WideBuildMode build_mode);
+    // Applies to the next build. The default is SPLIT_8x8x4.
+    void SetSplit(WideSplit split);
+    // How locations outside of the bounding box are handled. The default
+    // is OVERFLOW_LIST, see HOTDomainMode for how it differs from earlier
+    // versions. Can only be changed while the tree is empty.
+    void SetDomainMode(HOTDomainMode domain_mode);
+
+  protected:
+    friend class WideNode;
 
-  private:
     HOTBoundingBox bbox_;
     std::vector<HOTItem> items_;
     std::unique_ptr<WideNode> root_;
     int max_num_leaf_items_;
+    WideBuildMode build_mode_;
+    WideSplit split_;
+    HOTDomainMode domain_mode_;
+    // The items behind this index are in the overflow list.
+    size_t overflow_begin_;
+    size_t num_tombstones_;
+    double max_tombstone_fraction_;
+    WideNodeScratch scratch_;
+
+    // Adds the items in [begin, end) to the nodes of the tree, keeping the
+    // subtrees that don't receive any of them.
+    void Reinsert(const HOTItem* begin, const HOTItem* end);
+    // Builds the nodes for the items in [begin, end) into items_ unless
+    // some of them are outside of bbox_. *num_outside is set to their
+    // number.
+    std::unique_ptr<WideNode> Build(const HOTItem* begin, const HOTItem* end,
+        int* num_outside);
+    // Finds the item stored for item in the nodes or the overflow list.
+    // leaf_bbox is set to the bounding box of its leaf or to nullptr in the
+    // overflow list. Returns nullptr if there is no such item.
+    HOTItem* FindItem(const HOTItem& item, const HOTBoundingBox** leaf_bbox);
+    // VisitNear in Metric.
+    template <HOTMetric Metric, typename Callable>
+    bool VisitNearInMetric(HOTPoint position, double eps, Callable* visit);
+    // VisitNearItemRanges for any visitor with a Visit like
+    // ItemRangeVisitor::Visit.
+    template <typename Visitor>
+    bool VisitNearRanges(Visitor* visitor, HOTPoint position, double eps2,
+        HOTMetric metric);
+    // VisitNearRanges for the items in the nodes.
+    template <typename Visitor>
+    bool VisitNearRangesInBox(Visitor* visitor, HOTPoint position,
+        double eps2, HOTMetric metric);
+    // KNearest in Metric without extracting the items.
+    template <HOTMetric Metric>
+    void SearchNearest(HOTPoint position, HOTNearestItems* nearest);
+
+    // Sorts the n items at in into out by their key for split in bbox and
+    // stores the start of each of the 256 buckets in buckets. buckets[256]
+    // is n. Returns the number of items outside of bbox.
+    virtual int SortByWideKey(const HOTBoundingBox& bbox, WideSplit split,
+        const HOTItem* in, int n, HOTItem* out, int buckets[257]);
+    // Calls build_child(i) for all 256 children of a node with num_items
+    // items. Derived trees can build the children concurrently.
+    virtual void BuildChildren(size_t num_items,
+        const std::function<void(int)>& build_child);
+    // Scratch buffers of the calling thread.
+    virtual WideNodeScratch* LocalScratch();
+    // Releases the scratch buffers after a build.
+    virtual void ReleaseScratch();
 };
 
+WideSplitFactors GetWideSplitFactors(WideSplit split);
+// The split with the most cube shaped cells for bbox. Ties go to the split
+// with more cells. Axes of bbox without extent are never split. If every
+// split would divide one of them, SPLIT_8x8x4 is returned.
+WideSplit ChooseWideSplit(const HOTBoundingBox& bbox);
+
+// Key of the cell holding location in a grid of NX x NY x NZ cells over
+// bbox. Cell (a, b, c) has the key (a * NY + b) * NZ + c. Locations on the
+// upper faces of bbox belong to the last cells, locations outside of bbox
+// are folded back into it periodically. These templates are
+// instantiated for the splits of WideSplit.
+template <int NX, int NY, int NZ>
 uint8_t ComputeWideKey(const HOTBoundingBox& bbox, HOTPoint location);
-void ComputeManyWideKeys(const HOTBoundingBox& bbox, const double* locations,
-    int n, int stride, uint8_t* keys);
+// Keys of the n locations at locations, which are stride doubles apart.
+// Whole vectors of locations are done by kernel (see ComputeManyGridKeys).
+// Locations outside of bbox are clamped onto it instead of folded back.
+// Returns the number of locations outside of bbox (see InsideBox).
+template <int NX, int NY, int NZ>
+int ComputeManyWideKeys(const HOTBoundingBox& bbox, const double* locations,
+    int n, int stride, uint8_t* keys,
+    HOTKeyKernel kernel = HOTBestKeyKernel());
+
+// The same for the 8x8x4 split.
+uint8_t ComputeWideKey(const HOTBoundingBox& bbox, HOTPoint location);
+int ComputeManyWideKeys(const HOTBoundingBox& bbox, const double* locations,
+    int n, int stride, uint8_t* keys,
+    HOTKeyKernel kernel = HOTBestKeyKernel());
+
+// The same for a split chosen at runtime. split can't be ADAPTIVE.
+uint8_t ComputeWideKey(WideSplit split, const HOTBoundingBox& bbox,
+    HOTPoint location);
+int ComputeManyWideKeys(WideSplit split, const HOTBoundingBox& bbox,
+    const double* locations, int n, int stride, uint8_t* keys,
+    HOTKeyKernel kernel = HOTBestKeyKernel());
 void SortByKey(const uint8_t* keys, int n, int buckets[257], int* perm);
 
 template <typename T>
@@ -46,5 +223,6 @@ void ApplyPermutation(const int* perm, int n, const T* in, T* out) {
   }
 }
 
+#include <widetreenode.h>
 
 #endif
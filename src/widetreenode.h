@@ -0,0 +1,358 @@
+#ifndef WIDE_TREE_NODE_H
+#define WIDE_TREE_NODE_H
+
+// The nodes of WideTree and their traversal for eps queries. They are in a
+// header so that WideTree::VisitNear can inline the traversal together
+// with the callable. Only the query code is defined here, the build code is
+// in widetree.cpp.
+
+#include <widetree.h>
+#include <helpers.h>
+
+#include <bitset>
+#include <cassert>
+
+
+class WideNode;
+// Room for the children near a query on a few levels. Queries near many
+// cells move the stack to the heap.
+const int WIDE_TRAVERSAL_STACK_SIZE = 128;
+typedef HOTTraversalStack<WideNode*, WIDE_TRAVERSAL_STACK_SIZE>
+  WideTraversalStack;
+
+class WideNode {
+  public:
+    WideNode(HOTBoundingBox bbox, bool leaf) : bbox_(bbox), leaf_(leaf) {}
+    virtual ~WideNode();
+
+    bool IsLeaf() const {
+      return leaf_;
+    }
+
+    // Visits the item ranges of the leaves below root that can hold items
+    // within eps2 of visitor_position. visitor has a Visit like
+    // SpatialSortTree::ItemRangeVisitor::Visit.
+    template <typename Visitor>
+    static bool VisitNearItemRanges(WideNode* root, Visitor* visitor,
+        HOTPoint visitor_position, double eps2);
+    // Inserts the items of the leaves below root that are nearer to
+    // position in Metric than the bound of nearest, like
+    // HOTNode::SearchNearest.
+    template <HOTMetric Metric>
+    static void SearchNearest(WideNode* root, HOTPoint position,
+        HOTNearestItems* nearest);
+    // Visits the items near the queries in the range [first, last) of the
+    // traversal's active queries, which overlap the node.
+    virtual void VisitNearVerticesBatch(HOTBatchTraversal* traversal,
+        size_t first, size_t last) = 0;
+
+    // Finds the item matching item in position and data. The search
+    // descends into the children holding key_position, the position that
+    // the item was sorted by. leaf_bbox is set to the bounding box of the
+    // leaf holding the item. Returns nullptr if there is no such item.
+    virtual HOTItem* FindItem(const HOTItem& item, HOTPoint key_position,
+        const HOTBoundingBox** leaf_bbox) = 0;
+
+    // Moves the items of the subtree to *out in tree order.
+    virtual void Relocate(HOTItem** out) = 0;
+
+    virtual int NumNodes() const = 0;
+    virtual size_t Size() const = 0;
+
+    // Builds the subtree for the items in [begin, end). The items end up in
+    // tree order at sorted_items. spare_items is either nullptr or has room
+    // for as many items (see WideBuildMode). The first level finds the
+    // number of items outside of bbox on the side and stores it in
+    // *num_outside. If there are any, the build stops and returns nullptr.
+    static std::unique_ptr<WideNode> Build(WideTree* tree,
+        const HOTBoundingBox& bbox, const HOTItem* begin, const HOTItem* end,
+        HOTItem* sorted_items, HOTItem* spare_items, int max_num_leaf_items,
+        int* num_outside);
+
+    // Moves the items of the subtree at node to *out in tree order and adds
+    // the n items at added, which are inside of bbox, the subtree's box.
+    // Subtrees that receive no items keep their nodes. Leaves that do are
+    // built again from their items and the added ones, which drops their
+    // tombstones. node is nullptr for a cell without a child. Returns the
+    // root of the updated subtree.
+    static std::unique_ptr<WideNode> Reinsert(WideTree* tree,
+        std::unique_ptr<WideNode> node, const HOTBoundingBox& bbox,
+        const HOTItem* added, int n, HOTItem** out);
+
+  protected:
+    HOTBoundingBox bbox_;
+
+    friend class WideInnerNode;
+
+  private:
+    // Set for WideLeafNode, so that queries descend without virtual calls.
+    bool leaf_;
+
+    // Descends from node to the deepest descendant that holds
+    // visitor_position more than eps2 away from its boundary.
+    static WideNode* Descend(WideNode* node, HOTPoint visitor_position,
+        double eps2);
+
+    // Builds the subtree for the n items that it keeps at items. Without
+    // spare_items every level sorts the items into the thread's scratch
+    // buffer and copies them back. Otherwise spare_items is the same range
+    // of the second buffer and the items are currently there if in_spare
+    // is set. Each level then sorts them into the other buffer and leaves
+    // copy their items back if needed.
+    static std::unique_ptr<WideNode> BuildLevel(WideTree* tree,
+        const HOTBoundingBox& bbox, HOTItem* items, HOTItem* spare_items,
+        int n, bool in_spare, int max_num_leaf_items);
+
+    // Builds an inner node whose items are sorted into the given buckets
+    // of split and are in the buffer selected by in_spare.
+    static std::unique_ptr<WideNode> BuildInner(WideTree* tree,
+        const HOTBoundingBox& bbox, WideSplit split, HOTItem* items,
+        HOTItem* spare_items, bool in_spare, const int buckets[257],
+        int max_num_leaf_items);
+
+    // The split of a new inner node with bounding box bbox.
+    static WideSplit NodeSplit(const WideTree* tree,
+        const HOTBoundingBox& bbox);
+};
+
+// A node with at most max_num_leaf_items items and no children.
+class WideLeafNode : public WideNode {
+  public:
+    WideLeafNode(HOTBoundingBox bbox, HOTItem* begin, HOTItem* end) :
+      WideNode(bbox, true), items_begin_(begin), items_end_(end) {}
+
+    template <typename Visitor>
+    bool VisitItemRange(Visitor* visitor, HOTPoint visitor_position) {
+      return visitor->Visit(visitor_position, items_begin_, items_end_);
+    }
+
+    template <HOTMetric Metric>
+    void ScanNearest(HOTPoint position, HOTNearestItems* nearest) {
+      nearest->Scan<Metric>(items_begin_, items_end_, position);
+    }
+
+    void VisitNearVerticesBatch(HOTBatchTraversal* traversal,
+        size_t first, size_t last) override;
+    HOTItem* FindItem(const HOTItem& item, HOTPoint,
+        const HOTBoundingBox** leaf_bbox) override;
+    void Relocate(HOTItem** out) override;
+    int NumNodes() const override;
+    size_t Size() const override;
+
+  private:
+    HOTItem* items_begin_;
+    HOTItem* items_end_;
+
+    friend class WideNode;
+};
+
+// A node with children for the non-empty ones of the up to 256 cells of
+// its split. Bit k of occupancy_ is set if cell k has a child. The children
+// are stored densely in cell order, so the child for cell k is at the
+// number of set bits below k.
+class WideInnerNode : public WideNode {
+  public:
+    WideInnerNode(HOTBoundingBox bbox, WideSplit split) :
+      WideNode(bbox, false), split_(split), occupancy_{0, 0, 0, 0} {}
+
+    // The child holding visitor_position more than eps2 away from its
+    // boundary, or nullptr if there is none.
+    WideNode* SelectChild(HOTPoint visitor_position, double eps2) const {
+      uint8_t key = ComputeWideKey(split_, bbox_, visitor_position);
+      WideNode* selected_child = Child(key);
+      // Positions outside of bbox_ are folded into a cell that doesn't hold
+      // them.
+      if (selected_child &&
+          LInfinity(selected_child->bbox_, visitor_position) == 0 &&
+          DistanceFromBoundary(selected_child->bbox_, visitor_position) > eps2) {
+        return selected_child;
+      }
+      return nullptr;
+    }
+
+    // Pushes the children within eps2 of visitor_position onto stack, so
+    // that they are popped in cell order.
+    void PushChildrenNear(HOTPoint visitor_position, double eps2,
+        WideTraversalStack* stack) const {
+      // Only the cells overlapping the query box can hold near vertices.
+      WideSplitFactors f = GetWideSplitFactors(split_);
+      int a0, a1, b0, b1, c0, c1;
+      OverlappingCellRanges(f, visitor_position, eps2,
+          &a0, &a1, &b0, &b1, &c0, &c1);
+      for (int a = a1; a >= a0; --a) {
+        for (int b = b1; b >= b0; --b) {
+          for (int c = c1; c >= c0; --c) {
+            WideNode* child = Child((a * f.ny + b) * f.nz + c);
+            if (child && LInfinity(child->bbox_, visitor_position) < eps2) {
+              stack->Push(child);
+            }
+          }
+        }
+      }
+    }
+
+    // Calls push(child, distance) for the children whose BoxDistance from
+    // position in Metric is below bound. The distances are computed from
+    // the cells of the split, so that only the children that are pushed
+    // are touched.
+    template <HOTMetric Metric, typename Push>
+    void PushChildrenNearer(HOTPoint position, double bound,
+        Push push) const;
+
+    void VisitNearVerticesBatch(HOTBatchTraversal* traversal,
+        size_t first, size_t last) override;
+    HOTItem* FindItem(const HOTItem& item, HOTPoint key_position,
+        const HOTBoundingBox** leaf_bbox) override;
+    void Relocate(HOTItem** out) override;
+    int NumNodes() const override;
+    size_t Size() const override;
+
+  private:
+    WideSplit split_;
+    uint64_t occupancy_[4];
+    std::vector<std::unique_ptr<WideNode>> children_;
+
+    friend class WideNode;
+
+    bool HasChild(int key) const {
+      return (occupancy_[key >> 6] >> (key & 63)) & 1;
+    }
+
+    // Index of the child for cell key in children_.
+    int ChildIndex(int key) const {
+      int index = 0;
+      for (int i = 0; i < (key >> 6); ++i) {
+        index += std::bitset<64>(occupancy_[i]).count();
+      }
+      uint64_t below = (uint64_t(1) << (key & 63)) - 1;
+      index += std::bitset<64>(occupancy_[key >> 6] & below).count();
+      return index;
+    }
+
+    WideNode* Child(int key) const {
+      if (!HasChild(key)) return nullptr;
+      return children_[ChildIndex(key)].get();
+    }
+
+    // Distances of x from each of the n equal cells over [a, b].
+    static void CellDistances(double a, double b, int n, double x,
+        double* distances);
+
+    // Ranges of the cells (a, b, c) that can hold points within eps of
+    // position.
+    void OverlappingCellRanges(const WideSplitFactors& f,
+        const HOTPoint& position, double eps,
+        int* a0, int* a1, int* b0, int* b1, int* c0, int* c1) const {
+      OverlappingCells(bbox_.min.x, bbox_.max.x, f.nx, position.x, eps,
+          a0, a1);
+      OverlappingCells(bbox_.min.y, bbox_.max.y, f.ny, position.y, eps,
+          b0, b1);
+      OverlappingCells(bbox_.min.z, bbox_.max.z, f.nz, position.z, eps,
+          c0, c1);
+    }
+};
+
+inline WideNode* WideNode::Descend(WideNode* node, HOTPoint visitor_position,
+    double eps2) {
+  while (!node->IsLeaf()) {
+    WideNode* child = static_cast<WideInnerNode*>(node)->SelectChild(
+        visitor_position, eps2);
+    if (!child) break;
+    node = child;
+  }
+  return node;
+}
+
+template <typename Visitor>
+bool WideNode::VisitNearItemRanges(WideNode* root, Visitor* visitor,
+    HOTPoint visitor_position, double eps2) {
+  // Most queries end up in a single leaf without ever needing the stack.
+  WideNode* node = Descend(root, visitor_position, eps2);
+  if (node->IsLeaf()) {
+    return static_cast<WideLeafNode*>(node)->VisitItemRange(visitor,
+        visitor_position);
+  }
+  WideTraversalStack stack;
+  stack.Push(node);
+  while (!stack.Empty()) {
+    node = Descend(stack.Pop(), visitor_position, eps2);
+    if (node->IsLeaf()) {
+      if (!static_cast<WideLeafNode*>(node)->VisitItemRange(visitor,
+            visitor_position)) {
+        return false;
+      }
+      continue;
+    }
+    // We are near the boundary.
+    static_cast<WideInnerNode*>(node)->PushChildrenNear(visitor_position,
+        eps2, &stack);
+  }
+  return true;
+}
+
+
+template <typename Callable>
+bool WideTree::VisitNear(HOTPoint position, double eps, Callable visit) {
+  return VisitNearInMetric<HOTMetric::LINFINITY>(position, eps, &visit);
+}
+
+template <typename Callable>
+bool WideTree::VisitNear(HOTPoint position, double eps, HOTMetric metric,
+    Callable visit) {
+  switch (metric) {
+    case HOTMetric::L2:
+      return VisitNearInMetric<HOTMetric::L2>(position, eps, &visit);
+    case HOTMetric::L1:
+      return VisitNearInMetric<HOTMetric::L1>(position, eps, &visit);
+    case HOTMetric::LINFINITY:
+      break;
+  }
+  return VisitNearInMetric<HOTMetric::LINFINITY>(position, eps, &visit);
+}
+
+template <HOTMetric Metric, typename Callable>
+bool WideTree::VisitNearInMetric(HOTPoint position, double eps,
+    Callable* visit) {
+  NearItemsVisitor<Metric, Callable> range_visitor(visit, eps,
+      use_position_arrays_ ? &positions_ : nullptr);
+  return VisitNearRanges(&range_visitor, position, eps, Metric);
+}
+
+template <typename Visitor>
+bool WideTree::VisitNearRanges(Visitor* visitor, HOTPoint position,
+    double eps2, HOTMetric metric) {
+  switch (domain_mode_) {
+    case HOTDomainMode::PERIODIC:
+      return VisitPeriodicImages(bbox_, position, eps2,
+          [this, visitor, eps2, metric](HOTPoint image) {
+            return VisitNearRangesInBox(visitor, image, eps2, metric);
+          });
+    case HOTDomainMode::CLAMPED: {
+      HOTRangesForPosition<Visitor> ranges(visitor, position);
+      return VisitNearRangesInBox(&ranges,
+          MoveIntoBox(bbox_, domain_mode_, position), eps2, metric);
+    }
+    case HOTDomainMode::OVERFLOW_LIST:
+      break;
+  }
+  if (!VisitNearRangesInBox(visitor, position, eps2, metric)) {
+    return false;
+  }
+  if (overflow_begin_ == items_.size()) return true;
+  return visitor->Visit(position, &items_[0] + overflow_begin_,
+      &items_[0] + items_.size());
+}
+
+template <typename Visitor>
+bool WideTree::VisitNearRangesInBox(Visitor* visitor, HOTPoint position,
+    double eps2, HOTMetric metric) {
+  // Like in HOTTree only the box of the tree is tested in metric.
+  if (root_ && NearBox(bbox_, position, eps2, metric)) {
+    return WideNode::VisitNearItemRanges(root_.get(), visitor, position,
+        eps2);
+  }
+  return true;
+}
+
+
+#endif
@@ -1,42 +1,31 @@
 #ifndef WIDE_TREE_PARALLEL_H
 #define WIDE_TREE_PARALLEL_H
 
-#include <spatialsorttree.h>
-#include <vector>
-#include <memory>
+#include <widetree.h>
+#include <tbb/enumerable_thread_specific.h>
 
 
-class WideNode;
-
-class WideTreeParallel : public SpatialSortTree {
+// A WideTree whose nodes are built with TBB. Large nodes sort their items
+// with a parallel histogram and scatter, and the children of large nodes
+// are built as independent tasks. Nodes and queries are shared with
+// WideTree.
+class WideTreeParallel : public WideTree {
   public:
     WideTreeParallel(HOTBoundingBox bbox);
-    WideTreeParallel(const WideTreeParallel&) = delete;
-    WideTreeParallel& operator=(const WideTreeParallel&) = delete;
     WideTreeParallel(WideTreeParallel&&);
     WideTreeParallel& operator=(WideTreeParallel&& rhs);
-    ~WideTreeParallel();
-
-    void InsertItems(const HOTItem* begin, const HOTItem* end);
-
-    bool VisitNearVertices(SpatialSortTree::VertexVisitor* visitor, HOTPoint position, double eps2);
+    ~WideTreeParallel() override;
 
-    size_t Size() const;
-    std::vector<HOTItem>::iterator begin() override;
-    std::vector<HOTItem>::iterator end() override;
-
-    void SetMaxNumLeafItems(int maxnum_leaf_items);
+  protected:
+    int SortByWideKey(const HOTBoundingBox& bbox, WideSplit split,
+        const HOTItem* in, int n, HOTItem* out, int buckets[257]) override;
+    void BuildChildren(size_t num_items,
+        const std::function<void(int)>& build_child) override;
+    WideNodeScratch* LocalScratch() override;
+    void ReleaseScratch() override;
 
   private:
-    HOTBoundingBox bbox_;
-    std::vector<HOTItem> items_;
-    std::unique_ptr<WideNode> root_;
-    int max_num_leaf_items_;
+    tbb::enumerable_thread_specific<WideNodeScratch> thread_scratch_;
 };
 
-uint8_t ComputeWideKey(const HOTBoundingBox& bbox, HOTPoint location);
-void ComputeManyWideKeys(const HOTBoundingBox& bbox, const double* locations,
-    int n, int stride, uint8_t* keys);
-void SortByKey(const uint8_t* keys, int n, int buckets[257], int* perm);
-
 #endif
@@ -1,4 +1,5 @@
 #include <widetree.h>
+#include <keykernels.h>
 #include <test_utilities.h>
 #include <vector>
 #include <iostream>
@@ -15,11 +16,29 @@ int main(int, char **) {
   std::vector<HOTItem> items(BuildItems(&entities));
   std::vector<uint8_t> keys(n);
 
+  std::cout << "Key kernel: " << HOTKeyKernelName(HOTBestKeyKernel()) << std::endl;
+
   start = rdtsc();
   ComputeManyWideKeys(bbox, &items[0].position.x, n,  sizeof(items[0]) / sizeof(double), &keys[0]);
   end = rdtsc();
   std::cout << "Generate keys: " << (end - start) / 1.0e6 << std::endl;
 
+  start = rdtsc();
+  ComputeManyWideKeys(bbox, &items[0].position.x, n,  sizeof(items[0]) / sizeof(double), &keys[0], HOTKeyKernel::SCALAR);
+  end = rdtsc();
+  std::cout << "Generate keys (scalar): " << (end - start) / 1.0e6 << std::endl;
+
+  std::vector<HOTKey> hot_keys(n);
+  start = rdtsc();
+  HOTComputeManyHashes(bbox, &items[0].position.x, n,  sizeof(items[0]) / sizeof(double), &hot_keys[0]);
+  end = rdtsc();
+  std::cout << "Generate HOT keys: " << (end - start) / 1.0e6 << std::endl;
+
+  start = rdtsc();
+  HOTComputeManyHashes(bbox, &items[0].position.x, n,  sizeof(items[0]) / sizeof(double), &hot_keys[0], HOTKeyKernel::SCALAR);
+  end = rdtsc();
+  std::cout << "Generate HOT keys (scalar): " << (end - start) / 1.0e6 << std::endl;
+
   std::vector<int> perm(n);
   start = rdtsc();
   SortByKey(&keys[0], n, buckets, &perm[0]);
@@ -1,11 +1,16 @@
 #include <gtest/gtest.h>
 #include <hashedoctree.h>
+#include <keykernels.h>
 #include <test_utilities.h>
+#include <helpers.h>
+#include <algorithm>
+#include <cstdlib>
 #include <limits>
 
 #include <hot_config.h>
 #ifdef HOT_HAVE_TBB
 #include <tbb/task_scheduler_init.h>
+#include <hashedoctreeparallel.h>
 #endif
 
 
@@ -31,6 +36,13 @@ TEST(ComputeHash, SubstantiallyDifferentPointsYieldDifferentKeys) {
   EXPECT_NE(k1, k2);
 }
 
+TEST(ComputeHash, UpperFacesBelongToTheLastBucket) {
+  HOTBoundingBox bbox{{0, 0, 0}, {1, 1, 1}};
+  EXPECT_EQ(HOTComputeHash(bbox, {1 - 1.0e-9, 1 - 1.0e-9, 1 - 1.0e-9}),
+      HOTComputeHash(bbox, {1, 1, 1}));
+  EXPECT_GT(HOT_OVERFLOW_KEY, HOTComputeHash(bbox, {1, 1, 1}));
+}
+
 TEST(ComputeHash, CanComputeKeysOutsideOfBBox) {
   HOTBoundingBox bbox{{0, 0, 0}, {1, 1, 1}};
   EXPECT_GE(HOTComputeHash(bbox, {1.5, 1.5, 1.5}), 0u);
@@ -39,6 +51,146 @@ TEST(ComputeHash, CanComputeKeysOutsideOfBBox) {
 }
 
 
+TEST(ComputeHilbertHash, ConsecutiveBucketsShareAFace) {
+  HOTBoundingBox bbox{{-1, 0, 0}, {1, 3, 0.5}};
+  const int n = 16;
+  std::vector<std::pair<HOTKey, std::vector<int>>> buckets;
+  for (int i = 0; i < n; ++i) {
+    for (int j = 0; j < n; ++j) {
+      for (int k = 0; k < n; ++k) {
+        HOTPoint center({
+            bbox.min.x + (i + 0.5) * (bbox.max.x - bbox.min.x) / n,
+            bbox.min.y + (j + 0.5) * (bbox.max.y - bbox.min.y) / n,
+            bbox.min.z + (k + 0.5) * (bbox.max.z - bbox.min.z) / n});
+        buckets.push_back({HOTComputeHilbertHash(bbox, center), {i, j, k}});
+      }
+    }
+  }
+  std::sort(buckets.begin(), buckets.end());
+  for (size_t b = 1; b < buckets.size(); ++b) {
+    const std::vector<int>& p = buckets[b - 1].second;
+    const std::vector<int>& q = buckets[b].second;
+    EXPECT_EQ(1, std::abs(p[0] - q[0]) + std::abs(p[1] - q[1]) +
+        std::abs(p[2] - q[2])) << b;
+  }
+  // The curve starts at the origin.
+  EXPECT_EQ(0u, HOTComputeHilbertHash(bbox, bbox.min));
+}
+
+TEST(ComputeHilbertHash, MatchesMortonToHilbert) {
+  auto entities = BuildEntitiesAtRandomLocations(unit_cube(), 1000);
+  auto items = BuildItems(&entities);
+  std::vector<HOTKey> keys;
+  for (const HOTItem& item : items) {
+    keys.push_back(HOTComputeHash(unit_cube(), item.position));
+  }
+  HOTMortonToHilbert(&keys[0], keys.size());
+  for (size_t i = 0; i < items.size(); ++i) {
+    EXPECT_EQ(HOTComputeHilbertHash(unit_cube(), items[i].position), keys[i]);
+    EXPECT_GT(HOT_OVERFLOW_KEY, keys[i]);
+  }
+}
+
+TEST(ComputeManyHashes, MatchesComputeHashForAllKernels) {
+  HOTBoundingBox bbox{{-1, 0, 0}, {1, 3, 0.5}};
+  // Not a multiple of the vector width, so the tail is done by scalar code.
+  int n = 1003;
+  auto entities = BuildEntitiesAtRandomLocations(bbox, n);
+  auto items = BuildItems(&entities);
+  // Locations on the faces of and outside of bbox.
+  items[10].position = bbox.min;
+  items[20].position = bbox.max;
+  items[30].position = HOTPoint({1.5, -2.0, 0.25});
+  items[40].position = HOTPoint({0.0, 3.0, 0.25});
+  // Packed locations without a data pointer in between.
+  std::vector<double> packed;
+  for (const HOTItem& item : items) {
+    packed.push_back(item.position.x);
+    packed.push_back(item.position.y);
+    packed.push_back(item.position.z);
+  }
+  for (HOTKeyKernel kernel : {HOTKeyKernel::SCALAR, HOTKeyKernel::AVX2,
+        HOTKeyKernel::AVX512}) {
+    if (!HOTKeyKernelSupported(kernel)) continue;
+    std::vector<HOTKey> keys(n);
+    EXPECT_EQ(1, HOTComputeManyHashes(bbox, &items[0].position.x, n,
+          sizeof(HOTItem) / sizeof(double), &keys[0], kernel));
+    std::vector<HOTKey> packed_keys(n);
+    EXPECT_EQ(1, HOTComputeManyHashes(bbox, &packed[0], n, 3,
+          &packed_keys[0], kernel));
+    for (int i = 0; i < n; ++i) {
+      HOTKey expected = HOTComputeHash(bbox, items[i].position);
+      EXPECT_EQ(expected, keys[i]) << HOTKeyKernelName(kernel) << " " << i;
+      EXPECT_EQ(expected, packed_keys[i]) << HOTKeyKernelName(kernel) << " " << i;
+    }
+    std::vector<HOTKey> clamped_keys(n);
+    EXPECT_EQ(1, HOTComputeManyClampedHashes(bbox, &items[0].position.x, n,
+          sizeof(HOTItem) / sizeof(double), &clamped_keys[0], kernel));
+    for (int i = 0; i < n; ++i) {
+      HOTKey expected = HOTComputeHash(bbox,
+          MoveIntoBox(bbox, HOTDomainMode::CLAMPED, items[i].position));
+      EXPECT_EQ(expected, clamped_keys[i]) << HOTKeyKernelName(kernel) << " "
+        << i;
+    }
+  }
+}
+
+TEST(NearMask, MatchesDistanceForAllKernelsAndMetrics) {
+  HOTBoundingBox bbox{{-1, 0, 0}, {1, 3, 0.5}};
+  int n = 64;
+  auto entities = BuildEntitiesAtRandomLocations(bbox, n);
+  auto items = BuildItems(&entities);
+  HOTPoint position{0.25, 1.125, 0.375};
+  double eps = 0.5;
+  // Positions exactly eps away aren't near, and tombstones never are.
+  items[5].position = HOTPoint({position.x + eps, position.y, position.z});
+  items[6].position = HOTPoint({position.x, position.y, position.z - eps});
+  items[7].position = HOTTombstone().position;
+  items[8].position = position;
+  // Only near in L-infinity.
+  items[9].position = HOTPoint({position.x - 0.375, position.y + 0.375,
+      position.z});
+  std::vector<double> x, y, z;
+  for (const HOTItem& item : items) {
+    x.push_back(item.position.x);
+    y.push_back(item.position.y);
+    z.push_back(item.position.z);
+  }
+  for (HOTMetric metric : {HOTMetric::LINFINITY, HOTMetric::L2,
+        HOTMetric::L1}) {
+    std::vector<bool> near(n);
+    for (int i = 0; i < n; ++i) {
+      const HOTPoint& p = items[i].position;
+      switch (metric) {
+        case HOTMetric::LINFINITY:
+          near[i] = LInfinity(p, position) < eps;
+          break;
+        case HOTMetric::L2:
+          near[i] = L2Squared(p, position) < eps * eps;
+          break;
+        case HOTMetric::L1:
+          near[i] = L1(p, position) < eps;
+          break;
+      }
+    }
+    EXPECT_EQ(metric == HOTMetric::LINFINITY, near[9]);
+    for (HOTKeyKernel kernel : {HOTKeyKernel::SCALAR, HOTKeyKernel::AVX2,
+          HOTKeyKernel::AVX512}) {
+      if (!HOTKeyKernelSupported(kernel)) continue;
+      // All lengths, so that every kernel also does partial vectors.
+      for (int m = 0; m <= n; ++m) {
+        uint64_t mask = HOTNearMask(&x[0], &y[0], &z[0], m, position, eps,
+            metric, kernel);
+        for (int i = 0; i < n; ++i) {
+          EXPECT_EQ(i < m && near[i], ((mask >> i) & 1) != 0)
+            << HOTKeyKernelName(kernel) << " " << int(metric) << " " << m
+            << " " << i;
+        }
+      }
+    }
+  }
+}
+
 TEST(HOTTree, Ctor) {
   EXPECT_NO_THROW(HOTTree({{0, 0, 0}, {1, 1, 1}}));
 }
@@ -92,6 +244,352 @@ TEST(HOTTree, CanInsertAFewItems) {
 
 
 
+TEST(HOTTree, ItemsAreInKeyOrderForAllSortAlgorithms) {
+  HOTBoundingBox bbox({{0, 0, 0}, {1, 1, 1}});
+  int num_entities = 1000;
+  auto entities = BuildEntitiesAtRandomLocations(bbox, num_entities);
+  auto items = BuildItems(&entities);
+  for (auto algorithm : {HOTSortAlgorithm::RADIX_SORT,
+                         HOTSortAlgorithm::COMPARISON_SORT,
+                         HOTSortAlgorithm::ADAPTIVE_SORT}) {
+    HOTTree tree(bbox);
+    tree.SetSortAlgorithm(algorithm);
+    tree.InsertItems(&items[0], &items[0] + num_entities);
+    ASSERT_EQ(num_entities, std::distance(tree.begin(), tree.end()));
+    HOTKey previous = 0;
+    for (auto item = tree.begin(); item != tree.end(); ++item) {
+      HOTKey key = HOTComputeHash(bbox, item->position);
+      EXPECT_LE(previous, key);
+      previous = key;
+    }
+  }
+}
+
+TEST(HOTTree, AdaptiveSortReportsPath) {
+  HOTBoundingBox bbox({{0, 0, 0}, {1, 1, 1}});
+  int num_entities = 1000;
+  auto entities = BuildEntitiesAtRandomLocations(bbox, num_entities);
+  auto items = BuildItems(&entities);
+  HOTTree tree(bbox);
+  tree.SetSortAlgorithm(HOTSortAlgorithm::ADAPTIVE_SORT);
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+  EXPECT_EQ(HOTSortPath::FULL_SORT, tree.LastSortPath());
+
+  std::vector<HOTItem> ordered_items(tree.begin(), tree.end());
+  HOTTree ordered_tree(bbox);
+  ordered_tree.SetSortAlgorithm(HOTSortAlgorithm::ADAPTIVE_SORT);
+  ordered_tree.InsertItems(&ordered_items[0], &ordered_items[0] + num_entities);
+  EXPECT_EQ(HOTSortPath::ALREADY_SORTED, ordered_tree.LastSortPath());
+
+  std::swap(ordered_items[10], ordered_items[500]);
+  HOTTree nearly_ordered_tree(bbox);
+  nearly_ordered_tree.SetSortAlgorithm(HOTSortAlgorithm::ADAPTIVE_SORT);
+  nearly_ordered_tree.InsertItems(
+      &ordered_items[0], &ordered_items[0] + num_entities);
+  EXPECT_EQ(HOTSortPath::MERGE, nearly_ordered_tree.LastSortPath());
+  HOTKey previous = 0;
+  for (auto item = nearly_ordered_tree.begin();
+       item != nearly_ordered_tree.end(); ++item) {
+    HOTKey key = HOTComputeHash(bbox, item->position);
+    EXPECT_LE(previous, key);
+    previous = key;
+  }
+}
+
+TEST(HOTTree, InsertingInBatchesMatchesSingleInsert) {
+  HOTBoundingBox bbox({{0, 0, 0}, {1, 1, 1}});
+  int num_entities = 5000;
+  auto entities = BuildEntitiesAtRandomLocations(bbox, num_entities);
+  auto items = BuildItems(&entities);
+  HOTTree tree(bbox);
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+
+  HOTTree batched_tree(bbox);
+  int batch_ends[] = {3000, 3001, 3100, num_entities};
+  int batch_begin = 0;
+  for (int batch_end : batch_ends) {
+    batched_tree.InsertItems(&items[0] + batch_begin, &items[0] + batch_end);
+    batch_begin = batch_end;
+  }
+
+  ASSERT_EQ(num_entities, std::distance(batched_tree.begin(), batched_tree.end()));
+  HOTKey previous = 0;
+  for (auto item = batched_tree.begin(); item != batched_tree.end(); ++item) {
+    HOTKey key = HOTComputeHash(bbox, item->position);
+    EXPECT_LE(previous, key);
+    previous = key;
+  }
+  EXPECT_EQ(tree.NumNodes(), batched_tree.NumNodes());
+  EXPECT_EQ(tree.Depth(), batched_tree.Depth());
+
+  double eps = 1.0e-2;
+  for (int i = 0; i < num_entities; i += 97) {
+    RecordIdsVisitor visitor;
+    RecordIdsVisitor batched_visitor;
+    tree.VisitNearVertices(&visitor, items[i].position, eps);
+    batched_tree.VisitNearVertices(&batched_visitor, items[i].position, eps);
+    EXPECT_EQ(visitor.ids, batched_visitor.ids);
+    EXPECT_TRUE(batched_visitor.EntityVisited(entities[i].id));
+  }
+}
+
+TEST(HOTTree, RemovedItemsAreNotVisited) {
+  HOTBoundingBox bbox({{0, 0, 0}, {1, 1, 1}});
+  int num_entities = 1000;
+  auto entities = BuildEntitiesAtRandomLocations(bbox, num_entities);
+  auto items = BuildItems(&entities);
+  HOTTree tree(bbox);
+  tree.SetMaxTombstoneFraction(1.0);
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+  EXPECT_EQ(100, tree.RemoveItems(&items[0], &items[0] + 100));
+  EXPECT_EQ(0, tree.RemoveItems(&items[0], &items[0] + 100));
+  EXPECT_EQ(100u, tree.NumTombstones());
+  for (int i = 0; i < 200; ++i) {
+    RecordIdsVisitor visitor;
+    tree.VisitNearVertices(&visitor, items[i].position, 1.0e-10);
+    EXPECT_EQ(i >= 100, visitor.EntityVisited(entities[i].id)) << i;
+    std::vector<HOTItem*> nearest;
+    tree.KNearest(items[i].position, 1, &nearest);
+    ASSERT_EQ(1u, nearest.size());
+    EXPECT_EQ(i >= 100, nearest[0]->data == &entities[i]) << i;
+  }
+  std::vector<HOTItem*> nearest_of_items;
+  tree.KNearestOfItems(1, &nearest_of_items);
+  EXPECT_EQ(100, std::count(nearest_of_items.begin(), nearest_of_items.end(),
+        nullptr));
+
+  tree.Compact();
+  EXPECT_EQ(0u, tree.NumTombstones());
+  EXPECT_EQ(num_entities - 100, std::distance(tree.begin(), tree.end()));
+  HOTKey previous = 0;
+  for (auto item = tree.begin(); item != tree.end(); ++item) {
+    HOTKey key = HOTComputeHash(bbox, item->position);
+    EXPECT_LE(previous, key);
+    previous = key;
+  }
+}
+
+TEST(HOTTree, CompactsOnceTombstoneFractionIsExceeded) {
+  HOTBoundingBox bbox({{0, 0, 0}, {1, 1, 1}});
+  int num_entities = 1000;
+  auto entities = BuildEntitiesAtRandomLocations(bbox, num_entities);
+  auto items = BuildItems(&entities);
+  HOTTree tree(bbox);
+  tree.SetMaxTombstoneFraction(0.2);
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+  tree.RemoveItems(&items[0], &items[0] + 200);
+  EXPECT_EQ(200u, tree.NumTombstones());
+  tree.RemoveItems(&items[200], &items[201]);
+  EXPECT_EQ(0u, tree.NumTombstones());
+  EXPECT_EQ(num_entities - 201, std::distance(tree.begin(), tree.end()));
+}
+
+TEST(HOTTree, UpdatedItemsAreFoundAtNewPositions) {
+  HOTBoundingBox bbox({{0, 0, 0}, {1, 1, 1}});
+  int num_entities = 1000;
+  auto entities = BuildEntitiesAtRandomLocations(bbox, num_entities);
+  auto items = BuildItems(&entities);
+  HOTTree tree(bbox);
+  tree.SetMaxTombstoneFraction(1.0);
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+  // Small moves mostly stay within a leaf, large ones don't.
+  int num_moved = 200;
+  std::vector<HOTPoint> new_positions;
+  for (int i = 0; i < num_moved; ++i) {
+    double d = i < num_moved / 2 ? 1.0e-6 : 0.3;
+    HOTPoint p = items[i].position;
+    new_positions.push_back(HOTPoint{
+        std::fmod(p.x + d, 1.0), std::fmod(p.y + d, 1.0), p.z});
+  }
+  EXPECT_EQ(num_moved, tree.UpdatePositions(
+        &items[0], &items[0] + num_moved, &new_positions[0]));
+  EXPECT_LT(0u, tree.NumTombstones());
+  EXPECT_GT(size_t(num_moved), tree.NumTombstones());
+
+  double eps = 1.0e-10;
+  for (int i = 0; i < num_moved; ++i) {
+    RecordIdsVisitor visitor;
+    tree.VisitNearVertices(&visitor, new_positions[i], eps);
+    EXPECT_TRUE(visitor.EntityVisited(entities[i].id)) << i;
+    RecordIdsVisitor old_visitor;
+    tree.VisitNearVertices(&old_visitor, items[i].position, eps);
+    EXPECT_FALSE(old_visitor.EntityVisited(entities[i].id)) << i;
+  }
+
+  tree.Compact();
+  EXPECT_EQ(num_entities, std::distance(tree.begin(), tree.end()));
+  HOTKey previous = 0;
+  for (auto item = tree.begin(); item != tree.end(); ++item) {
+    HOTKey key = HOTComputeHash(bbox, item->position);
+    EXPECT_LE(previous, key);
+    previous = key;
+  }
+}
+
+TEST(HOTTree, LinearLayoutMatchesPointerLayout) {
+  HOTBoundingBox bbox({{0, 0, 0}, {1, 1, 1}});
+  int num_entities = 5000;
+  auto entities = BuildEntitiesInClustersAndOnCellFaces(bbox, num_entities,
+      5, 1.0e-2, 4);
+  auto items = BuildItems(&entities);
+  HOTTree tree(bbox);
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+  HOTTree linear_tree(bbox);
+  linear_tree.SetNodeLayout(HOTNodeLayout::LINEAR);
+  linear_tree.InsertItems(&items[0], &items[0] + 3000);
+  linear_tree.InsertItems(&items[0] + 3000, &items[0] + num_entities);
+
+  EXPECT_EQ(tree.NumNodes(), linear_tree.NumNodes());
+  EXPECT_EQ(tree.Depth(), linear_tree.Depth());
+  EXPECT_GT(tree.Size(), linear_tree.Size());
+  EXPECT_EQ(std::vector<int>(),
+      FindDifferentNeighbourhoods(&tree, &linear_tree, items, 1.0e-3, 37));
+
+  linear_tree.SetNodeLayout(HOTNodeLayout::POINTER);
+  EXPECT_EQ(tree.NumNodes(), linear_tree.NumNodes());
+  EXPECT_EQ(tree.Size(), linear_tree.Size());
+}
+
+TEST(HOTTree, CompactPointerLayoutMatchesPointerLayout) {
+  HOTBoundingBox bbox({{0, 0, 0}, {1, 1, 1}});
+  int num_entities = 5000;
+  auto entities = BuildEntitiesInClustersAndOnCellFaces(bbox, num_entities,
+      5, 1.0e-2, 4);
+  auto items = BuildItems(&entities);
+  HOTTree tree(bbox);
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+  HOTTree compact_tree(bbox);
+  compact_tree.SetNodeLayout(HOTNodeLayout::COMPACT_POINTER);
+  compact_tree.InsertItems(&items[0], &items[0] + 3000);
+  compact_tree.InsertItems(&items[0] + 3000, &items[0] + num_entities);
+
+  EXPECT_EQ(tree.NumNodes(), compact_tree.NumNodes());
+  EXPECT_EQ(tree.Depth(), compact_tree.Depth());
+  EXPECT_EQ(tree.Size() - tree.NumNodes() * sizeof(HOTBoundingBox),
+      compact_tree.Size());
+  EXPECT_EQ(std::vector<int>(),
+      FindDifferentNeighbourhoods(&tree, &compact_tree, items, 1.0e-3, 37));
+}
+
+TEST(HOTTree, NodeTableQueriesMatchTopDownQueries) {
+  HOTBoundingBox bbox({{0, 0, 0}, {1, 1, 1}});
+  int num_entities = 5000;
+  auto entities = BuildEntitiesInClustersAndOnCellFaces(bbox, num_entities,
+      5, 1.0e-2, 4);
+  auto items = BuildItems(&entities);
+  HOTTree tree(bbox);
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+  for (auto layout : {HOTNodeLayout::POINTER, HOTNodeLayout::COMPACT_POINTER,
+        HOTNodeLayout::LINEAR}) {
+    HOTTree table_tree(bbox);
+    table_tree.SetNodeLayout(layout);
+    table_tree.SetUseNodeTable(true);
+    table_tree.InsertItems(&items[0], &items[0] + 3000);
+    table_tree.InsertItems(&items[0] + 3000, &items[0] + num_entities);
+    for (double eps : {1.0e-6, 1.0e-3, 1.0e-1}) {
+      EXPECT_EQ(std::vector<int>(),
+          FindDifferentNeighbourhoods(&tree, &table_tree, items, eps, 37));
+    }
+  }
+}
+
+TEST(HOTTree, HilbertOrderMatchesMortonOrderQueries) {
+  HOTBoundingBox bbox({{0, 0, 0}, {1, 1, 1}});
+  int num_entities = 5000;
+  auto entities = BuildEntitiesInClustersAndOnCellFaces(bbox, num_entities,
+      5, 1.0e-2, 4);
+  auto items = BuildItems(&entities);
+  HOTTree tree(bbox);
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+  for (auto layout : {HOTNodeLayout::POINTER, HOTNodeLayout::COMPACT_POINTER,
+        HOTNodeLayout::LINEAR}) {
+    for (bool use_node_table : {false, true}) {
+      HOTTree hilbert_tree(bbox);
+      hilbert_tree.SetKeyOrder(HOTKeyOrder::HILBERT);
+      hilbert_tree.SetNodeLayout(layout);
+      hilbert_tree.SetUseNodeTable(use_node_table);
+      hilbert_tree.InsertItems(&items[0], &items[0] + 3000);
+      hilbert_tree.InsertItems(&items[0] + 3000, &items[0] + num_entities);
+      // Both orders have the same nodes.
+      EXPECT_EQ(tree.NumNodes(), hilbert_tree.NumNodes());
+      EXPECT_EQ(tree.Depth(), hilbert_tree.Depth());
+      HOTKey previous = 0;
+      for (const HOTItem& item : hilbert_tree) {
+        HOTKey key = HOTComputeHilbertHash(bbox, item.position);
+        EXPECT_LE(previous, key);
+        previous = key;
+      }
+      for (double eps : {1.0e-6, 1.0e-3, 1.0e-1}) {
+        EXPECT_EQ(std::vector<int>(),
+            FindDifferentNeighbourhoods(&tree, &hilbert_tree, items, eps, 37));
+      }
+      // Updates find the leaves of the items by their keys.
+      std::vector<HOTPoint> new_positions;
+      for (int i = 0; i < 100; ++i) {
+        HOTPoint p = items[i].position;
+        new_positions.push_back(HOTPoint({p.x + 1.0e-4, p.y, p.z}));
+      }
+      EXPECT_EQ(100, hilbert_tree.UpdatePositions(&items[0], &items[0] + 100,
+            &new_positions[0]));
+      for (int i = 0; i < 100; ++i) {
+        RecordIdsVisitor visitor;
+        hilbert_tree.VisitNearVertices(&visitor, new_positions[i], 1.0e-9);
+        EXPECT_TRUE(visitor.EntityVisited(entities[i].id));
+      }
+    }
+  }
+}
+
+TEST(HOTTree, QueriesOnCellFacesMatchBruteForce) {
+  // Items and queries on the faces of the cells down to level four, where
+  // the children near a query are decided by exact ties.
+  std::vector<Entity> entities = BuildEntitiesAtRandomLocations(unit_cube(),
+      1000);
+  std::vector<HOTItem> items(BuildItems(&entities));
+  std::srand(7);
+  for (HOTItem& item : items) {
+    item.position = HOTPoint({(std::rand() % 16) / 16.0,
+        (std::rand() % 16) / 16.0, (std::rand() % 16) / 16.0});
+  }
+  for (auto order : {HOTKeyOrder::MORTON, HOTKeyOrder::HILBERT}) {
+    for (auto layout : {HOTNodeLayout::POINTER,
+          HOTNodeLayout::COMPACT_POINTER, HOTNodeLayout::LINEAR}) {
+      HOTTree tree(unit_cube());
+      tree.SetKeyOrder(order);
+      tree.SetNodeLayout(layout);
+      tree.InsertItems(&items[0], &items[0] + items.size());
+      for (double eps : {1.0 / 64, 1.0 / 16, 1.0 / 8}) {
+        for (int i = 0; i < 100; ++i) {
+          HOTPoint p = items[i].position;
+          p.y += 1.0 / 32;
+          RecordIdsVisitor visitor;
+          tree.VisitNearVertices(&visitor, p, eps);
+          std::set<int> expected;
+          for (size_t j = 0; j < items.size(); ++j) {
+            if (LInfinity(items[j].position, p) < eps) {
+              expected.insert(entities[j].id);
+            }
+          }
+          EXPECT_EQ(expected, visitor.ids);
+        }
+      }
+    }
+  }
+}
+
+TEST(HOTTree, DepthIsLimitedByKeyWidth) {
+  HOTBoundingBox bbox({{0, 0, 0}, {1, 1, 1}});
+  HOTTree tree(bbox);
+  int num_entities = 100;
+  auto entities = BuildEntitiesAtRandomLocations(bbox, num_entities);
+  auto items = BuildItems(&entities);
+  for (auto& item : items) {
+    item.position = HOTPoint({0.3, 0.6, 0.7});
+  }
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+  EXPECT_EQ(HOT_BITS_PER_DIM + 1, tree.Depth());
+}
+
 TEST(HOTTree, VertexInNeighbouringNodeIsVisited) {
   HOTTree tree = ConstructTreeWithRandomItems(unit_cube(), 100);
   double eps = 1.0e-10;
@@ -182,6 +680,229 @@ TEST(HOTTree, VisitEachVerticesNeighbours) {
   EXPECT_GE(counter.count_, 0);
 }
 
+TEST(HOTTree, PeriodicDomainFindsNeighboursAcrossFaces) {
+  HOTBoundingBox bbox({{0, 0, 0}, {1, 1, 1}});
+  int num_entities = 2000;
+  auto entities = BuildEntitiesAtRandomLocations(bbox, num_entities);
+  auto items = BuildItems(&entities);
+  items[0].position = HOTPoint({0.0005, 0.5, 0.5});
+  items[1].position = HOTPoint({0.9995, 0.5, 0.5});
+  items[2].position = HOTPoint({0.0001, 0.0001, 0.0001});
+  items[3].position = HOTPoint({1, 1, 1});
+  // Stored folded back into bbox.
+  items[4].position = HOTPoint({1.25, -0.75, 2.5});
+  for (HOTNodeLayout layout : {HOTNodeLayout::POINTER,
+        HOTNodeLayout::COMPACT_POINTER, HOTNodeLayout::LINEAR}) {
+    HOTTree tree(bbox);
+    tree.SetNodeLayout(layout);
+    tree.SetDomainMode(HOTDomainMode::PERIODIC);
+    tree.InsertItems(&items[0], &items[0] + num_entities);
+    for (const HOTItem& item : tree) {
+      EXPECT_EQ(0, LInfinity(bbox, item.position));
+    }
+    double eps = 1.0e-3;
+    for (int i = 0; i < num_entities; i += 37) {
+      RecordIdsVisitor visitor;
+      tree.VisitNearVertices(&visitor, items[i].position, eps);
+      std::set<int> expected;
+      for (int j = 0; j < num_entities; ++j) {
+        if (PeriodicLInfinity(bbox, items[i].position, items[j].position) < eps) {
+          expected.insert(entities[j].id);
+        }
+      }
+      EXPECT_EQ(expected, visitor.ids) << i;
+    }
+    std::vector<HOTPoint> points;
+    for (int i = 0; i < num_entities; i += 37) {
+      points.push_back(items[i].position);
+    }
+    RecordBatchIdsVisitor batch_visitor(points.size());
+    tree.VisitNearVerticesBatch(&batch_visitor, &points[0], points.size(), eps);
+    for (size_t i = 0; i < points.size(); ++i) {
+      RecordIdsVisitor visitor;
+      tree.VisitNearVertices(&visitor, points[i], eps);
+      EXPECT_EQ(visitor.ids, batch_visitor.ids[i]) << i;
+    }
+    RecordIdsVisitor visitor;
+    tree.VisitNearVertices(&visitor, HOTPoint({0.25, 0.25, 0.5}), eps);
+    EXPECT_TRUE(visitor.EntityVisited(entities[4].id));
+    EXPECT_EQ(1, tree.RemoveItems(&items[4], &items[5]));
+  }
+}
+
+TEST(HOTTree, PeriodicDomainKNearestFindsNeighboursAcrossFaces) {
+  HOTBoundingBox bbox({{0, 0, 0}, {1, 1, 1}});
+  int num_entities = 2000;
+  auto entities = BuildEntitiesAtRandomLocations(bbox, num_entities);
+  auto items = BuildItems(&entities);
+  items[0].position = HOTPoint({0.0005, 0.5, 0.5});
+  items[1].position = HOTPoint({0.9995, 0.5, 0.5});
+  items[2].position = HOTPoint({0.0001, 0.0001, 0.0001});
+  std::vector<HOTPoint> queries;
+  for (int i = 0; i < num_entities; i += 37) {
+    queries.push_back(items[i].position);
+  }
+  queries.push_back(HOTPoint({1.25, -0.75, 2.5}));
+  queries.push_back(HOTPoint({0.9999, 0.9999, 0.9999}));
+  // With fewer items than k every image is searched, and each item must
+  // still be found once.
+  for (int num_items : {num_entities, 5}) {
+    for (HOTNodeLayout layout :
+        {HOTNodeLayout::POINTER, HOTNodeLayout::COMPACT_POINTER,
+          HOTNodeLayout::LINEAR}) {
+      HOTTree tree(bbox);
+      tree.SetNodeLayout(layout);
+      tree.SetDomainMode(HOTDomainMode::PERIODIC);
+      tree.InsertItems(&items[0], &items[0] + num_items);
+      for (const HOTPoint& query : queries) {
+        std::vector<std::pair<double, int>> expected;
+        for (int j = 0; j < num_items; ++j) {
+          expected.push_back(std::make_pair(
+                PeriodicLInfinity(bbox, query, items[j].position),
+                entities[j].id));
+        }
+        std::sort(expected.begin(), expected.end());
+        std::vector<int> expected_ids;
+        for (int j = 0; j < std::min(10, num_items); ++j) {
+          expected_ids.push_back(expected[j].second);
+        }
+        std::vector<HOTItem*> nearest;
+        tree.KNearest(query, 10, &nearest, HOTMetric::LINFINITY);
+        std::vector<int> ids;
+        for (HOTItem* item : nearest) {
+          ids.push_back(static_cast<Entity*>(item->data)->id);
+        }
+        EXPECT_EQ(expected_ids, ids) << num_items;
+      }
+    }
+  }
+}
+
+TEST(HOTTree, ClampedDomainKeepsItemPositions) {
+  HOTBoundingBox bbox({{0, 0, 0}, {1, 1, 1}});
+  int num_entities = 1000;
+  auto entities = BuildEntitiesAtRandomLocations(bbox, num_entities);
+  auto items = BuildItems(&entities);
+  items[0].position = HOTPoint({1.5, 0.5, -0.25});
+  items[1].position = HOTPoint({-0.2, 2, 0.3});
+  HOTTree tree(bbox);
+  tree.SetDomainMode(HOTDomainMode::CLAMPED);
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+  EXPECT_EQ(1, std::count_if(tree.begin(), tree.end(),
+        [](const HOTItem& item) {
+          return item.position.x == 1.5 && item.position.y == 0.5 &&
+            item.position.z == -0.25;
+        }));
+  // Nothing is near the point that item 0 is clamped onto.
+  RecordIdsVisitor clamped_visitor;
+  tree.VisitNearVertices(&clamped_visitor, HOTPoint({1, 0.5, 0}), 1.0e-10);
+  EXPECT_FALSE(clamped_visitor.EntityVisited(entities[0].id));
+  std::vector<HOTItem*> nearest;
+  tree.KNearest(items[0].position, 1, &nearest);
+  ASSERT_EQ(1u, nearest.size());
+  EXPECT_EQ(entities[0].id, static_cast<Entity*>(nearest[0]->data)->id);
+
+  double eps = 0.2;
+  std::vector<HOTPoint> points({items[0].position, items[1].position,
+      HOTPoint({1, 0.5, 0}), HOTPoint({1.4, 0.6, -0.2}),
+      HOTPoint({3, 0.5, -1}), HOTPoint({0.5, 0.5, 0.5})});
+  auto expect_brute_force_ids = [&]() {
+    RecordBatchIdsVisitor batch_visitor(points.size());
+    tree.VisitNearVerticesBatch(&batch_visitor, &points[0], points.size(),
+        eps);
+    for (size_t i = 0; i < points.size(); ++i) {
+      std::set<int> expected_ids;
+      for (const auto& item : items) {
+        if (HOTMetricDistance<HOTMetric::LINFINITY>(item.position,
+              points[i]) < eps) {
+          expected_ids.insert(static_cast<Entity*>(item.data)->id);
+        }
+      }
+      RecordIdsVisitor visitor;
+      tree.VisitNearVertices(&visitor, points[i], eps);
+      EXPECT_EQ(expected_ids, visitor.ids) << i;
+      EXPECT_EQ(expected_ids, batch_visitor.ids[i]) << i;
+    }
+  };
+  expect_brute_force_ids();
+
+  HOTPoint new_position({-2, 0.5, 0.5});
+  EXPECT_EQ(1, tree.UpdatePositions(&items[0], &items[1], &new_position));
+  items[0].position = new_position;
+  RecordIdsVisitor moved_visitor;
+  tree.VisitNearVertices(&moved_visitor, HOTPoint({0, 0.5, 0.5}), 1.0e-10);
+  EXPECT_FALSE(moved_visitor.EntityVisited(entities[0].id));
+  points.push_back(new_position);
+  expect_brute_force_ids();
+}
+
+TEST(HOTTree, OverflowListHoldsItemsOutsideOfTheBox) {
+  HOTBoundingBox bbox({{0, 0, 0}, {1, 1, 1}});
+  int num_entities = 1000;
+  auto entities = BuildEntitiesAtRandomLocations(bbox, num_entities);
+  auto items = BuildItems(&entities);
+  items[0].position = HOTPoint({1.5, 0.5, 0.5});
+  items[1].position = HOTPoint({-0.2, 2, 0.3});
+  items[2].position = HOTPoint({1, 1, 1});
+  double eps = 1.0e-10;
+  for (HOTNodeLayout layout : {HOTNodeLayout::POINTER,
+        HOTNodeLayout::COMPACT_POINTER, HOTNodeLayout::LINEAR}) {
+    HOTTree tree(bbox);
+    tree.SetNodeLayout(layout);
+    tree.SetMaxTombstoneFraction(1.0);
+    // Starts out with nothing but the overflow list.
+    tree.InsertItems(&items[0], &items[0] + 2);
+    EXPECT_EQ(0, tree.NumNodes());
+    tree.InsertItems(&items[2], &items[0] + num_entities);
+    for (int i = 0; i < 10; ++i) {
+      RecordIdsVisitor visitor;
+      tree.VisitNearVertices(&visitor, items[i].position, eps);
+      EXPECT_TRUE(visitor.EntityVisited(entities[i].id)) << i;
+    }
+
+    // Into the box and out of it.
+    std::vector<HOTPoint> new_positions = {
+      HOTPoint({0.5, 0.5, 0.5}), HOTPoint({-0.3, 2, 0.3}),
+      HOTPoint({3, 3, 3})};
+    EXPECT_EQ(3, tree.UpdatePositions(&items[0], &items[3], &new_positions[0]));
+    for (int i = 0; i < 3; ++i) {
+      RecordIdsVisitor visitor;
+      tree.VisitNearVertices(&visitor, new_positions[i], eps);
+      EXPECT_TRUE(visitor.EntityVisited(entities[i].id)) << i;
+      RecordIdsVisitor old_visitor;
+      tree.VisitNearVertices(&old_visitor, items[i].position, eps);
+      EXPECT_FALSE(old_visitor.EntityVisited(entities[i].id)) << i;
+    }
+
+    HOTItem moved{new_positions[2], items[2].data};
+    EXPECT_EQ(1, tree.RemoveItems(&moved, &moved + 1));
+    RecordIdsVisitor visitor;
+    tree.VisitNearVertices(&visitor, new_positions[2], eps);
+    EXPECT_FALSE(visitor.EntityVisited(entities[2].id));
+    tree.Compact();
+    EXPECT_EQ(num_entities - 1, std::distance(tree.begin(), tree.end()));
+  }
+}
+#ifdef HOT_HAVE_TBB
+TEST(HOTTreeParallel, BuildsSameNodesAsHOTTree) {
+  HOTBoundingBox bbox({{0, 0, 0}, {1, 1, 1}});
+  int num_entities = 50000;
+  auto entities = BuildEntitiesInClustersAndOnCellFaces(bbox, num_entities,
+      10, 1.0e-2, 4);
+  auto items = BuildItems(&entities);
+  HOTTree tree(bbox);
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+  HOTTreeParallel parallel_tree(bbox);
+  parallel_tree.InsertItems(&items[0], &items[0] + 30000);
+  parallel_tree.InsertItems(&items[0] + 30000, &items[0] + num_entities);
+  EXPECT_EQ(tree.NumNodes(), parallel_tree.NumNodes());
+  EXPECT_EQ(tree.Depth(), parallel_tree.Depth());
+  EXPECT_EQ(tree.Size(), parallel_tree.Size());
+  EXPECT_EQ(std::vector<int>(),
+      FindDifferentNeighbourhoods(&tree, &parallel_tree, items, 1.0e-3, 101));
+}
+#endif
+
 
 TEST(HOTNodeKey, ZeroIsNotValidNode) {
   EXPECT_FALSE(HOTNodeValidKey(0u));
@@ -211,16 +932,58 @@ TEST(HOTNodeKey, BeginOfRootIsZero) {
   EXPECT_EQ(0u, HOTNodeBegin(HOTNodeRoot()));
 }
 
-TEST(HOTNodeKey, EndOfRootIsTwoToTheThirty) {
-  EXPECT_EQ(1u << (3 * 10), HOTNodeEnd(HOTNodeRoot()));
+TEST(HOTNodeKey, EndOfRootCoversAllKeys) {
+  EXPECT_EQ(HOTKey(1) << (3 * HOT_BITS_PER_DIM), HOTNodeEnd(HOTNodeRoot()));
 }
 
 TEST(HOTNodeKey, BeginSpotChecks) {
-  EXPECT_EQ(1u << (3 * 9), HOTNodeBegin(9u));
-  EXPECT_EQ(2u << (3 * 9), HOTNodeBegin(10u));
-  EXPECT_EQ(3u << (3 * 9), HOTNodeBegin(11u));
-  EXPECT_EQ(1u << (3 * 8), HOTNodeBegin(65u));
-  EXPECT_EQ(10u << (3 * 8), HOTNodeBegin(74u));
+  const int b = HOT_BITS_PER_DIM;
+  EXPECT_EQ(HOTKey(1) << (3 * (b - 1)), HOTNodeBegin(9u));
+  EXPECT_EQ(HOTKey(2) << (3 * (b - 1)), HOTNodeBegin(10u));
+  EXPECT_EQ(HOTKey(3) << (3 * (b - 1)), HOTNodeBegin(11u));
+  EXPECT_EQ(HOTKey(1) << (3 * (b - 2)), HOTNodeBegin(65u));
+  EXPECT_EQ(HOTKey(10) << (3 * (b - 2)), HOTNodeBegin(74u));
+}
+
+TEST(HOTNodeKey, DeepestLevelIsValid) {
+  HOTNodeKey key = HOTNodeKey(1) << (3 * HOT_BITS_PER_DIM);
+  EXPECT_TRUE(HOTNodeValidKey(key));
+  EXPECT_EQ(HOT_BITS_PER_DIM, HOTNodeLevel(key));
+  EXPECT_FALSE(HOTNodeValidKey(key << 1));
+  EXPECT_EQ(HOTNodeBegin(key) + 1, HOTNodeEnd(key));
+}
+TEST(HOTNodeKey, BoundingBoxMatchesChildBoxes) {
+  HOTBoundingBox bbox({{-1, 0, 2}, {1, 4, 3}});
+  HOTNodeKey key = HOTNodeRoot();
+  HOTBoundingBox child_bbox = bbox;
+  int octants[] = {3, 5, 0, 7, 6, 1};
+  for (int octant : octants) {
+    key = (key << 3) + octant;
+    child_bbox = ComputeChildBox(child_bbox, octant);
+    HOTBoundingBox key_bbox = HOTNodeBoundingBox(bbox, key);
+    EXPECT_DOUBLE_EQ(child_bbox.min.x, key_bbox.min.x);
+    EXPECT_DOUBLE_EQ(child_bbox.min.y, key_bbox.min.y);
+    EXPECT_DOUBLE_EQ(child_bbox.min.z, key_bbox.min.z);
+    EXPECT_DOUBLE_EQ(child_bbox.max.x, key_bbox.max.x);
+    EXPECT_DOUBLE_EQ(child_bbox.max.y, key_bbox.max.y);
+    EXPECT_DOUBLE_EQ(child_bbox.max.z, key_bbox.max.z);
+  }
+}
+
+TEST(HOTNodeKey, HilbertBoundingBoxesHoldTheirBuckets) {
+  HOTBoundingBox bbox({{-1, 0, 2}, {1, 4, 3}});
+  auto entities = BuildEntitiesAtRandomLocations(bbox, 100);
+  auto items = BuildItems(&entities);
+  for (const HOTItem& item : items) {
+    HOTKey key = HOTComputeHilbertHash(bbox, item.position);
+    for (int level = 0; level <= HOT_BITS_PER_DIM; ++level) {
+      HOTNodeKey node_key = (HOTNodeKey(1) << (3 * level)) |
+        (key >> (3 * (HOT_BITS_PER_DIM - level)));
+      HOTBoundingBox node_bbox =
+        HOTNodeBoundingBox(bbox, node_key, HOTKeyOrder::HILBERT);
+      EXPECT_EQ(0, LInfinity(node_bbox, item.position)) << level;
+    }
+  }
 }
 
 
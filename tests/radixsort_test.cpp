@@ -0,0 +1,273 @@
+#include <gtest/gtest.h>
+#include <radixsort.h>
+#include <adaptivesort.h>
+#include <merge.h>
+#include <cstdint>
+#include <random>
+#include <algorithm>
+#include <numeric>
+
+#include <hot_config.h>
+#ifdef HOT_HAVE_TBB
+#include <radixsortparallel.h>
+#include <mergeparallel.h>
+#include <tbb/task_arena.h>
+#endif
+
+
+template <typename Key>
+static void ExpectSortedLikeStableSort(std::vector<Key> keys, int num_bits) {
+  std::vector<int> values(keys.size());
+  std::iota(values.begin(), values.end(), 0);
+  std::vector<std::pair<Key, int>> expected;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    expected.push_back({keys[i], values[i]});
+  }
+  std::stable_sort(expected.begin(), expected.end(),
+      [](const std::pair<Key, int>& a, const std::pair<Key, int>& b) {
+        return a.first < b.first;
+      });
+  RadixSortPairs(&keys, &values, num_bits);
+  ASSERT_EQ(expected.size(), keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    EXPECT_EQ(expected[i].first, keys[i]) << i;
+    EXPECT_EQ(expected[i].second, values[i]) << i;
+  }
+}
+
+TEST(RadixSortPairs, EmptyInput) {
+  std::vector<uint32_t> keys;
+  std::vector<int> values;
+  EXPECT_NO_THROW(RadixSortPairs(&keys, &values, 30));
+}
+
+TEST(RadixSortPairs, SortsRandom30BitKeys) {
+  std::mt19937 gen(1);
+  std::uniform_int_distribution<uint32_t> dist(0, (1u << 30) - 1);
+  std::vector<uint32_t> keys(10000);
+  for (auto& k : keys) k = dist(gen);
+  ExpectSortedLikeStableSort(keys, 30);
+}
+
+TEST(RadixSortPairs, SortsRandom63BitKeys) {
+  std::mt19937_64 gen(1);
+  std::uniform_int_distribution<uint64_t> dist(0, (uint64_t(1) << 63) - 1);
+  std::vector<uint64_t> keys(10000);
+  for (auto& k : keys) k = dist(gen);
+  ExpectSortedLikeStableSort(keys, 63);
+}
+
+TEST(RadixSortPairs, IsStableForDuplicateKeys) {
+  std::mt19937 gen(1);
+  std::uniform_int_distribution<uint32_t> dist(0, 7);
+  std::vector<uint32_t> keys(1000);
+  for (auto& k : keys) k = dist(gen) << 20;
+  ExpectSortedLikeStableSort(keys, 30);
+}
+
+TEST(RadixSortPairs, ConstantKeysAreLeftInPlace) {
+  std::vector<uint32_t> keys(100, 12345u);
+  ExpectSortedLikeStableSort(keys, 30);
+}
+
+TEST(RadixPassIsTrivial, DetectsConstantDigit) {
+  std::vector<uint32_t> keys = {3u << 11, 5u << 11, 7u << 11};
+  std::vector<int> counts(RadixNumPasses(30) * RADIX_NUM_BUCKETS);
+  RadixHistograms(&keys[0], keys.size(), 30, &counts[0]);
+  EXPECT_TRUE(RadixPassIsTrivial(&counts[0], keys.size()));
+  EXPECT_FALSE(RadixPassIsTrivial(&counts[RADIX_NUM_BUCKETS], keys.size()));
+  EXPECT_TRUE(RadixPassIsTrivial(&counts[2 * RADIX_NUM_BUCKETS], keys.size()));
+}
+
+TEST(CountDescents, IsZeroForSortedKeys) {
+  std::vector<uint32_t> keys = {1, 2, 2, 5, 9};
+  EXPECT_EQ(0, CountDescents(&keys[0], keys.size()));
+  keys[2] = 7;
+  EXPECT_EQ(1, CountDescents(&keys[0], keys.size()));
+}
+
+static void ExpectMergeSortsLikeRadixSort(const std::vector<uint32_t>& keys) {
+  std::vector<int> values(keys.size());
+  std::iota(values.begin(), values.end(), 0);
+  std::vector<uint32_t> merged_keys;
+  std::vector<int> merged_values;
+  MergeNearlySortedPairs(&keys[0], &values[0], keys.size(), 30,
+      &merged_keys, &merged_values);
+  std::vector<uint32_t> expected_keys(keys);
+  RadixSortPairs(&expected_keys, &values, 30);
+  EXPECT_EQ(expected_keys, merged_keys);
+  for (size_t i = 0; i < keys.size(); ++i) {
+    EXPECT_EQ(keys[merged_values[i]], merged_keys[i]) << i;
+  }
+}
+
+TEST(MergeNearlySortedPairs, SortsLocallyPerturbedKeys) {
+  std::mt19937 gen(1);
+  std::vector<uint32_t> keys(10000);
+  std::iota(keys.begin(), keys.end(), 0u);
+  std::uniform_int_distribution<int> dist(0, keys.size() - 2);
+  for (int i = 0; i < 100; ++i) {
+    int j = dist(gen);
+    std::swap(keys[j], keys[j + 1]);
+  }
+  ExpectMergeSortsLikeRadixSort(keys);
+}
+
+TEST(MergeNearlySortedPairs, SortsKeysWithFarOutliers) {
+  std::vector<uint32_t> keys(1000);
+  std::iota(keys.begin(), keys.end(), 0u);
+  keys[10] = 5000;
+  keys[900] = 3;
+  ExpectMergeSortsLikeRadixSort(keys);
+}
+
+TEST(MergeNearlySortedPairs, SortsReversedKeys) {
+  std::vector<uint32_t> keys(100);
+  std::iota(keys.rbegin(), keys.rend(), 0u);
+  ExpectMergeSortsLikeRadixSort(keys);
+}
+
+// Merges a and b, whose keys are the values modulo 100, and compares with
+// std::stable_sort of the concatenation.
+static void ExpectMergeMatchesStableSort(
+    const std::vector<uint32_t>& a, const std::vector<uint32_t>& b,
+    std::vector<uint32_t>* keys, std::vector<uint32_t>* values) {
+  std::vector<uint32_t> expected(a);
+  expected.insert(expected.end(), b.begin(), b.end());
+  std::stable_sort(expected.begin(), expected.end(),
+      [](uint32_t x, uint32_t y) { return x % 100 < y % 100; });
+  ASSERT_EQ(expected, *values);
+  for (size_t i = 0; i < keys->size(); ++i) {
+    EXPECT_EQ(expected[i] % 100, (*keys)[i]);
+  }
+}
+
+static std::vector<uint32_t> SortedRandomValues(int n, std::mt19937* gen) {
+  std::uniform_int_distribution<uint32_t> dist(0, 99);
+  std::vector<uint32_t> values(n);
+  for (int i = 0; i < n; ++i) {
+    // The value records which input an element came from.
+    values[i] = dist(*gen) + 100 * i;
+  }
+  std::stable_sort(values.begin(), values.end(),
+      [](uint32_t x, uint32_t y) { return x % 100 < y % 100; });
+  return values;
+}
+
+static std::vector<uint32_t> KeysOf(const std::vector<uint32_t>& values) {
+  std::vector<uint32_t> keys;
+  for (auto v : values) keys.push_back(v % 100);
+  return keys;
+}
+
+TEST(MergeSortedPairs, IsStable) {
+  std::mt19937 gen(1);
+  std::vector<uint32_t> a = SortedRandomValues(1000, &gen);
+  std::vector<uint32_t> b = SortedRandomValues(300, &gen);
+  for (auto& v : b) v += 1000000;
+  std::vector<uint32_t> a_keys = KeysOf(a);
+  std::vector<uint32_t> b_keys = KeysOf(b);
+  std::vector<uint32_t> keys(a.size() + b.size());
+  std::vector<uint32_t> values(keys.size());
+  MergeSortedPairs(a_keys.data(), a.data(), a.size(),
+      b_keys.data(), b.data(), b.size(), keys.data(), values.data());
+  ExpectMergeMatchesStableSort(a, b, &keys, &values);
+}
+
+TEST(MergeSortedPairs, HandlesEmptyInputs) {
+  std::vector<uint32_t> a{1, 2, 3};
+  std::vector<uint32_t> keys(3);
+  std::vector<uint32_t> values(3);
+  MergeSortedPairs<uint32_t, uint32_t>(nullptr, nullptr, 0,
+      a.data(), a.data(), a.size(), keys.data(), values.data());
+  EXPECT_EQ(a, keys);
+  MergeSortedPairs<uint32_t, uint32_t>(a.data(), a.data(), a.size(),
+      nullptr, nullptr, 0, keys.data(), values.data());
+  EXPECT_EQ(a, keys);
+}
+
+TEST(MergePathSplit, AgreesWithSerialMerge) {
+  std::vector<uint32_t> a{1, 3, 3, 5, 8};
+  std::vector<uint32_t> b{0, 3, 4, 9};
+  // Stable merge: 0b 1a 3a 3a 3b 4b 5a 8a 9b
+  int expected[] = {0, 0, 1, 2, 3, 3, 3, 4, 5, 5};
+  for (int k = 0; k <= 9; ++k) {
+    EXPECT_EQ(expected[k], MergePathSplit(a.data(), a.size(), b.data(),
+          b.size(), k)) << k;
+  }
+}
+
+#ifdef HOT_HAVE_TBB
+template <typename Key>
+static void ExpectParallelSortMatchesSerialSort(
+    const std::vector<Key>& keys, int num_bits, int num_threads) {
+  std::vector<int> values(keys.size());
+  std::iota(values.begin(), values.end(), 0);
+  std::vector<Key> sorted_keys;
+  std::vector<int> sorted_values;
+  tbb::task_arena arena(num_threads);
+  arena.execute([&]() {
+      ParallelRadixSortPairs(&keys[0], &values[0], keys.size(), num_bits,
+        &sorted_keys, &sorted_values);
+    });
+  std::vector<Key> expected_keys(keys);
+  RadixSortPairs(&expected_keys, &values, num_bits);
+  EXPECT_EQ(expected_keys, sorted_keys);
+  EXPECT_EQ(values, sorted_values);
+}
+
+TEST(ParallelRadixSortPairs, EmptyInput) {
+  std::vector<uint32_t> keys;
+  std::vector<int> values;
+  EXPECT_NO_THROW((ParallelRadixSortPairs<uint32_t, int>(
+        nullptr, nullptr, 0, 30, &keys, &values)));
+  EXPECT_TRUE(keys.empty());
+}
+
+TEST(ParallelRadixSortPairs, MatchesSerialSortWithManyBlocks) {
+  std::mt19937 gen(1);
+  std::uniform_int_distribution<uint32_t> dist(0, (1u << 30) - 1);
+  std::vector<uint32_t> keys(8 * RADIX_MIN_BLOCK_SIZE + 17);
+  for (auto& k : keys) k = dist(gen);
+  for (int num_threads : {1, 3, 8}) {
+    ExpectParallelSortMatchesSerialSort(keys, 30, num_threads);
+  }
+}
+
+TEST(ParallelRadixSortPairs, MatchesSerialSortFor63BitKeys) {
+  std::mt19937_64 gen(1);
+  std::uniform_int_distribution<uint64_t> dist(0, (uint64_t(1) << 63) - 1);
+  std::vector<uint64_t> keys(4 * RADIX_MIN_BLOCK_SIZE);
+  for (auto& k : keys) k = dist(gen);
+  ExpectParallelSortMatchesSerialSort(keys, 63, 4);
+}
+
+TEST(ParallelRadixSortPairs, HandlesDuplicatesAndConstantDigits) {
+  std::mt19937 gen(1);
+  std::uniform_int_distribution<uint32_t> dist(0, 15);
+  std::vector<uint32_t> keys(4 * RADIX_MIN_BLOCK_SIZE);
+  for (auto& k : keys) k = dist(gen) << 12;
+  ExpectParallelSortMatchesSerialSort(keys, 30, 4);
+  std::fill(keys.begin(), keys.end(), 42u);
+  ExpectParallelSortMatchesSerialSort(keys, 30, 4);
+}
+
+TEST(ParallelMergeSortedPairs, MatchesSerialMerge) {
+  std::mt19937 gen(1);
+  std::vector<uint32_t> a = SortedRandomValues(5 * MERGE_MIN_BLOCK_SIZE, &gen);
+  std::vector<uint32_t> b = SortedRandomValues(3 * MERGE_MIN_BLOCK_SIZE + 7, &gen);
+  for (auto& v : b) v += 100 * a.size();
+  std::vector<uint32_t> a_keys = KeysOf(a);
+  std::vector<uint32_t> b_keys = KeysOf(b);
+  for (int num_threads : {1, 3, 8}) {
+    std::vector<uint32_t> keys(a.size() + b.size());
+    std::vector<uint32_t> values(keys.size());
+    tbb::task_arena arena(num_threads);
+    arena.execute([&]() {
+        ParallelMergeSortedPairs(a_keys.data(), a.data(), a.size(),
+          b_keys.data(), b.data(), b.size(), keys.data(), values.data());
+      });
+    ExpectMergeMatchesStableSort(a, b, &keys, &values);
+  }
+}
+#endif
@@ -1,6 +1,8 @@
 #include <test_utilities.h>
 #include <random>
 #include <cassert>
+#include <algorithm>
+#include <cmath>
 
 namespace {
 std::random_device rd;
@@ -21,6 +23,54 @@ std::vector<Entity> BuildEntitiesAtRandomLocations(
   return entities;
 }
 
+std::vector<Entity> BuildEntitiesInClusters(
+    HOTBoundingBox bbox, int n, int num_clusters, double cluster_width) {
+  assert(num_clusters > 0);
+  std::vector<Entity> centers =
+    BuildEntitiesAtRandomLocations(bbox, num_clusters);
+  std::vector<Entity> entities;
+  entities.reserve(n);
+  std::uniform_real_distribution<> offset(
+      -0.5 * cluster_width, 0.5 * cluster_width);
+  for (int i = 0; i < n; ++i) {
+    const HOTPoint& c = centers[i % num_clusters].position;
+    HOTPoint p = {
+      std::min(std::max(c.x + offset(gen), bbox.min.x), bbox.max.x),
+      std::min(std::max(c.y + offset(gen), bbox.min.y), bbox.max.y),
+      std::min(std::max(c.z + offset(gen), bbox.min.z), bbox.max.z)};
+    entities.emplace_back(Entity{p, i});
+  }
+  return entities;
+}
+
+static double NearestCellFace(double min, double max, int level,
+    double x) {
+  double cell_size = (max - min) / (1 << level);
+  return min + std::round((x - min) / cell_size) * cell_size;
+}
+
+std::vector<Entity> BuildEntitiesInClustersAndOnCellFaces(
+    HOTBoundingBox bbox, int n, int num_clusters, double cluster_width,
+    int level) {
+  std::vector<Entity> entities =
+    BuildEntitiesInClusters(bbox, n, num_clusters, cluster_width);
+  for (int i = 0; i < n; ++i) {
+    HOTPoint& p = entities[i].position;
+    switch (i % 4) {
+      case 0:
+        p.x = NearestCellFace(bbox.min.x, bbox.max.x, level, p.x);
+        break;
+      case 1:
+        p.y = NearestCellFace(bbox.min.y, bbox.max.y, level, p.y);
+        break;
+      case 2:
+        p.z = NearestCellFace(bbox.min.z, bbox.max.z, level, p.z);
+        break;
+    }
+  }
+  return entities;
+}
+
 std::vector<HOTItem> BuildItems(std::vector<Entity>* entities) {
   std::vector<HOTItem> items;
   int n = entities->size();
@@ -35,6 +85,42 @@ HOTBoundingBox unit_cube() {
   return HOTBoundingBox({{0, 0, 0}, {1, 1, 1}});
 }
 
+std::vector<int> FindDifferentNeighbourhoods(SpatialSortTree* tree,
+    SpatialSortTree* other, const std::vector<HOTItem>& items, double eps,
+    int step) {
+  std::vector<int> different;
+  for (size_t i = 0; i < items.size(); i += step) {
+    const HOTPoint& position = items[i].position;
+    std::set<int> expected;
+    for (const HOTItem& item : items) {
+      if (LInfinity(item.position, position) < eps) {
+        expected.insert(static_cast<Entity*>(item.data)->id);
+      }
+    }
+    RecordIdsVisitor visitor;
+    RecordIdsVisitor other_visitor;
+    tree->VisitNearVertices(&visitor, position, eps);
+    other->VisitNearVertices(&other_visitor, position, eps);
+    if (visitor.ids != expected || other_visitor.ids != expected) {
+      different.push_back(i);
+    }
+  }
+  return different;
+}
+
+static double PeriodicDistance(double width, double a, double b) {
+  double d = std::fmod(std::fabs(a - b), width);
+  return std::min(d, width - d);
+}
+
+double PeriodicLInfinity(HOTBoundingBox bbox, HOTPoint p, HOTPoint q) {
+  double dist = 0;
+  dist = std::max(dist, PeriodicDistance(bbox.max.x - bbox.min.x, p.x, q.x));
+  dist = std::max(dist, PeriodicDistance(bbox.max.y - bbox.min.y, p.y, q.y));
+  dist = std::max(dist, PeriodicDistance(bbox.max.z - bbox.min.z, p.z, q.z));
+  return dist;
+}
+
 HOTTree ConstructTreeWithRandomItems(HOTBoundingBox bbox, int n) {
   assert(n > 0);
   HOTTree tree(bbox);
@@ -3,7 +3,9 @@
 
 #include <hashedoctree.h>
 #include <stdint.h>
+#include <limits>
 #include <set>
+#include <vector>
 
 
 struct Entity {
@@ -48,9 +50,50 @@ class RecordIdsVisitor : public HOTTree::VertexVisitor {
     std::set<int> ids;
 };
 
+// Records the ids visited for each point of a batch. Stops visiting a point
+// after max_visits visits, by default never.
+class RecordBatchIdsVisitor : public SpatialSortTree::BatchVisitor {
+  public:
+    explicit RecordBatchIdsVisitor(int n,
+        int max_visits = std::numeric_limits<int>::max()) :
+      ids(n), max_visits_(max_visits) {}
+
+    bool Visit(int point, HOTItem* item) override {
+      Entity *entity = static_cast<Entity*>(item->data);
+      if (entity) {
+        ids[point].insert(entity->id);
+      }
+      return static_cast<int>(ids[point].size()) < max_visits_;
+    }
+
+    std::vector<std::set<int>> ids;
+
+  private:
+    int max_visits_;
+};
+
 std::vector<Entity> BuildEntitiesAtRandomLocations(HOTBoundingBox bbox, int n);
+// Entities in num_clusters cubes of side length cluster_width that are
+// centered at random locations in bbox.
+std::vector<Entity> BuildEntitiesInClusters(
+    HOTBoundingBox bbox, int n, int num_clusters, double cluster_width);
+// Entities as in BuildEntitiesInClusters where one coordinate of three out
+// of four entities is moved onto the nearest face of the cells of the given
+// level of bbox. These include the faces of bbox itself.
+std::vector<Entity> BuildEntitiesInClustersAndOnCellFaces(
+    HOTBoundingBox bbox, int n, int num_clusters, double cluster_width,
+    int level);
 std::vector<HOTItem> BuildItems(std::vector<Entity>* entities);
+// Queries both trees within eps of every step-th item and returns the
+// indices of the items for which either tree visits other ids than a brute
+// force search over items. The data of the items are Entities.
+std::vector<int> FindDifferentNeighbourhoods(SpatialSortTree* tree,
+    SpatialSortTree* other, const std::vector<HOTItem>& items, double eps,
+    int step);
 HOTBoundingBox unit_cube();
+// L-infinity distance between p and the nearest periodic image of q for the
+// periodic domain bbox.
+double PeriodicLInfinity(HOTBoundingBox bbox, HOTPoint p, HOTPoint q);
 HOTTree ConstructTreeWithRandomItems(HOTBoundingBox bbox, int n);
 uint64_t rdtsc();
 
@@ -3,6 +3,7 @@
 #include <hashedoctree.h>
 #include <widetree.h>
 #include <test_utilities.h>
+#include <algorithm>
 
 #include <hot_config.h>
 #ifdef HOT_HAVE_TBB
@@ -122,19 +123,319 @@ TEST_P(SpatialSortTreeFixture, VisitEachVerticesNeighbours) {
   EXPECT_GE(counter.count_, 0);
 }
 
+TEST_P(SpatialSortTreeFixture, NeighbourAcrossACornerIsVisitedNextToACluster) {
+  double eps = 1.0e-10;
+  // A cluster fills the far corner of the octant next to the query. Keys of
+  // the query position in that octant select the child holding the cluster.
+  HOTBoundingBox cluster({{0.8, 0.8, 0.8}, {0.95, 0.95, 0.95}});
+  std::vector<Entity> entities = BuildEntitiesAtRandomLocations(cluster, 42);
+  std::vector<HOTItem> items(BuildItems(&entities));
+  items[0].position = HOTPoint({0.5 - 0.1 * eps, 0.5 - 0.1 * eps, 0.5 - 0.1 * eps});
+  items[1].position = HOTPoint({0.5 + 0.1 * eps, 0.5 + 0.1 * eps, 0.5 + 0.1 * eps});
+  SpatialSortTree* tree = GetParam();
+  RecordIdsVisitor visitor;
+  tree->InsertItems(&items[0], &items[0] + items.size());
+  tree->VisitNearVertices(&visitor, items[0].position, eps);
+  EXPECT_TRUE(visitor.EntityVisited(entities[0].id));
+  EXPECT_TRUE(visitor.EntityVisited(entities[1].id));
+}
+
+TEST_P(SpatialSortTreeFixture, CallableQueriesMatchVisitorQueries) {
+  int n = 2000;
+  std::vector<Entity> entities = BuildEntitiesAtRandomLocations(unit_cube(), n);
+  std::vector<HOTItem> items(BuildItems(&entities));
+  items[0].position = HOTPoint({1.01, 0.5, 0.5});
+  SpatialSortTree* tree = GetParam();
+  tree->InsertItems(&items[0], &items[0] + n);
+  HOTBoundingBox query_bbox({{-0.1, -0.1, -0.1}, {1.1, 1.1, 1.1}});
+  std::vector<Entity> queries = BuildEntitiesAtRandomLocations(query_bbox, 200);
+  queries[0].position = HOTPoint({1.0105, 0.5, 0.5});
+  for (double eps : {1.0e-3, 5.0e-2, 0.3}) {
+    for (const Entity& query : queries) {
+      RecordIdsVisitor visitor;
+      EXPECT_TRUE(tree->VisitNearVertices(&visitor, query.position, eps));
+      std::set<int> ids;
+      EXPECT_TRUE(tree->VisitNear(query.position, eps, [&ids](HOTItem* item) {
+          ids.insert(static_cast<Entity*>(item->data)->id);
+          return true;
+        }));
+      EXPECT_EQ(visitor.ids, ids);
+      // Returning false stops the query.
+      size_t num_visits = 0;
+      EXPECT_EQ(ids.empty(), tree->VisitNear(query.position, eps,
+            [&num_visits](HOTItem*) {
+            ++num_visits;
+            return false;
+          }));
+      EXPECT_EQ(std::min<size_t>(1, ids.size()), num_visits);
+    }
+  }
+}
+
+TEST_P(SpatialSortTreeFixture, BatchQueriesMatchSingleQueries) {
+  int n = 2000;
+  std::vector<Entity> entities = BuildEntitiesAtRandomLocations(unit_cube(), n);
+  std::vector<HOTItem> items(BuildItems(&entities));
+  // Items outside of the tree's box.
+  items[0].position = HOTPoint({1.01, 0.5, 0.5});
+  items[1].position = HOTPoint({-0.5, -0.5, 2.0});
+  SpatialSortTree* tree = GetParam();
+  tree->InsertItems(&items[0], &items[0] + n);
+  HOTBoundingBox query_bbox({{-0.1, -0.1, -0.1}, {1.1, 1.1, 1.1}});
+  std::vector<Entity> queries = BuildEntitiesAtRandomLocations(query_bbox, 500);
+  std::vector<HOTPoint> points;
+  for (const Entity& query : queries) {
+    points.push_back(query.position);
+  }
+  points[0] = HOTPoint({1.0105, 0.5, 0.5});
+  points[1] = HOTPoint({5, 5, 5});
+  for (double eps : {1.0e-3, 5.0e-2, 0.3}) {
+    RecordBatchIdsVisitor batch_visitor(points.size());
+    tree->VisitNearVerticesBatch(&batch_visitor, &points[0], points.size(),
+        eps);
+    for (size_t i = 0; i < points.size(); ++i) {
+      RecordIdsVisitor visitor;
+      tree->VisitNearVertices(&visitor, points[i], eps);
+      EXPECT_EQ(visitor.ids, batch_visitor.ids[i]) << i << " " << eps;
+    }
+    EXPECT_EQ(1u, batch_visitor.ids[0].count(entities[0].id));
+    EXPECT_TRUE(batch_visitor.ids[1].empty());
+
+    // Stopping one point's visits doesn't affect the other points.
+    RecordBatchIdsVisitor first_visitor(points.size(), 1);
+    tree->VisitNearVerticesBatch(&first_visitor, &points[0], points.size(),
+        eps);
+    for (size_t i = 0; i < points.size(); ++i) {
+      EXPECT_EQ(std::min<size_t>(1, batch_visitor.ids[i].size()),
+          first_visitor.ids[i].size()) << i << " " << eps;
+    }
+  }
+}
+
+TEST_P(SpatialSortTreeFixture, MetricQueriesMatchBruteForce) {
+  int n = 2000;
+  std::vector<Entity> entities = BuildEntitiesAtRandomLocations(unit_cube(), n);
+  std::vector<HOTItem> items(BuildItems(&entities));
+  items[0].position = HOTPoint({1.01, 0.5, 0.5});
+  // In the corner of the cube around queries[1] for eps = 0.05, but outside
+  // of the ball.
+  items[1].position = HOTPoint({0.56, 0.56, 0.56});
+  SpatialSortTree* tree = GetParam();
+  tree->InsertItems(&items[0], &items[0] + n);
+  HOTBoundingBox query_bbox({{-0.1, -0.1, -0.1}, {1.1, 1.1, 1.1}});
+  std::vector<Entity> queries = BuildEntitiesAtRandomLocations(query_bbox, 100);
+  queries[0].position = HOTPoint({1.0105, 0.5, 0.5});
+  queries[1].position = HOTPoint({0.52, 0.52, 0.52});
+  std::vector<HOTPoint> points;
+  for (const Entity& query : queries) {
+    points.push_back(query.position);
+  }
+  for (HOTMetric metric : {HOTMetric::LINFINITY, HOTMetric::L2,
+        HOTMetric::L1}) {
+    for (double eps : {1.0e-3, 5.0e-2, 0.3}) {
+      RecordBatchIdsVisitor batch_visitor(points.size());
+      tree->VisitNearVerticesBatch(&batch_visitor, &points[0], points.size(),
+          eps, metric);
+      for (size_t i = 0; i < points.size(); ++i) {
+        std::set<int> expected;
+        for (int j = 0; j < n; ++j) {
+          const HOTPoint& p = items[j].position;
+          bool near =
+            metric == HOTMetric::L2 ? L2Squared(p, points[i]) < eps * eps :
+            metric == HOTMetric::L1 ? L1(p, points[i]) < eps :
+            LInfinity(p, points[i]) < eps;
+          if (near) expected.insert(entities[j].id);
+        }
+        RecordIdsVisitor visitor;
+        EXPECT_TRUE(tree->VisitNearVertices(&visitor, points[i], eps,
+              metric));
+        EXPECT_EQ(expected, visitor.ids) << i << " " << eps;
+        EXPECT_EQ(expected, batch_visitor.ids[i]) << i << " " << eps;
+      }
+    }
+  }
+}
+
+TEST_P(SpatialSortTreeFixture, KNearestMatchesBruteForce) {
+  int n = 2000;
+  std::vector<Entity> entities = BuildEntitiesAtRandomLocations(unit_cube(), n);
+  std::vector<HOTItem> items(BuildItems(&entities));
+  items[0].position = HOTPoint({1.01, 0.5, 0.5});
+  SpatialSortTree* tree = GetParam();
+  tree->InsertItems(&items[0], &items[0] + n);
+  HOTBoundingBox query_bbox({{-0.1, -0.1, -0.1}, {1.1, 1.1, 1.1}});
+  std::vector<Entity> queries = BuildEntitiesAtRandomLocations(query_bbox, 50);
+  queries[0].position = HOTPoint({1.0105, 0.5, 0.5});
+  for (HOTMetric metric : {HOTMetric::LINFINITY, HOTMetric::L2,
+        HOTMetric::L1}) {
+    for (int k : {0, 1, 5, 64, n + 1}) {
+      for (const Entity& query : queries) {
+        std::vector<std::pair<double, int>> expected;
+        for (int j = 0; j < n; ++j) {
+          const HOTPoint& p = items[j].position;
+          double distance =
+            metric == HOTMetric::L2 ? L2Squared(p, query.position) :
+            metric == HOTMetric::L1 ? L1(p, query.position) :
+            LInfinity(p, query.position);
+          expected.push_back(std::make_pair(distance, entities[j].id));
+        }
+        std::sort(expected.begin(), expected.end());
+        std::vector<int> expected_ids;
+        for (int j = 0; j < std::min(k, n); ++j) {
+          expected_ids.push_back(expected[j].second);
+        }
+        std::vector<HOTItem*> nearest;
+        tree->KNearest(query.position, k, &nearest, metric);
+        std::vector<int> ids;
+        for (HOTItem* item : nearest) {
+          ids.push_back(static_cast<Entity*>(item->data)->id);
+        }
+        EXPECT_EQ(expected_ids, ids) << query.id << " " << k;
+      }
+    }
+  }
+  HOTTree* hot_tree = dynamic_cast<HOTTree*>(tree);
+  if (!hot_tree) return;
+  int k = 16;
+  std::vector<HOTItem*> nearest_of_items;
+  hot_tree->KNearestOfItems(k, &nearest_of_items);
+  ASSERT_EQ(size_t(n * k), nearest_of_items.size());
+  int i = 0;
+  for (const HOTItem& item : *tree) {
+    std::vector<HOTItem*> nearest;
+    tree->KNearest(item.position, k, &nearest);
+    EXPECT_EQ(nearest, std::vector<HOTItem*>(nearest_of_items.begin() + i * k,
+          nearest_of_items.begin() + (i + 1) * k));
+    ++i;
+  }
+}
+
+TEST_P(SpatialSortTreeFixture, PositionArraysFollowRemovedAndMovedItems) {
+  // RemoveItems, UpdatePositions and Compact aren't part of
+  // SpatialSortTree.
+  SpatialSortTree* tree = GetParam();
+  HOTTree* hot_tree = dynamic_cast<HOTTree*>(tree);
+  WideTree* wide_tree = dynamic_cast<WideTree*>(tree);
+  ASSERT_TRUE(hot_tree || wide_tree);
+  int n = 1000;
+  std::vector<Entity> entities = BuildEntitiesAtRandomLocations(unit_cube(), n);
+  std::vector<HOTItem> items(BuildItems(&entities));
+  std::vector<HOTPoint> new_positions;
+  for (int i = 0; i < 200; ++i) {
+    double d = i < 100 ? 1.0e-6 : 0.3;
+    HOTPoint p = items[i].position;
+    new_positions.push_back(HOTPoint{
+        std::fmod(p.x + d, 1.0), std::fmod(p.y + d, 1.0), p.z});
+  }
+  // Stale positions would turn up as visited tombstones or as moved items
+  // that are missing at their new positions.
+  std::vector<HOTPoint> positions(new_positions);
+  for (int i = 0; i < 300; ++i) {
+    positions.push_back(items[i].position);
+  }
+  // Where the items are, with the removed ones left out.
+  std::vector<HOTItem> expected_items(items);
+  double eps = 1.0e-10;
+  auto expect_brute_force_neighbours = [&]() {
+    for (const HOTPoint& position : positions) {
+      std::set<int> expected;
+      for (const HOTItem& item : expected_items) {
+        if (item.data && LInfinity(item.position, position) < eps) {
+          expected.insert(static_cast<Entity*>(item.data)->id);
+        }
+      }
+      RecordIdsVisitor visitor;
+      tree->VisitNearVertices(&visitor, position, eps);
+      EXPECT_EQ(expected, visitor.ids);
+      std::set<int> ids;
+      tree->VisitNear(position, eps, [&ids](HOTItem* item) {
+          ids.insert(static_cast<Entity*>(item->data)->id);
+          return true;
+        });
+      EXPECT_EQ(expected, ids);
+    }
+  };
+  if (hot_tree) hot_tree->SetMaxTombstoneFraction(1.0);
+  if (wide_tree) wide_tree->SetMaxTombstoneFraction(1.0);
+  tree->InsertItems(&items[0], &items[0] + n);
+  // Enabling position arrays copies the positions of existing items.
+  tree->SetUsePositionArrays(true);
+  expect_brute_force_neighbours();
+  if (hot_tree) hot_tree->RemoveItems(&items[200], &items[300]);
+  if (wide_tree) wide_tree->RemoveItems(&items[200], &items[300]);
+  for (int i = 200; i < 300; ++i) {
+    expected_items[i].data = nullptr;
+  }
+  expect_brute_force_neighbours();
+  // Small moves mostly stay in their leaves, so the tree is updated in
+  // place. The large ones are reinserted.
+  for (int first : {0, 100}) {
+    if (hot_tree) {
+      hot_tree->UpdatePositions(&items[first], &items[first + 100],
+          &new_positions[first]);
+    }
+    if (wide_tree) {
+      wide_tree->UpdatePositions(&items[first], &items[first + 100],
+          &new_positions[first]);
+    }
+    for (int i = first; i < first + 100; ++i) {
+      expected_items[i].position = new_positions[i];
+    }
+    expect_brute_force_neighbours();
+  }
+  if (hot_tree) hot_tree->Compact();
+  if (wide_tree) wide_tree->Compact();
+  expect_brute_force_neighbours();
+}
+
 std::vector<SpatialSortTree*> GetTrees() {
   std::vector<SpatialSortTree*> trees;
   trees.push_back(new HOTTree(unit_cube()));
+  HOTTree* linearHOTTree(new HOTTree(unit_cube()));
+  linearHOTTree->SetNodeLayout(HOTNodeLayout::LINEAR);
+  trees.push_back(linearHOTTree);
+  HOTTree* tableHOTTree(new HOTTree(unit_cube()));
+  tableHOTTree->SetUseNodeTable(true);
+  trees.push_back(tableHOTTree);
+  HOTTree* compactHOTTree(new HOTTree(unit_cube()));
+  compactHOTTree->SetNodeLayout(HOTNodeLayout::COMPACT_POINTER);
+  trees.push_back(compactHOTTree);
+  HOTTree* compactTableHOTTree(new HOTTree(unit_cube()));
+  compactTableHOTTree->SetNodeLayout(HOTNodeLayout::COMPACT_POINTER);
+  compactTableHOTTree->SetUseNodeTable(true);
+  trees.push_back(compactTableHOTTree);
+  HOTTree* hilbertHOTTree(new HOTTree(unit_cube()));
+  hilbertHOTTree->SetKeyOrder(HOTKeyOrder::HILBERT);
+  hilbertHOTTree->SetNodeLayout(HOTNodeLayout::LINEAR);
+  trees.push_back(hilbertHOTTree);
+  HOTTree* positionArraysHOTTree(new HOTTree(unit_cube()));
+  positionArraysHOTTree->SetUsePositionArrays(true);
+  trees.push_back(positionArraysHOTTree);
   trees.push_back(new WideTree(unit_cube()));
   WideTree* anotherWideTree(new WideTree(unit_cube()));
   anotherWideTree->SetMaxNumLeafItems(5);
   trees.push_back(anotherWideTree);
+  for (WideSplit split : {WideSplit::SPLIT_4x4x4, WideSplit::SPLIT_16x16x1,
+        WideSplit::SPLIT_2x2x2, WideSplit::ADAPTIVE}) {
+    WideTree* splitWideTree(new WideTree(unit_cube()));
+    splitWideTree->SetSplit(split);
+    splitWideTree->SetMaxNumLeafItems(5);
+    trees.push_back(splitWideTree);
+  }
+  WideTree* positionArraysWideTree(new WideTree(unit_cube()));
+  positionArraysWideTree->SetMaxNumLeafItems(100);
+  positionArraysWideTree->SetUsePositionArrays(true);
+  trees.push_back(positionArraysWideTree);
 #ifdef HOT_HAVE_TBB
   trees.push_back(new HOTTreeParallel(unit_cube()));
   trees.push_back(new WideTreeParallel(unit_cube()));
   WideTreeParallel* yetAnotherWideTree(new WideTreeParallel(unit_cube()));
   yetAnotherWideTree->SetMaxNumLeafItems(5);
   trees.push_back(yetAnotherWideTree);
+  WideTreeParallel* adaptiveWideTree(new WideTreeParallel(unit_cube()));
+  adaptiveWideTree->SetSplit(WideSplit::ADAPTIVE);
+  adaptiveWideTree->SetMaxNumLeafItems(5);
+  trees.push_back(adaptiveWideTree);
 #endif
   return trees;
 }
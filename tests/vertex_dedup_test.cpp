@@ -5,6 +5,9 @@
 #include <string>
 #include <iostream>
 #include <cassert>
+#include <algorithm>
+#include <list>
+#include <unordered_map>
 #include <hot_config.h>
 #ifdef HOT_HAVE_TBB
 #include <tbb/parallel_for.h>
@@ -19,6 +22,20 @@ struct Configuration {
   int num_iter;
   int num_threads;
   const char* tree_type;
+  const char* distribution;
+  double eps;
+  int k;
+  const char* sort_algorithm;
+  const char* node_layout;
+  bool node_table;
+  bool position_arrays;
+  const char* build_mode;
+  const char* split;
+  const char* domain;
+  const char* domain_mode;
+  const char* key_order;
+  bool cache_misses;
+  bool thread_sweep;
 };
 
 struct TimingResults {
@@ -26,28 +43,51 @@ struct TimingResults {
   double VertexDedup1;
   double BuildTreeFromOrderedItems;
   double VertexDedup2;
+  double VertexDedupBatch;
+  double KNearest;
+  double KNearestOfItems;
+  double VertexDedupCallable;
   double ParallelVertexDedup;
 };
 
 Configuration parse_command_line(int argn, char **argv);
-std::unique_ptr<SpatialSortTree> BuildTreeWithRandomItems(HOTBoundingBox bbox, int n, const char* type);
-std::unique_ptr<SpatialSortTree> BuildTreeFromOrderedItems(
-    HOTBoundingBox bbox, const HOTItem* begin, const HOTItem* end, const char* type);
-void VertexDedup(SpatialSortTree* tree);
+std::vector<Entity> BuildEntities(HOTBoundingBox bbox, const Configuration& conf);
+std::unique_ptr<SpatialSortTree> BuildTreeWithRandomItems(HOTBoundingBox bbox,
+    const Configuration& conf);
+std::unique_ptr<SpatialSortTree> BuildTreeFromOrderedItems(HOTBoundingBox bbox,
+    const HOTItem* begin, const HOTItem* end, const Configuration& conf);
+void VertexDedup(SpatialSortTree* tree, double eps);
+void VertexDedupBatch(SpatialSortTree* tree, double eps);
+void VertexDedupCallable(SpatialSortTree* tree, double eps);
+void KNearestNeighbours(SpatialSortTree* tree, int k);
+void KNearestOfItems(HOTTree* tree, int k);
+void PrintCacheMisses(SpatialSortTree* tree, double eps);
 #ifdef HOT_HAVE_TBB
-void ParallelVertexDedup(SpatialSortTree* tree);
+void ParallelVertexDedup(SpatialSortTree* tree, double eps);
+void ThreadSweep(const Configuration& conf);
 #endif
-std::unique_ptr<SpatialSortTree> TreeFromType(const HOTBoundingBox& bbox, const char* type);
+std::unique_ptr<SpatialSortTree> TreeFromType(const HOTBoundingBox& bbox,
+    const Configuration& conf);
+HOTSortAlgorithm SortAlgorithmFromName(const char* name);
+HOTNodeLayout NodeLayoutFromName(const char* name);
+HOTBoundingBox DomainFromName(const char* name);
+HOTDomainMode DomainModeFromName(const char* name);
+HOTKeyOrder KeyOrderFromName(const char* name);
+const char* SortPathName(HOTSortPath path);
 
 
 int main(int argn, char **argv) {
   Configuration conf = parse_command_line(argn, argv);
 
 #ifdef HOT_HAVE_TBB
+  if (conf.thread_sweep) {
+    ThreadSweep(conf);
+    return 0;
+  }
   tbb::task_scheduler_init scheduler(conf.num_threads);
 #endif
 
-  TimingResults results = {0, 0, 0, 0, 0};
+  TimingResults results = {0, 0, 0, 0, 0, 0, 0, 0, 0};
 
   std::cout.precision(5);
   std::cout << std::scientific;
@@ -57,6 +97,19 @@ int main(int argn, char **argv) {
   std::cout << "  \"num_iter\": " << conf.num_iter << ",\n";
   std::cout << "  \"num_threads\": " << conf.num_threads << ",\n";
   std::cout << "  \"tree_type\": \"" << conf.tree_type << "\",\n";
+  std::cout << "  \"key_bits\": " << 8 * sizeof(HOTKey) << ",\n";
+  std::cout << "  \"distribution\": \"" << conf.distribution << "\",\n";
+  std::cout << "  \"eps\": " << conf.eps << ",\n";
+  std::cout << "  \"k\": " << conf.k << ",\n";
+  std::cout << "  \"sort_algorithm\": \"" << conf.sort_algorithm << "\",\n";
+  std::cout << "  \"node_layout\": \"" << conf.node_layout << "\",\n";
+  std::cout << "  \"node_table\": " << (conf.node_table ? "true" : "false") << ",\n";
+  std::cout << "  \"position_arrays\": " << (conf.position_arrays ? "true" : "false") << ",\n";
+  std::cout << "  \"build_mode\": \"" << conf.build_mode << "\",\n";
+  std::cout << "  \"split\": \"" << conf.split << "\",\n";
+  std::cout << "  \"domain\": \"" << conf.domain << "\",\n";
+  std::cout << "  \"domain_mode\": \"" << conf.domain_mode << "\",\n";
+  std::cout << "  \"key_order\": \"" << conf.key_order << "\",\n";
   for (int i = 0; i < conf.num_iter; ++i) {
 
     std::cout << "  \"iteration " << i << "\": {\n";
@@ -66,47 +119,98 @@ int main(int argn, char **argv) {
     uint64_t start, end;
     start = rdtsc();
     std::unique_ptr<SpatialSortTree> tree =
-        BuildTreeWithRandomItems(unit_cube(), conf.num_vertices, conf.tree_type);
+        BuildTreeWithRandomItems(DomainFromName(conf.domain), conf);
     end = rdtsc();
     std::cout << "      \"ConstructTreeWithRandomItems\": " << (end - start) / 1.0e6 << ",\n";
     results.ConstructTreeWithRandomItems += (end - start) / 1.0e6;
 
     start = rdtsc();
-    VertexDedup(tree.get());
+    VertexDedup(tree.get(), conf.eps);
     end = rdtsc();
     std::cout << "      \"VertexDedup1\":                 " << (end - start) / 1.0e6 << ",\n";
     results.VertexDedup1 += (end - start) / 1.0e6;
 
     start = rdtsc();
     std::unique_ptr<SpatialSortTree> tree2 =
-        BuildTreeFromOrderedItems(unit_cube(), &*tree->begin(), &*tree->end(),
-        conf.tree_type);
+        BuildTreeFromOrderedItems(DomainFromName(conf.domain),
+        &*tree->begin(), &*tree->end(), conf);
     end = rdtsc();
     std::cout << "      \"BuildTreeFromOrderedItems\":    " << (end - start) / 1.0e6 << ",\n";
     results.BuildTreeFromOrderedItems += (end - start) / 1.0e6;
 
     start = rdtsc();
-    VertexDedup(tree2.get());
+    VertexDedup(tree2.get(), conf.eps);
     end = rdtsc();
-    std::cout << "      \"VertexDedup2\":                 " << (end - start) / 1.0e6 << "\n";
+    std::cout << "      \"VertexDedup2\":                 " << (end - start) / 1.0e6 << ",\n";
     results.VertexDedup2 += (end - start) / 1.0e6;
 
+    start = rdtsc();
+    VertexDedupBatch(tree2.get(), conf.eps);
+    end = rdtsc();
+    std::cout << "      \"VertexDedupBatch\":             " << (end - start) / 1.0e6 << ",\n";
+    results.VertexDedupBatch += (end - start) / 1.0e6;
+
+    start = rdtsc();
+    KNearestNeighbours(tree2.get(), conf.k);
+    end = rdtsc();
+    std::cout << "      \"KNearest\":                     " << (end - start) / 1.0e6 << ",\n";
+    results.KNearest += (end - start) / 1.0e6;
+
+    HOTTree* hot_tree2 = dynamic_cast<HOTTree*>(tree2.get());
+    if (hot_tree2) {
+      start = rdtsc();
+      KNearestOfItems(hot_tree2, conf.k);
+      end = rdtsc();
+      std::cout << "      \"KNearestOfItems\":              " << (end - start) / 1.0e6 << ",\n";
+      results.KNearestOfItems += (end - start) / 1.0e6;
+    }
+
+    start = rdtsc();
+    VertexDedupCallable(tree2.get(), conf.eps);
+    end = rdtsc();
+    std::cout << "      \"VertexDedupCallable\":          " << (end - start) / 1.0e6 << "\n";
+    results.VertexDedupCallable += (end - start) / 1.0e6;
+
 #ifdef HOT_HAVE_TBB
     start = rdtsc();
-    ParallelVertexDedup(tree2.get());
+    ParallelVertexDedup(tree2.get(), conf.eps);
     end = rdtsc();
     std::cout << "      \"ParallelVertexDedup\":          " << (end - start) / 1.0e6 << "\n";
     results.ParallelVertexDedup += (end - start) / 1.0e6;
 #endif
 
-    std::cout << "    }\n  }," << std::endl;
+    std::cout << "    }";
+    HOTTree* hot_tree = dynamic_cast<HOTTree*>(tree.get());
+    if (hot_tree && hot_tree2) {
+      std::cout << ",\n    \"sort_paths\": {\n";
+      std::cout << "      \"ConstructTreeWithRandomItems\": \"" <<
+        SortPathName(hot_tree->LastSortPath()) << "\",\n";
+      std::cout << "      \"BuildTreeFromOrderedItems\":    \"" <<
+        SortPathName(hot_tree2->LastSortPath()) << "\"\n";
+      std::cout << "    },\n";
+      std::cout << "    \"size\": " << hot_tree->Size() << ",\n";
+      std::cout << "    \"num_nodes\": " << hot_tree->NumNodes();
+    }
+    WideTree* wide_tree = dynamic_cast<WideTree*>(tree.get());
+    if (wide_tree) {
+      std::cout << ",\n    \"size\": " << wide_tree->SizeInBytes() << ",\n";
+      std::cout << "    \"num_nodes\": " << wide_tree->NumNodes();
+    }
+    if (conf.cache_misses) {
+      PrintCacheMisses(tree2.get(), conf.eps);
+    }
+    std::cout << "\n  }," << std::endl;
   }
 
   std::cout << "  \"totals\": {\n";
   std::cout << "    \"ConstructTreeWithRandomItems\":   " << results.ConstructTreeWithRandomItems << ",\n";
   std::cout << "    \"VertexDedup1\":                   " << results.VertexDedup1 << ",\n";
   std::cout << "    \"BuildTreeFromOrderedItems\":      " << results.BuildTreeFromOrderedItems << ",\n";
-  std::cout << "    \"VertexDedup2\":                   " << results.VertexDedup2 << "\n";
+  std::cout << "    \"VertexDedup2\":                   " << results.VertexDedup2 << ",\n";
+  std::cout << "    \"VertexDedupBatch\":               " << results.VertexDedupBatch << ",\n";
+  std::cout << "    \"KNearest\":                       " << results.KNearest << ",\n";
+  std::cout << "    \"KNearestOfItems\":                " << results.KNearestOfItems << ",\n";
+  std::cout << "    \"VertexDedupCallable\":            " << results.VertexDedupCallable << "\n";
   std::cout << "    \"ParallelVertexDedup\":            " << results.ParallelVertexDedup << "\n";
   std::cout << "  },\n";
 
@@ -114,7 +218,11 @@ int main(int argn, char **argv) {
   std::cout << "    \"ConstructTreeWithRandomItems\":   " << results.ConstructTreeWithRandomItems / conf.num_iter << ",\n";
   std::cout << "    \"VertexDedup1\":                   " << results.VertexDedup1 / conf.num_iter << ",\n";
   std::cout << "    \"BuildTreeFromOrderedItems\":      " << results.BuildTreeFromOrderedItems / conf.num_iter << ",\n";
-  std::cout << "    \"VertexDedup2\":                   " << results.VertexDedup2 / conf.num_iter << "\n";
+  std::cout << "    \"VertexDedup2\":                   " << results.VertexDedup2 / conf.num_iter << ",\n";
+  std::cout << "    \"VertexDedupBatch\":               " << results.VertexDedupBatch / conf.num_iter << ",\n";
+  std::cout << "    \"KNearest\":                       " << results.KNearest / conf.num_iter << ",\n";
+  std::cout << "    \"KNearestOfItems\":                " << results.KNearestOfItems / conf.num_iter << ",\n";
+  std::cout << "    \"VertexDedupCallable\":            " << results.VertexDedupCallable / conf.num_iter << "\n";
   std::cout << "    \"ParallelVertexDedup\":            " << results.ParallelVertexDedup / conf.num_iter << "\n";
   std::cout << "  }\n";
   std::cout << "}\n";
@@ -124,24 +232,36 @@ int main(int argn, char **argv) {
 #endif
 }
 
-std::unique_ptr<SpatialSortTree> BuildTreeWithRandomItems(HOTBoundingBox bbox, int n, const char* type) {
+std::unique_ptr<SpatialSortTree> BuildTreeWithRandomItems(HOTBoundingBox bbox,
+    const Configuration& conf) {
+  int n = conf.num_vertices;
   assert(n > 0);
-  std::unique_ptr<SpatialSortTree> tree = TreeFromType(bbox, type);
-  auto entities = BuildEntitiesAtRandomLocations(bbox, n);
+  std::unique_ptr<SpatialSortTree> tree = TreeFromType(bbox, conf);
+  auto entities = BuildEntities(bbox, conf);
   auto items = BuildItems(&entities);
   tree->InsertItems(&items[0], &items[0] + n);
   return tree;
 }
 
+std::vector<Entity> BuildEntities(HOTBoundingBox bbox, const Configuration& conf) {
+  int n = conf.num_vertices;
+  if (std::string("clustered") == conf.distribution) {
+    // Roughly a thousand vertices per cluster of size 1e-3. That is
+    // about the size of the smallest cells available with 32 bit keys.
+    return BuildEntitiesInClusters(bbox, n, std::max(1, n / 1000), 1.0e-3);
+  } else {
+    return BuildEntitiesAtRandomLocations(bbox, n);
+  }
+}
+
 std::unique_ptr<SpatialSortTree> BuildTreeFromOrderedItems(HOTBoundingBox bbox,
-    const HOTItem* begin, const HOTItem* end, const char* type) {
-  std::unique_ptr<SpatialSortTree> tree = TreeFromType(bbox, type);
+    const HOTItem* begin, const HOTItem* end, const Configuration& conf) {
+  std::unique_ptr<SpatialSortTree> tree = TreeFromType(bbox, conf);
   tree->InsertItems(begin, end);
   return tree;
 }
 
-void VertexDedup(SpatialSortTree* tree) {
-  double eps = 1.0e-3;
+void VertexDedup(SpatialSortTree* tree, double eps) {
   CountVisits counter(nullptr);
   auto item = tree->begin();
   int n = std::distance(tree->begin(), tree->end());
@@ -151,9 +271,167 @@ void VertexDedup(SpatialSortTree* tree) {
   }
 }
 
+// VertexDedupCallable on a tree of type Tree. HOTTree and WideTree inline
+// the node traversal into their VisitNear, SpatialSortTree only the item
+// loop.
+template <typename Tree>
+static void VertexDedupCallableIn(Tree* tree, double eps) {
+  int count = 0;
+  auto item = tree->begin();
+  int n = std::distance(tree->begin(), tree->end());
+  for (int i = 0; i < n; ++i) {
+    void* data = item[i].data;
+    tree->VisitNear(item[i].position, eps, [&count, data](HOTItem* other) {
+        if (other->data != data) {
+          ++count;
+        }
+        return true;
+      });
+  }
+}
+
+// Like VertexDedup but with a lambda instead of a VertexVisitor.
+void VertexDedupCallable(SpatialSortTree* tree, double eps) {
+  HOTTree* hot_tree = dynamic_cast<HOTTree*>(tree);
+  WideTree* wide_tree = dynamic_cast<WideTree*>(tree);
+  if (hot_tree) {
+    VertexDedupCallableIn(hot_tree, eps);
+  } else if (wide_tree) {
+    VertexDedupCallableIn(wide_tree, eps);
+  } else {
+    VertexDedupCallableIn(tree, eps);
+  }
+}
+
+// Counts the visits of vertices excluding the queried vertex itself.
+class CountBatchVisits : public SpatialSortTree::BatchVisitor {
+  public:
+    CountBatchVisits(const HOTItem* items) : count_{0}, items_{items} {}
+    bool Visit(int point, HOTItem* item) override {
+      if (item->data != items_[point].data) {
+        ++count_;
+      }
+      return true;
+    }
+
+    int count_;
+    const HOTItem* items_;
+};
+
+// Like VertexDedup but with all vertices in one batch.
+void VertexDedupBatch(SpatialSortTree* tree, double eps) {
+  auto item = tree->begin();
+  int n = std::distance(tree->begin(), tree->end());
+  std::vector<HOTPoint> points(n);
+  for (int i = 0; i < n; ++i) {
+    points[i] = item[i].position;
+  }
+  CountBatchVisits counter(&item[0]);
+  tree->VisitNearVerticesBatch(&counter, points.data(), n, eps);
+}
+
+// Finds the k nearest neighbours of every item, one query at a time, as
+// for normal estimation.
+void KNearestNeighbours(SpatialSortTree* tree, int k) {
+  auto item = tree->begin();
+  int n = std::distance(tree->begin(), tree->end());
+  std::vector<HOTItem*> nearest;
+  for (int i = 0; i < n; ++i) {
+    tree->KNearest(item[i].position, k, &nearest);
+  }
+}
+
+// Like KNearestNeighbours with the batched query, which runs in parallel
+// for HashedOctreeParallel.
+void KNearestOfItems(HOTTree* tree, int k) {
+  std::vector<HOTItem*> nearest;
+  tree->KNearestOfItems(k, &nearest);
+}
+
+// Fully associative cache with least recently used replacement that counts
+// the misses of the accesses to it.
+class SimulatedCache {
+  public:
+    static const uintptr_t LINE_SIZE = 64;
+
+    SimulatedCache(size_t num_lines) : num_lines_(num_lines), misses_(0) {}
+
+    void Access(const void* p) {
+      uintptr_t line = reinterpret_cast<uintptr_t>(p) / LINE_SIZE;
+      auto position = positions_.find(line);
+      if (position != positions_.end()) {
+        lines_.splice(lines_.begin(), lines_, position->second);
+        return;
+      }
+      ++misses_;
+      if (lines_.size() == num_lines_) {
+        positions_.erase(lines_.back());
+        lines_.pop_back();
+      }
+      lines_.push_front(line);
+      positions_[line] = lines_.begin();
+    }
+
+    size_t Misses() const {
+      return misses_;
+    }
+
+  private:
+    size_t num_lines_;
+    size_t misses_;
+    std::list<uintptr_t> lines_;
+    std::unordered_map<uintptr_t, std::list<uintptr_t>::iterator> positions_;
+};
+
+// Feeds the items visited by the queries into simulated caches of the size
+// of typical L1 and L2 data caches.
+class CacheMissCounter : public HOTTree::VertexVisitor {
+  public:
+    CacheMissCounter() :
+      l1_(32 * 1024 / SimulatedCache::LINE_SIZE),
+      l2_(1024 * 1024 / SimulatedCache::LINE_SIZE), num_visits_(0) {}
+
+    bool Visit(HOTItem* item) override {
+      Access(item);
+      ++num_visits_;
+      return true;
+    }
+
+    // Items can straddle two cache lines.
+    void Access(const HOTItem* item) {
+      const char* begin = reinterpret_cast<const char*>(item);
+      for (const char* p : {begin, begin + sizeof(HOTItem) - 1}) {
+        l1_.Access(p);
+        l2_.Access(p);
+      }
+    }
+
+    SimulatedCache l1_;
+    SimulatedCache l2_;
+    size_t num_visits_;
+};
+
+// Walks the neighbours of the items in tree order like VertexDedup and
+// prints the cache misses on the items. This measures the locality of the
+// item order. Unlike hardware counters, it leaves out the nodes and doesn't
+// depend on the machine.
+void PrintCacheMisses(SpatialSortTree* tree, double eps) {
+  CacheMissCounter counter;
+  auto item = tree->begin();
+  int n = std::distance(tree->begin(), tree->end());
+  for (int i = 0; i < n; ++i) {
+    counter.Access(&item[i]);
+    tree->VisitNearVertices(&counter, item[i].position, eps);
+  }
+  std::cout << ",\n    \"cache_misses\": {\n";
+  std::cout << "      \"visits\": " << counter.num_visits_ << ",\n";
+  std::cout << "      \"32KiB\":  " << counter.l1_.Misses() << ",\n";
+  std::cout << "      \"1MiB\":   " << counter.l2_.Misses() << "\n";
+  std::cout << "    }";
+}
+
 #ifdef HOT_HAVE_TBB
-void ParallelVertexDedup(SpatialSortTree* tree) {
-  double eps = 1.0e-3;
+void ParallelVertexDedup(SpatialSortTree* tree, double eps) {
   auto item = tree->begin();
   int n = std::distance(tree->begin(), tree->end());
   tbb::parallel_for (tbb::blocked_range<int>(0, n, 1 << 10),
@@ -165,6 +443,55 @@ void ParallelVertexDedup(SpatialSortTree* tree) {
       }
     });
 }
+
+// Times InsertItems and ParallelVertexDedup with 1, 2, 4, ... threads up to
+// conf.num_threads.
+void ThreadSweep(const Configuration& conf) {
+  std::vector<int> thread_counts;
+  for (int t = 1; t < conf.num_threads; t *= 2) {
+    thread_counts.push_back(t);
+  }
+  thread_counts.push_back(conf.num_threads);
+
+  auto entities = BuildEntities(DomainFromName(conf.domain), conf);
+  auto items = BuildItems(&entities);
+
+  std::cout.precision(5);
+  std::cout << std::scientific;
+  std::cout << "{\n";
+  std::cout << "  \"num_vertices\": " << conf.num_vertices << ",\n";
+  std::cout << "  \"num_iter\": " << conf.num_iter << ",\n";
+  std::cout << "  \"tree_type\": \"" << conf.tree_type << "\",\n";
+  std::cout << "  \"distribution\": \"" << conf.distribution << "\",\n";
+  std::cout << "  \"sort_algorithm\": \"" << conf.sort_algorithm << "\",\n";
+  std::cout << "  \"thread_sweep\": {\n";
+  for (size_t j = 0; j < thread_counts.size(); ++j) {
+    tbb::task_scheduler_init scheduler(thread_counts[j]);
+    double insert_items = 0;
+    double parallel_vertex_dedup = 0;
+    for (int i = 0; i < conf.num_iter; ++i) {
+      std::unique_ptr<SpatialSortTree> tree =
+        TreeFromType(DomainFromName(conf.domain), conf);
+      uint64_t start, end;
+      start = rdtsc();
+      tree->InsertItems(&items[0], &items[0] + items.size());
+      end = rdtsc();
+      insert_items += (end - start) / 1.0e6;
+
+      start = rdtsc();
+      ParallelVertexDedup(tree.get(), conf.eps);
+      end = rdtsc();
+      parallel_vertex_dedup += (end - start) / 1.0e6;
+    }
+    std::cout << "    \"" << thread_counts[j] << "\": {\n";
+    std::cout << "      \"InsertItems\":         " << insert_items / conf.num_iter << ",\n";
+    std::cout << "      \"ParallelVertexDedup\": " << parallel_vertex_dedup / conf.num_iter << "\n";
+    std::cout << "    }" << (j + 1 < thread_counts.size() ? "," : "") << "\n";
+    scheduler.terminate();
+  }
+  std::cout << "  }\n";
+  std::cout << "}\n";
+}
 #endif
 
 static int find_string(std::string s, int argn, char **argv) {
@@ -180,7 +507,21 @@ static const std::string usage(
     "[--num_vertices num_vertices] "
     "[--num_iter num_iter] "
     "[--num_threads num_threads] "
-    "[--tree_type tree_type"
+    "[--tree_type tree_type] "
+    "[--distribution distribution] "
+    "[--eps eps] "
+    "[--k k] "
+    "[--sort sort_algorithm] "
+    "[--layout node_layout] "
+    "[--node_table] "
+    "[--position_arrays] "
+    "[--build_mode build_mode] "
+    "[--split split] "
+    "[--domain domain] "
+    "[--domain_mode domain_mode] "
+    "[--key_order key_order] "
+    "[--cache_misses] "
+    "[--thread_sweep]"
     "\n\n"
     "Available tree_types:\n"
     "  HashedOctree\n"
@@ -189,6 +530,65 @@ static const std::string usage(
     "  HashedOctreeParallel\n"
     "  WideTreeParallel\n"
 #endif
+    "\n"
+    "Available distributions:\n"
+    "  uniform\n"
+    "  clustered\n"
+    "\n"
+    "Available sort algorithms for HashedOctree trees:\n"
+    "  radix\n"
+    "  comparison\n"
+    "  adaptive\n"
+    "\n"
+    "Available node layouts for HashedOctree trees:\n"
+    "  pointer\n"
+    "  linear\n"
+    "  compact\n"
+    "\n"
+    "--k sets the number of neighbours found per item by KNearest and,\n"
+    "for HashedOctree trees, KNearestOfItems.\n"
+    "\n"
+    "--node_table makes HashedOctree trees start queries from a hash\n"
+    "table lookup of the deepest suitable node.\n"
+    "\n"
+    "--position_arrays makes the trees keep a copy of the item positions\n"
+    "as x, y and z arrays, whose leaf scans test several items at a time.\n"
+    "\n"
+    "Available key orders for HashedOctree trees:\n"
+    "  morton\n"
+    "  hilbert\n"
+    "\n"
+    "--cache_misses walks the neighbours of the items in the order of the\n"
+    "tree built from ordered items and reports the misses of simulated\n"
+    "32 KiB and 1 MiB LRU caches on the items.\n"
+    "\n"
+    "Available build modes for WideTree trees:\n"
+    "  scratch\n"
+    "  ping_pong\n"
+    "\n"
+    "Available splits for WideTree trees:\n"
+    "  8x8x4\n"
+    "  4x4x4\n"
+    "  16x16x1\n"
+    "  2x2x2\n"
+    "  adaptive\n"
+    "\n"
+    "Available domains:\n"
+    "  cube   the unit cube\n"
+    "  slab   [0, 1] x [0, 1] x [0, 0.01]\n"
+    "\n"
+    "Available domain modes:\n"
+    "  overflow\n"
+    "  clamped\n"
+    "  periodic\n"
+#ifdef HOT_HAVE_TBB
+    "\n"
+    "--thread_sweep times InsertItems and ParallelVertexDedup with\n"
+    "1, 2, 4, ... threads up to num_threads.\n"
+#endif
+    "\n"
+    "The key width of the HashedOctree trees is chosen at configure time\n"
+    "with -DHOT_USE_64BIT_KEYS and reported as key_bits.\n"
     );
 
 Configuration parse_command_line(int argn, char **argv) {
@@ -197,6 +597,20 @@ Configuration parse_command_line(int argn, char **argv) {
   conf.num_iter = 10;
   conf.num_threads = 1;
   conf.tree_type = "HashedOctree";
+  conf.distribution = "uniform";
+  conf.eps = 1.0e-3;
+  conf.k = 16;
+  conf.sort_algorithm = "radix";
+  conf.node_layout = "pointer";
+  conf.node_table = false;
+  conf.position_arrays = false;
+  conf.build_mode = "scratch";
+  conf.split = "8x8x4";
+  conf.domain = "cube";
+  conf.domain_mode = "overflow";
+  conf.key_order = "morton";
+  conf.cache_misses = false;
+  conf.thread_sweep = false;
 
   int i;
   i = find_string("--help", argn, argv);
@@ -245,22 +659,236 @@ Configuration parse_command_line(int argn, char **argv) {
     conf.tree_type = argv[i + 1];
   }
 
+  i = find_string("--distribution", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: distribution parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.distribution = argv[i + 1];
+  }
+
+  i = find_string("--eps", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: eps parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.eps = std::stod(std::string(argv[i + 1]));
+  }
+
+  i = find_string("--k", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: k parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.k = std::stoi(std::string(argv[i + 1]));
+  }
+
+  i = find_string("--sort", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: sort algorithm parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.sort_algorithm = argv[i + 1];
+  }
+
+  i = find_string("--layout", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: node layout parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.node_layout = argv[i + 1];
+  }
+
+  i = find_string("--node_table", argn, argv);
+  if (i != argn) {
+    conf.node_table = true;
+  }
+
+  i = find_string("--position_arrays", argn, argv);
+  if (i != argn) {
+    conf.position_arrays = true;
+  }
+
+  i = find_string("--build_mode", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: build mode parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.build_mode = argv[i + 1];
+  }
+
+  i = find_string("--split", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: split parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.split = argv[i + 1];
+  }
+
+  i = find_string("--domain", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: domain parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.domain = argv[i + 1];
+  }
+
+  i = find_string("--domain_mode", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: domain mode parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.domain_mode = argv[i + 1];
+  }
+
+  i = find_string("--key_order", argn, argv);
+  if (i != argn) {
+    if (i == argn - 1) {
+      std::cout << "Error: key order parameter missing." << std::endl;
+      std::cout << usage << std::endl;
+      exit(1);
+    }
+    conf.key_order = argv[i + 1];
+  }
+
+  i = find_string("--cache_misses", argn, argv);
+  if (i != argn) {
+    conf.cache_misses = true;
+  }
+
+  i = find_string("--thread_sweep", argn, argv);
+  if (i != argn) {
+    conf.thread_sweep = true;
+  }
+
   return conf;
 }
 
+HOTSortAlgorithm SortAlgorithmFromName(const char* name) {
+  if (std::string("comparison") == name) {
+    return HOTSortAlgorithm::COMPARISON_SORT;
+  } else if (std::string("adaptive") == name) {
+    return HOTSortAlgorithm::ADAPTIVE_SORT;
+  }
+  return HOTSortAlgorithm::RADIX_SORT;
+}
+
+HOTNodeLayout NodeLayoutFromName(const char* name) {
+  if (std::string("linear") == name) {
+    return HOTNodeLayout::LINEAR;
+  } else if (std::string("compact") == name) {
+    return HOTNodeLayout::COMPACT_POINTER;
+  }
+  return HOTNodeLayout::POINTER;
+}
+
+WideBuildMode BuildModeFromName(const char* name) {
+  if (std::string("ping_pong") == name) {
+    return WideBuildMode::PING_PONG;
+  }
+  return WideBuildMode::SCRATCH;
+}
+
+WideSplit SplitFromName(const char* name) {
+  if (std::string("4x4x4") == name) {
+    return WideSplit::SPLIT_4x4x4;
+  } else if (std::string("16x16x1") == name) {
+    return WideSplit::SPLIT_16x16x1;
+  } else if (std::string("2x2x2") == name) {
+    return WideSplit::SPLIT_2x2x2;
+  } else if (std::string("adaptive") == name) {
+    return WideSplit::ADAPTIVE;
+  }
+  return WideSplit::SPLIT_8x8x4;
+}
+
+HOTBoundingBox DomainFromName(const char* name) {
+  if (std::string("slab") == name) {
+    return HOTBoundingBox({{0, 0, 0}, {1, 1, 0.01}});
+  }
+  return unit_cube();
+}
+
+HOTDomainMode DomainModeFromName(const char* name) {
+  if (std::string("clamped") == name) {
+    return HOTDomainMode::CLAMPED;
+  } else if (std::string("periodic") == name) {
+    return HOTDomainMode::PERIODIC;
+  }
+  return HOTDomainMode::OVERFLOW_LIST;
+}
+
+HOTKeyOrder KeyOrderFromName(const char* name) {
+  if (std::string("hilbert") == name) {
+    return HOTKeyOrder::HILBERT;
+  }
+  return HOTKeyOrder::MORTON;
+}
+
+const char* SortPathName(HOTSortPath path) {
+  switch (path) {
+    case HOTSortPath::ALREADY_SORTED: return "already_sorted";
+    case HOTSortPath::MERGE: return "merge";
+    case HOTSortPath::FULL_SORT: return "full_sort";
+  }
+  return "unknown";
+}
+
 std::unique_ptr<SpatialSortTree> TreeFromType(const HOTBoundingBox& bbox,
-    const char* type) {
+    const Configuration& conf) {
+  const char* type = conf.tree_type;
   if (std::string("HashedOctree") == type) {
-    return std::unique_ptr<SpatialSortTree>(new HOTTree(bbox));
+    HOTTree* tree = new HOTTree(bbox);
+    tree->SetSortAlgorithm(SortAlgorithmFromName(conf.sort_algorithm));
+    tree->SetNodeLayout(NodeLayoutFromName(conf.node_layout));
+    tree->SetUseNodeTable(conf.node_table);
+    tree->SetDomainMode(DomainModeFromName(conf.domain_mode));
+    tree->SetKeyOrder(KeyOrderFromName(conf.key_order));
+    tree->SetUsePositionArrays(conf.position_arrays);
+    return std::unique_ptr<SpatialSortTree>(tree);
   } else if (std::string("WideTree") == type) {
-    return std::unique_ptr<SpatialSortTree>(new WideTree(bbox));
+    WideTree* tree = new WideTree(bbox);
+    tree->SetBuildMode(BuildModeFromName(conf.build_mode));
+    tree->SetSplit(SplitFromName(conf.split));
+    tree->SetDomainMode(DomainModeFromName(conf.domain_mode));
+    tree->SetUsePositionArrays(conf.position_arrays);
+    return std::unique_ptr<SpatialSortTree>(tree);
 #ifdef HOT_HAVE_TBB
   } else if (std::string("HashedOctreeParallel") == type) {
-    return std::unique_ptr<SpatialSortTree>(new HOTTreeParallel(bbox));
+    HOTTreeParallel* tree = new HOTTreeParallel(bbox);
+    tree->SetSortAlgorithm(SortAlgorithmFromName(conf.sort_algorithm));
+    tree->SetNodeLayout(NodeLayoutFromName(conf.node_layout));
+    tree->SetUseNodeTable(conf.node_table);
+    tree->SetDomainMode(DomainModeFromName(conf.domain_mode));
+    tree->SetKeyOrder(KeyOrderFromName(conf.key_order));
+    tree->SetUsePositionArrays(conf.position_arrays);
+    return std::unique_ptr<SpatialSortTree>(tree);
   } else if (std::string("WideTreeParallel") == type) {
-    return std::unique_ptr<SpatialSortTree>(new WideTreeParallel(bbox));
+    WideTreeParallel* tree = new WideTreeParallel(bbox);
+    tree->SetBuildMode(BuildModeFromName(conf.build_mode));
+    tree->SetSplit(SplitFromName(conf.split));
+    tree->SetDomainMode(DomainModeFromName(conf.domain_mode));
+    tree->SetUsePositionArrays(conf.position_arrays);
+    return std::unique_ptr<SpatialSortTree>(tree);
 #endif
   }
   return nullptr;
 }
-
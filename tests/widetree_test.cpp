@@ -1,6 +1,10 @@
 #include <gtest/gtest.h>
 #include <widetree.h>
 #include <test_utilities.h>
+#include <helpers.h>
+#ifdef HOT_HAVE_TBB
+#include <widetreeparallel.h>
+#endif
 
 
 TEST(ComputeWideKey, DoesntCrash) {
@@ -11,6 +15,84 @@ TEST(ComputeWideKey, WorksForOutOfBoundsCoords) {
   EXPECT_NO_THROW(ComputeWideKey(unit_cube(), {-0.5, 10.5, 0.5}));
 }
 
+TEST(ComputeWideKey, UpperFacesBelongToTheLastCell) {
+  EXPECT_EQ(255, ComputeWideKey(unit_cube(), {1, 1, 1}));
+  EXPECT_EQ(7, ComputeWideKey(WideSplit::SPLIT_2x2x2, unit_cube(), {1, 1, 1}));
+}
+
+TEST(ComputeManyWideKeys, MatchesComputeWideKeyForAllSplitsAndKernels) {
+  int n = 1003;
+  auto entities = BuildEntitiesAtRandomLocations(unit_cube(), n);
+  auto items = BuildItems(&entities);
+  items[10].position = HOTPoint({0, 0, 0});
+  items[20].position = HOTPoint({1, 1, 1});
+  items[30].position = HOTPoint({0.5, 0.25, 0.125});
+  for (HOTKeyKernel kernel : {HOTKeyKernel::SCALAR, HOTKeyKernel::AVX2,
+        HOTKeyKernel::AVX512}) {
+    if (!HOTKeyKernelSupported(kernel)) continue;
+    for (WideSplit split : {WideSplit::SPLIT_8x8x4, WideSplit::SPLIT_4x4x4,
+          WideSplit::SPLIT_16x16x1, WideSplit::SPLIT_2x2x2}) {
+      std::vector<uint8_t> keys(n);
+      ComputeManyWideKeys(split, unit_cube(), &items[0].position.x, n, 4,
+          &keys[0], kernel);
+      for (int i = 0; i < n; ++i) {
+        EXPECT_EQ(ComputeWideKey(split, unit_cube(), items[i].position), keys[i])
+          << HOTKeyKernelName(kernel) << " " << static_cast<int>(split)
+          << " " << i;
+      }
+    }
+  }
+}
+
+TEST(ComputeManyWideKeys, CountsLocationsOutsideOfBBox) {
+  int n = 1003;
+  auto entities = BuildEntitiesAtRandomLocations(unit_cube(), n);
+  auto items = BuildItems(&entities);
+  items[10].position = HOTPoint({1, 1, 1});
+  items[20].position = HOTPoint({1.5, 0.5, 0.5});
+  items[1001].position = HOTPoint({0.5, -1.0e-9, 0.5});
+  for (HOTKeyKernel kernel : {HOTKeyKernel::SCALAR, HOTKeyKernel::AVX2,
+        HOTKeyKernel::AVX512}) {
+    if (!HOTKeyKernelSupported(kernel)) continue;
+    std::vector<uint8_t> keys(n);
+    EXPECT_EQ(2, ComputeManyWideKeys(unit_cube(), &items[0].position.x, n, 4,
+          &keys[0], kernel)) << HOTKeyKernelName(kernel);
+    // Clamped onto the box.
+    EXPECT_EQ(ComputeWideKey(unit_cube(), {1, 0.5, 0.5}), keys[20]);
+    EXPECT_EQ(ComputeWideKey(unit_cube(), {0.5, 0, 0.5}), keys[1001]);
+  }
+}
+
+TEST(ChooseWideSplit, PicksCubeShapedCells) {
+  EXPECT_EQ(WideSplit::SPLIT_4x4x4, ChooseWideSplit(unit_cube()));
+  EXPECT_EQ(WideSplit::SPLIT_8x8x4,
+      ChooseWideSplit(HOTBoundingBox({{0, 0, 0}, {1, 1, 0.5}})));
+  EXPECT_EQ(WideSplit::SPLIT_16x16x1,
+      ChooseWideSplit(HOTBoundingBox({{0, 0, 0}, {100, 100, 1}})));
+}
+
+TEST(ChooseWideSplit, DoesntSplitAxesWithoutExtent) {
+  EXPECT_EQ(WideSplit::SPLIT_16x16x1,
+      ChooseWideSplit(HOTBoundingBox({{0, 0, 0.5}, {1, 1, 0.5}})));
+  EXPECT_EQ(WideSplit::SPLIT_16x16x1,
+      ChooseWideSplit(HOTBoundingBox({{0, 0, 0}, {1, 4, 0}})));
+  EXPECT_EQ(WideSplit::SPLIT_8x8x4,
+      ChooseWideSplit(HOTBoundingBox({{0, 0, 0}, {0, 0, 0}})));
+}
+
+TEST(HOTTraversalStack, PopsInReverseOrderAfterGrowing) {
+  HOTTraversalStack<int, 4> stack;
+  for (int i = 0; i < 10; ++i) stack.Push(i);
+  for (int i = 9; i >= 7; --i) EXPECT_EQ(i, stack.Pop());
+  stack.Push(10);
+  EXPECT_EQ(10, stack.Pop());
+  for (int i = 6; i >= 0; --i) {
+    ASSERT_FALSE(stack.Empty());
+    EXPECT_EQ(i, stack.Pop());
+  }
+  EXPECT_TRUE(stack.Empty());
+}
+
 TEST(WideTree, Ctor) {
   WideTree tree(unit_cube());
 }
@@ -31,6 +113,31 @@ TEST(WideTree, SizeGrowsWhenInsertingItems) {
   EXPECT_LT(empty_size, tree.Size());
 }
 
+TEST(WideTree, SizeInBytesGrowsWhenInsertingItems) {
+  HOTBoundingBox bbox({{0, 0, 0}, {1, 1, 1}});
+  WideTree tree(bbox);
+  size_t empty_size = tree.SizeInBytes();
+  int num_entities = 100;
+  auto entities = BuildEntitiesAtRandomLocations(bbox, num_entities);
+  auto items = BuildItems(&entities);
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+  EXPECT_EQ(size_t(num_entities), tree.Size());
+  EXPECT_LT(empty_size + num_entities * sizeof(HOTItem), tree.SizeInBytes());
+}
+
+TEST(WideTree, OnlyNonEmptyCellsHaveChildren) {
+  WideTree tree(unit_cube());
+  tree.SetMaxNumLeafItems(1);
+  std::vector<Entity> entities = BuildEntitiesAtRandomLocations(unit_cube(), 3);
+  std::vector<HOTItem> items = BuildItems(&entities);
+  items[0].position = HOTPoint({0.01, 0.01, 0.01});
+  items[1].position = HOTPoint({0.51, 0.51, 0.51});
+  items[2].position = HOTPoint({0.99, 0.99, 0.99});
+  tree.InsertItems(&items[0], &items[0] + items.size());
+  // The root and one leaf per item.
+  EXPECT_EQ(4, tree.NumNodes());
+}
+
 static WideTree ConstructWideTreeWithRandomItems(HOTBoundingBox bbox, int n) {
   assert(n > 0);
   WideTree tree(bbox);
@@ -76,6 +183,29 @@ TEST(WideTree, VertexInNeighbouringNodeIsVisited) {
   EXPECT_GT(counter.count_, 0);
 }
 
+TEST(WideTree, QueriesNearManyCellsFindAllItems) {
+  int num_entities = 5000;
+  auto entities = BuildEntitiesAtRandomLocations(unit_cube(), num_entities);
+  auto items = BuildItems(&entities);
+  WideTree tree(unit_cube());
+  tree.SetMaxNumLeafItems(1);
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+  // Far more cells than the traversal stack has room for.
+  double eps = 0.45;
+  for (HOTPoint position : {HOTPoint({0.5, 0.5, 0.5}),
+        HOTPoint({0.1, 0.9, 0.3})}) {
+    RecordIdsVisitor visitor;
+    tree.VisitNearVertices(&visitor, position, eps);
+    std::set<int> expected;
+    for (int i = 0; i < num_entities; ++i) {
+      if (LInfinity(items[i].position, position) < eps) {
+        expected.insert(entities[i].id);
+      }
+    }
+    EXPECT_EQ(expected, visitor.ids);
+  }
+}
+
 TEST(WideTree, VertexInNeighbouringNodeIsVisitedForDeepTree) {
   double eps = 1.0e-10;
   int n = 300;
@@ -136,6 +266,181 @@ TEST(WideTree, VertexInNeighbouringNodeIsVisitedForDeepTreeZ) {
   EXPECT_GT(counter.count_, 0);
 }
 
+TEST(WideTree, VerticesInAllCellsAroundACornerAreVisited) {
+  double eps = 1.0e-3;
+  std::vector<Entity> entities = BuildEntitiesAtRandomLocations(unit_cube(), 8);
+  std::vector<HOTItem> items = BuildItems(&entities);
+  // The corner shared by eight cells of the root.
+  HOTPoint corner({0.5, 0.5, 0.5});
+  for (int i = 0; i < 8; ++i) {
+    double dx = (i & 1) ? 0.5 * eps : -0.5 * eps;
+    double dy = (i & 2) ? 0.5 * eps : -0.5 * eps;
+    double dz = (i & 4) ? 0.5 * eps : -0.5 * eps;
+    items[i].position = HOTPoint({corner.x + dx, corner.y + dy, corner.z + dz});
+  }
+  WideTree tree(unit_cube());
+  tree.SetMaxNumLeafItems(1);
+  tree.InsertItems(&items[0], &items[0] + items.size());
+  RecordIdsVisitor visitor;
+  tree.VisitNearVertices(&visitor, corner, eps);
+  for (int i = 0; i < 8; ++i) {
+    EXPECT_TRUE(visitor.EntityVisited(entities[i].id)) << i;
+  }
+}
+
+TEST(WideTree, RemovedItemsAreNotVisited) {
+  int num_entities = 1000;
+  auto entities = BuildEntitiesAtRandomLocations(unit_cube(), num_entities);
+  auto items = BuildItems(&entities);
+  WideTree tree(unit_cube());
+  tree.SetMaxTombstoneFraction(1.0);
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+  EXPECT_EQ(100, tree.RemoveItems(&items[0], &items[0] + 100));
+  EXPECT_EQ(0, tree.RemoveItems(&items[0], &items[0] + 100));
+  EXPECT_EQ(100u, tree.NumTombstones());
+  for (int i = 0; i < 200; ++i) {
+    RecordIdsVisitor visitor;
+    tree.VisitNearVertices(&visitor, items[i].position, 1.0e-10);
+    EXPECT_EQ(i >= 100, visitor.EntityVisited(entities[i].id)) << i;
+  }
+
+  tree.Compact();
+  EXPECT_EQ(0u, tree.NumTombstones());
+  EXPECT_EQ(num_entities - 100, std::distance(tree.begin(), tree.end()));
+  for (int i = 100; i < 200; ++i) {
+    RecordIdsVisitor visitor;
+    tree.VisitNearVertices(&visitor, items[i].position, 1.0e-10);
+    EXPECT_TRUE(visitor.EntityVisited(entities[i].id)) << i;
+  }
+}
+
+TEST(WideTree, UpdatedItemsAreFoundAtNewPositions) {
+  int num_entities = 1000;
+  auto entities = BuildEntitiesAtRandomLocations(unit_cube(), num_entities);
+  auto items = BuildItems(&entities);
+  WideTree tree(unit_cube());
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+  int num_moved = 200;
+  std::vector<HOTPoint> new_positions;
+  for (int i = 0; i < num_moved; ++i) {
+    double d = i < num_moved / 2 ? 1.0e-6 : 0.3;
+    HOTPoint p = items[i].position;
+    new_positions.push_back(HOTPoint{
+        std::fmod(p.x + d, 1.0), std::fmod(p.y + d, 1.0), p.z});
+  }
+  EXPECT_EQ(num_moved, tree.UpdatePositions(
+        &items[0], &items[0] + num_moved, &new_positions[0]));
+  double eps = 1.0e-10;
+  for (int i = 0; i < num_moved; ++i) {
+    RecordIdsVisitor visitor;
+    tree.VisitNearVertices(&visitor, new_positions[i], eps);
+    EXPECT_TRUE(visitor.EntityVisited(entities[i].id)) << i;
+    RecordIdsVisitor old_visitor;
+    tree.VisitNearVertices(&old_visitor, items[i].position, eps);
+    EXPECT_FALSE(old_visitor.EntityVisited(entities[i].id)) << i;
+  }
+  // The leaves left by the moved items keep their tombstones.
+  EXPECT_LT(0u, tree.NumTombstones());
+  EXPECT_EQ(num_entities + tree.NumTombstones(),
+      size_t(std::distance(tree.begin(), tree.end())));
+}
+
+TEST(WideTree, ItemsMovedIntoOneLeafSplitIt) {
+  int num_entities = 1000;
+  auto entities = BuildEntitiesAtRandomLocations(unit_cube(), num_entities);
+  auto items = BuildItems(&entities);
+  WideTree tree(unit_cube());
+  tree.SetMaxTombstoneFraction(1.0);
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+  int num_nodes = tree.NumNodes();
+  int num_moved = 100;
+  std::vector<HOTPoint> new_positions;
+  for (int i = 0; i < num_moved; ++i) {
+    new_positions.push_back(HOTPoint{
+        0.5 + 1.0e-4 * i, 0.5 + 1.0e-4 * (i % 7), 0.5});
+  }
+  EXPECT_EQ(num_moved, tree.UpdatePositions(
+        &items[0], &items[0] + num_moved, &new_positions[0]));
+  EXPECT_LT(num_nodes, tree.NumNodes());
+  for (int i = 0; i < num_entities; ++i) {
+    RecordIdsVisitor visitor;
+    HOTPoint position = i < num_moved ? new_positions[i] : items[i].position;
+    tree.VisitNearVertices(&visitor, position, 1.0e-10);
+    EXPECT_TRUE(visitor.EntityVisited(entities[i].id)) << i;
+  }
+}
+
+TEST(WideTree, PingPongBuildMatchesScratchBuild) {
+  int num_entities = 20000;
+  auto entities = BuildEntitiesInClustersAndOnCellFaces(unit_cube(),
+      num_entities, 10, 1.0e-2, 4);
+  auto items = BuildItems(&entities);
+  WideTree tree(unit_cube());
+  tree.SetMaxNumLeafItems(4);
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+  WideTree ping_pong_tree(unit_cube());
+  ping_pong_tree.SetMaxNumLeafItems(4);
+  ping_pong_tree.SetBuildMode(WideBuildMode::PING_PONG);
+  ping_pong_tree.InsertItems(&items[0], &items[0] + num_entities);
+  EXPECT_EQ(tree.NumNodes(), ping_pong_tree.NumNodes());
+  std::vector<HOTItem> tree_items(tree.begin(), tree.end());
+  std::vector<HOTItem> ping_pong_items(ping_pong_tree.begin(), ping_pong_tree.end());
+  ASSERT_EQ(tree_items.size(), ping_pong_items.size());
+  for (size_t i = 0; i < tree_items.size(); ++i) {
+    EXPECT_EQ(tree_items[i].data, ping_pong_items[i].data) << i;
+  }
+  EXPECT_EQ(std::vector<int>(),
+      FindDifferentNeighbourhoods(&tree, &ping_pong_tree, items, 1.0e-3, 101));
+}
+
+TEST(WideTree, AdaptiveSplitFindsAllNeighboursInASlab) {
+  int num_entities = 5000;
+  HOTBoundingBox slab({{0, 0, 0}, {1, 1, 0.01}});
+  auto entities = BuildEntitiesAtRandomLocations(slab, num_entities);
+  auto items = BuildItems(&entities);
+  WideTree tree(slab);
+  tree.SetSplit(WideSplit::ADAPTIVE);
+  tree.SetMaxNumLeafItems(4);
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+  double eps = 2.0e-2;
+  for (int i = 0; i < num_entities; i += 97) {
+    RecordIdsVisitor visitor;
+    tree.VisitNearVertices(&visitor, items[i].position, eps);
+    std::set<int> expected;
+    for (int j = 0; j < num_entities; ++j) {
+      if (LInfinity(items[i].position, items[j].position) < eps) {
+        expected.insert(entities[j].id);
+      }
+    }
+    EXPECT_EQ(expected, visitor.ids) << i;
+  }
+}
+
+TEST(WideTree, AdaptiveSplitFindsAllNeighboursInAPlane) {
+  int num_entities = 5000;
+  HOTBoundingBox plane({{0, 0, 0.5}, {1, 1, 0.5}});
+  auto entities = BuildEntitiesAtRandomLocations(plane, num_entities);
+  auto items = BuildItems(&entities);
+  WideTree tree(plane);
+  tree.SetSplit(WideSplit::ADAPTIVE);
+  tree.SetMaxNumLeafItems(4);
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+  // All items are inside the box, none goes to the overflow list.
+  EXPECT_LT(1, tree.NumNodes());
+  double eps = 2.0e-2;
+  for (int i = 0; i < num_entities; i += 97) {
+    RecordIdsVisitor visitor;
+    tree.VisitNearVertices(&visitor, items[i].position, eps);
+    std::set<int> expected;
+    for (int j = 0; j < num_entities; ++j) {
+      if (LInfinity(items[i].position, items[j].position) < eps) {
+        expected.insert(entities[j].id);
+      }
+    }
+    EXPECT_EQ(expected, visitor.ids) << i;
+  }
+}
+
 TEST(WideTree, SpotCheck) {
   double eps = 1.0e-10;
   int n = 2;
@@ -156,3 +461,175 @@ TEST(WideTree, SpotCheck) {
   EXPECT_GT(counter.count_, 0);
 }
 
+TEST(WideTree, PeriodicDomainFindsNeighboursAcrossFaces) {
+  int num_entities = 2000;
+  auto entities = BuildEntitiesAtRandomLocations(unit_cube(), num_entities);
+  auto items = BuildItems(&entities);
+  items[0].position = HOTPoint({0.0005, 0.5, 0.5});
+  items[1].position = HOTPoint({0.9995, 0.5, 0.5});
+  items[2].position = HOTPoint({0.0001, 0.0001, 0.0001});
+  items[3].position = HOTPoint({1, 1, 1});
+  // Stored folded back into the box.
+  items[4].position = HOTPoint({1.25, -0.75, 2.5});
+  WideTree tree(unit_cube());
+  tree.SetMaxNumLeafItems(4);
+  tree.SetDomainMode(HOTDomainMode::PERIODIC);
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+  for (const HOTItem& item : tree) {
+    EXPECT_EQ(0, LInfinity(unit_cube(), item.position));
+  }
+  double eps = 1.0e-3;
+  for (int i = 0; i < num_entities; i += 37) {
+    RecordIdsVisitor visitor;
+    tree.VisitNearVertices(&visitor, items[i].position, eps);
+    std::set<int> expected;
+    for (int j = 0; j < num_entities; ++j) {
+      if (PeriodicLInfinity(unit_cube(), items[i].position,
+            items[j].position) < eps) {
+        expected.insert(entities[j].id);
+      }
+    }
+    EXPECT_EQ(expected, visitor.ids) << i;
+  }
+  std::vector<HOTPoint> points;
+  for (int i = 0; i < num_entities; i += 37) {
+    points.push_back(items[i].position);
+  }
+  RecordBatchIdsVisitor batch_visitor(points.size());
+  tree.VisitNearVerticesBatch(&batch_visitor, &points[0], points.size(), eps);
+  for (size_t i = 0; i < points.size(); ++i) {
+    RecordIdsVisitor visitor;
+    tree.VisitNearVertices(&visitor, points[i], eps);
+    EXPECT_EQ(visitor.ids, batch_visitor.ids[i]) << i;
+  }
+  RecordIdsVisitor visitor;
+  tree.VisitNearVertices(&visitor, HOTPoint({0.25, 0.25, 0.5}), eps);
+  EXPECT_TRUE(visitor.EntityVisited(entities[4].id));
+  EXPECT_EQ(1, tree.RemoveItems(&items[4], &items[5]));
+}
+
+TEST(WideTree, ClampedDomainKeepsItemPositions) {
+  int num_entities = 1000;
+  auto entities = BuildEntitiesAtRandomLocations(unit_cube(), num_entities);
+  auto items = BuildItems(&entities);
+  items[0].position = HOTPoint({1.5, 0.5, -0.25});
+  items[1].position = HOTPoint({-0.2, 2, 0.3});
+  WideTree tree(unit_cube());
+  tree.SetDomainMode(HOTDomainMode::CLAMPED);
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+  EXPECT_EQ(1, std::count_if(tree.begin(), tree.end(),
+        [](const HOTItem& item) {
+          return item.position.x == 1.5 && item.position.y == 0.5 &&
+            item.position.z == -0.25;
+        }));
+  // Nothing is near the point that item 0 is clamped onto.
+  RecordIdsVisitor clamped_visitor;
+  tree.VisitNearVertices(&clamped_visitor, HOTPoint({1, 0.5, 0}), 1.0e-10);
+  EXPECT_FALSE(clamped_visitor.EntityVisited(entities[0].id));
+  std::vector<HOTItem*> nearest;
+  tree.KNearest(items[0].position, 1, &nearest);
+  ASSERT_EQ(1u, nearest.size());
+  EXPECT_EQ(entities[0].id, static_cast<Entity*>(nearest[0]->data)->id);
+
+  double eps = 0.2;
+  std::vector<HOTPoint> points({items[0].position, items[1].position,
+      HOTPoint({1, 0.5, 0}), HOTPoint({1.4, 0.6, -0.2}),
+      HOTPoint({3, 0.5, -1}), HOTPoint({0.5, 0.5, 0.5})});
+  auto expect_brute_force_ids = [&]() {
+    RecordBatchIdsVisitor batch_visitor(points.size());
+    tree.VisitNearVerticesBatch(&batch_visitor, &points[0], points.size(),
+        eps);
+    for (size_t i = 0; i < points.size(); ++i) {
+      std::set<int> expected_ids;
+      for (const auto& item : items) {
+        if (HOTMetricDistance<HOTMetric::LINFINITY>(item.position,
+              points[i]) < eps) {
+          expected_ids.insert(static_cast<Entity*>(item.data)->id);
+        }
+      }
+      RecordIdsVisitor visitor;
+      tree.VisitNearVertices(&visitor, points[i], eps);
+      EXPECT_EQ(expected_ids, visitor.ids) << i;
+      EXPECT_EQ(expected_ids, batch_visitor.ids[i]) << i;
+    }
+  };
+  expect_brute_force_ids();
+
+  HOTPoint new_position({-2, 0.5, 0.5});
+  EXPECT_EQ(1, tree.UpdatePositions(&items[0], &items[1], &new_position));
+  items[0].position = new_position;
+  RecordIdsVisitor moved_visitor;
+  tree.VisitNearVertices(&moved_visitor, HOTPoint({0, 0.5, 0.5}), 1.0e-10);
+  EXPECT_FALSE(moved_visitor.EntityVisited(entities[0].id));
+  points.push_back(new_position);
+  expect_brute_force_ids();
+}
+
+TEST(WideTree, OverflowListHoldsItemsOutsideOfTheBox) {
+  int num_entities = 1000;
+  auto entities = BuildEntitiesAtRandomLocations(unit_cube(), num_entities);
+  auto items = BuildItems(&entities);
+  items[0].position = HOTPoint({1.5, 0.5, 0.5});
+  items[1].position = HOTPoint({-0.2, 2, 0.3});
+  items[2].position = HOTPoint({1, 1, 1});
+  double eps = 1.0e-10;
+  WideTree tree(unit_cube());
+  tree.SetMaxTombstoneFraction(1.0);
+  // Nothing but the overflow list.
+  tree.InsertItems(&items[0], &items[0] + 2);
+  EXPECT_EQ(0, tree.NumNodes());
+  RecordIdsVisitor overflow_visitor;
+  tree.VisitNearVertices(&overflow_visitor, items[1].position, eps);
+  EXPECT_TRUE(overflow_visitor.EntityVisited(entities[1].id));
+
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+  for (int i = 0; i < 10; ++i) {
+    RecordIdsVisitor visitor;
+    tree.VisitNearVertices(&visitor, items[i].position, eps);
+    EXPECT_TRUE(visitor.EntityVisited(entities[i].id)) << i;
+  }
+
+  // Into the box and out of it.
+  std::vector<HOTPoint> new_positions = {
+    HOTPoint({0.5, 0.5, 0.5}), HOTPoint({-0.3, 2, 0.3}),
+    HOTPoint({3, 3, 3})};
+  EXPECT_EQ(3, tree.UpdatePositions(&items[0], &items[3], &new_positions[0]));
+  for (int i = 0; i < 3; ++i) {
+    RecordIdsVisitor visitor;
+    tree.VisitNearVertices(&visitor, new_positions[i], eps);
+    EXPECT_TRUE(visitor.EntityVisited(entities[i].id)) << i;
+    RecordIdsVisitor old_visitor;
+    tree.VisitNearVertices(&old_visitor, items[i].position, eps);
+    EXPECT_FALSE(old_visitor.EntityVisited(entities[i].id)) << i;
+  }
+
+  HOTItem moved{new_positions[2], items[2].data};
+  EXPECT_EQ(1, tree.RemoveItems(&moved, &moved + 1));
+  RecordIdsVisitor visitor;
+  tree.VisitNearVertices(&visitor, new_positions[2], eps);
+  EXPECT_FALSE(visitor.EntityVisited(entities[2].id));
+  tree.Compact();
+  EXPECT_EQ(num_entities - 1, std::distance(tree.begin(), tree.end()));
+}
+
+
+#ifdef HOT_HAVE_TBB
+TEST(WideTreeParallel, StoresItemsInSameOrderAsWideTree) {
+  int num_entities = 100000;
+  auto entities = BuildEntitiesInClustersAndOnCellFaces(unit_cube(),
+      num_entities, 10, 1.0e-2, 4);
+  auto items = BuildItems(&entities);
+  WideTree tree(unit_cube());
+  tree.InsertItems(&items[0], &items[0] + num_entities);
+  WideTreeParallel parallel_tree(unit_cube());
+  parallel_tree.InsertItems(&items[0], &items[0] + num_entities);
+  std::vector<HOTItem> tree_items(tree.begin(), tree.end());
+  std::vector<HOTItem> parallel_items(parallel_tree.begin(), parallel_tree.end());
+  ASSERT_EQ(tree_items.size(), parallel_items.size());
+  for (size_t i = 0; i < tree_items.size(); ++i) {
+    EXPECT_EQ(tree_items[i].data, parallel_items[i].data) << i;
+  }
+  EXPECT_EQ(std::vector<int>(),
+      FindDifferentNeighbourhoods(&tree, &parallel_tree, items, 1.0e-3, 101));
+}
+#endif